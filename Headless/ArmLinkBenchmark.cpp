@@ -0,0 +1,193 @@
+/**
+ * @file
+ * @section Description
+ *
+ * ArmLinkBenchmark times the control path from the host to the arm with a SimulatedArm on a pseudo-terminal in place of
+ * the arm, so it runs anywhere with no hardware. The host side is what the app runs: ArmLink over a raw, non-blocking
+ * serial device, and FeedingSequence stepped at the app's control rate with its commands aimed by ArmTargeting. It
+ * reports, as JSON:
+ *   round_trip   Time from sending a move to its ack, one command in flight at a time (p50, p95, p99, max).
+ *   throughput   Commands acked per second and bytes sent per second with the pipeline kept full.
+ *   feed_cycle   Time from starting a feed to the sequence finishing, for a mouth that holds still and stays open.
+ *
+ * A pseudo-terminal has no baud rate, so round trip and throughput measure the software at both ends, not the wire; at the
+ * arm's 115200 baud a 16 byte command frame alone takes about 1.4 ms to send.
+ *
+ * It exits with 1 if any command failed or any feed ended early, so it can be run as an automated check.
+ *
+ * Usage: ArmLinkBenchmark [--round-trips N] [--throughput-seconds SECONDS] [--feeds N] [--speed UNITS_PER_SECOND]
+ *                         [--scoop-time SECONDS] [--settle-time SECONDS] [--telemetry-period SECONDS]
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "SimulatedArmEndpoint.hpp"
+#include "ArmProtocol.hpp"
+#include "FeedingSequence.hpp"
+#include "ArmTargeting.hpp"
+#include "StereoFrameGrabber.hpp"
+#include "BenchmarkStatistics.hpp"
+
+// How often the app steps the feeding sequence, in seconds.
+static const double feedingControlPeriod = 0.05;
+
+/**
+ * The host end of the link: a serial device, and the ArmLink writing to and reading from it.
+ */
+class ArmHost
+{
+    int descriptor;
+public:
+    ArmLink link;
+    unsigned long bytesSent;
+
+    ArmHost(int device): descriptor(device),
+        link([this] (const uint8_t *data, size_t length) { writeToArm(data, length); }), bytesSent(0) {}
+
+    void writeToArm(const uint8_t *data, size_t length) {
+        ssize_t written = write(descriptor, data, length);
+        if(written > 0)
+            bytesSent += written; // A short write is a lost frame, which the link sends again
+    }
+
+    /**
+     * Hand the link whatever the arm has sent and let it retransmit, waiting at most until the given time for a reply.
+     */
+    void pump(double until) {
+        struct pollfd readable = {descriptor, POLLIN, 0};
+        int timeout = (int)std::ceil(std::max(0.0, until - StereoFrameGrabber::now())*1000);
+        poll(&readable, 1, timeout);
+        uint8_t buffer[1024];
+        ssize_t length;
+        while((length = read(descriptor, buffer, sizeof(buffer))) > 0)
+            link.receive(buffer, length, StereoFrameGrabber::now());
+        link.poll(StereoFrameGrabber::now());
+    }
+};
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " [--round-trips N] [--throughput-seconds SECONDS] [--feeds N] [--speed UNITS_PER_SECOND]\n"
+              << "       [--scoop-time SECONDS] [--settle-time SECONDS] [--telemetry-period SECONDS]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    unsigned long roundTrips = 200, feeds = 3;
+    double throughputSeconds = 2;
+    SimulatedArm::Configuration configuration;
+    configuration.scoopTime = 0.5; // Keep the feeds short
+
+    for(int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(option == "--round-trips" && hasValue)
+            roundTrips = strtoul(argv[++i], 0, 10);
+        else if(option == "--throughput-seconds" && hasValue)
+            throughputSeconds = atof(argv[++i]);
+        else if(option == "--feeds" && hasValue)
+            feeds = strtoul(argv[++i], 0, 10);
+        else if(hasValue && parseSimulatedArmOption(option, argv[i + 1], configuration))
+            i++;
+        else {
+            printUsage(argv[0]);
+            return option == "--help" ? 0 : 2;
+        }
+    }
+
+    SimulatedArmEndpoint arm(false, configuration);
+    int device = arm.open() ? openSerialDevice(arm.getPath()) : -1;
+    if(device < 0) {
+        std::cerr << "Failed to open a simulated arm" << std::endl;
+        return 1;
+    }
+    arm.start();
+    ArmHost host(device);
+    unsigned long feedsCompleted = 0;
+    uint8_t lastSequence = 0;
+    FeedingSequence *feeding = 0;
+    host.link.onArrived = [&] (uint8_t sequence) {
+        if(feeding && sequence == lastSequence)
+            feeding->armArrived();
+    };
+
+    // Round trip: one move at a time, between two targets so the arm always has somewhere to go.
+    std::vector<double> roundTripTimes;
+    for(unsigned long i = 0; i < roundTrips; i++) {
+        double arguments[ArmProtocol::commandArguments] = {i % 2 ? 5.0 : -5.0, 10, 20, 0, 1};
+        double sent = StereoFrameGrabber::now();
+        host.link.sendMove(arguments, sent);
+        while(!host.link.isIdle() && StereoFrameGrabber::now() - sent < 1.0)
+            host.pump(sent + 1.0);
+        if(host.link.isIdle())
+            roundTripTimes.push_back(StereoFrameGrabber::now() - sent);
+    }
+    std::sort(roundTripTimes.begin(), roundTripTimes.end());
+
+    // Throughput: keep the window and queue full for the whole time.
+    ArmLink::Statistics before = host.link.getStatistics();
+    unsigned long bytesBefore = host.bytesSent;
+    double started = StereoFrameGrabber::now();
+    for(unsigned long i = 0; StereoFrameGrabber::now() - started < throughputSeconds; i++) {
+        double arguments[ArmProtocol::commandArguments] = {i % 2 ? 5.0 : -5.0, 10, 20, 0, 1};
+        if(!host.link.sendMove(arguments, StereoFrameGrabber::now()))
+            host.pump(StereoFrameGrabber::now() + 0.001);
+    }
+    while(!host.link.isIdle() && StereoFrameGrabber::now() - started < throughputSeconds + 1.0)
+        host.pump(StereoFrameGrabber::now() + 0.01);
+    double throughputElapsed = StereoFrameGrabber::now() - started;
+    ArmLink::Statistics after = host.link.getStatistics();
+    double acksPerSecond = (after.acks - before.acks)/throughputElapsed;
+    double bytesPerSecond = (host.bytesSent - bytesBefore)/throughputElapsed;
+
+    // Feed cycle: the sequence the app runs, against a still, open mouth.
+    std::vector<double> feedTimes;
+    FeedingSequence::MouthObservation mouth;
+    mouth.tracked = true;
+    mouth.isOpen = true;
+    mouth.position = Point3d(-13.5, 2.75, -14); // Aims the insert at (5, 10, 28), inside the simulated arm's reach
+    for(unsigned long i = 0; i < feeds; i++) {
+        FeedingSequence sequence;
+        feeding = &sequence;
+        double feedStarted = StereoFrameGrabber::now();
+        FeedingSequence::ArmCommand command = sequence.start(mouth, feedStarted);
+        for(double nextStep = feedStarted; sequence.getPhase() != FeedingSequence::Idle; nextStep += feedingControlPeriod) {
+            double arguments[ArmProtocol::commandArguments];
+            ArmTargeting::commandArguments(command, arguments);
+            if(command.type == FeedingSequence::ScoopCommand)
+                host.link.sendScoop(arguments, StereoFrameGrabber::now(), &lastSequence);
+            else if(command.type == FeedingSequence::InsertCommand || command.type == FeedingSequence::RetrieveCommand)
+                host.link.sendMove(arguments, StereoFrameGrabber::now(), &lastSequence, command.type == FeedingSequence::InsertCommand);
+            while(StereoFrameGrabber::now() < nextStep + feedingControlPeriod)
+                host.pump(nextStep + feedingControlPeriod);
+            command = sequence.update(mouth, StereoFrameGrabber::now());
+        }
+        feeding = 0;
+        if(sequence.getStopReason().empty()) {
+            feedsCompleted++;
+            feedTimes.push_back(StereoFrameGrabber::now() - feedStarted);
+        } else {
+            std::cerr << "Feed stopped: " << sequence.getStopReason() << std::endl;
+        }
+    }
+    std::sort(feedTimes.begin(), feedTimes.end());
+
+    arm.stop();
+    close(device);
+    ArmLink::Statistics link = host.link.getStatistics();
+    SimulatedArm::Statistics simulated = arm.getStatistics();
+    std::cout << "{\n  \"round_trip\": {\"samples\": " << roundTripTimes.size() << ", \"p50_ms\": " << percentile(roundTripTimes, 50)*1000
+              << ", \"p95_ms\": " << percentile(roundTripTimes, 95)*1000 << ", \"p99_ms\": " << percentile(roundTripTimes, 99)*1000
+              << ", \"max_ms\": " << (roundTripTimes.empty() ? 0 : roundTripTimes.back()*1000) << "},\n"
+              << "  \"throughput\": {\"commands_per_second\": " << acksPerSecond << ", \"bytes_per_second\": " << bytesPerSecond << "},\n"
+              << "  \"feed_cycle\": {\"feeds\": " << feeds << ", \"completed\": " << feedsCompleted << ", \"p50_s\": "
+              << percentile(feedTimes, 50) << ", \"max_s\": " << (feedTimes.empty() ? 0 : feedTimes.back()) << "},\n"
+              << "  \"link\": {\"commands_sent\": " << link.commandsSent << ", \"retransmissions\": " << link.retransmissions
+              << ", \"failures\": " << link.failures << ", \"bad_frames\": " << host.link.getBadFrames() << "},\n"
+              << "  \"arm\": {\"commands\": " << simulated.commands << ", \"duplicates\": " << simulated.duplicates << ", \"rejected\": "
+              << simulated.rejected << ", \"arrivals\": " << simulated.arrivals << "}\n}\n";
+    std::cout.flush();
+    bool passed = link.failures == 0 && roundTripTimes.size() == roundTrips && feedsCompleted == feeds;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file
+ * @section Description
+ *
+ * ArmSimulator runs a SimulatedArm on a pseudo-terminal until it is interrupted, so the app or any other host can be pointed
+ * at it in place of the arm's serial port (for the app: defaults write <bundle id> ArmSerialPort PATH, and ArmProtocol binary
+ * unless the simulator is run with --text). It prints the path of the terminal on the first line of stdout, and what the arm
+ * did when it stops.
+ *
+ * Usage: ArmSimulator [--text] [--link PATH] [--speed UNITS_PER_SECOND] [--scoop-time SECONDS] [--settle-time SECONDS]
+ *                     [--telemetry-period SECONDS]
+ *   --text       Speak the old text commands instead of the binary protocol.
+ *   --link PATH  Also make PATH a symbolic link to the terminal, for a path that doesn't change from run to run.
+ */
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <unistd.h>
+#include "SimulatedArmEndpoint.hpp"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt(int) {
+    interrupted = 1;
+}
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " [--text] [--link PATH] [--speed UNITS_PER_SECOND] [--scoop-time SECONDS]\n"
+              << "       [--settle-time SECONDS] [--telemetry-period SECONDS]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    bool text = false;
+    std::string linkPath;
+    SimulatedArm::Configuration configuration;
+
+    for(int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(option == "--text")
+            text = true;
+        else if(option == "--link" && hasValue)
+            linkPath = argv[++i];
+        else if(hasValue && parseSimulatedArmOption(option, argv[i + 1], configuration))
+            i++;
+        else {
+            printUsage(argv[0]);
+            return option == "--help" ? 0 : 2;
+        }
+    }
+
+    SimulatedArmEndpoint endpoint(text, configuration);
+    if(!endpoint.open()) {
+        std::cerr << "Failed to open a pseudo-terminal" << std::endl;
+        return 1;
+    }
+    if(!linkPath.empty()) {
+        unlink(linkPath.c_str());
+        if(symlink(endpoint.getPath().c_str(), linkPath.c_str()) != 0) {
+            std::cerr << "Failed to link " << linkPath << " to " << endpoint.getPath() << std::endl;
+            return 1;
+        }
+    }
+    std::cout << endpoint.getPath() << std::endl;
+
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
+    endpoint.start();
+    while(!interrupted)
+        usleep(100000);
+    endpoint.stop();
+    if(!linkPath.empty())
+        unlink(linkPath.c_str());
+
+    SimulatedArm::Statistics statistics = endpoint.getStatistics();
+    std::cerr << "commands: " << statistics.commands << ", duplicates: " << statistics.duplicates << ", rejected: "
+              << statistics.rejected << ", arrivals: " << statistics.arrivals << ", position reports: "
+              << statistics.positionReports << std::endl;
+    return 0;
+}
@@ -0,0 +1,27 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Summary statistics shared by the headless benchmarks, so they all report their distributions the same way.
+ */
+#ifndef BENCHMARK_STATISTICS_HPP
+#define BENCHMARK_STATISTICS_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+/**
+ * The value below which the given percentage of the sorted samples fall (nearest rank).
+ * @param  sorted  The samples, in ascending order.
+ * @param  percent The percentage, from 0 to 100.
+ * @return         The sample at that rank, or 0 if there are no samples.
+ */
+inline double percentile(const std::vector<double> &sorted, double percent) {
+    if(sorted.empty())
+        return 0;
+    size_t rank = (size_t)std::ceil(percent/100.0*sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+#endif
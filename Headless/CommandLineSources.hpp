@@ -0,0 +1,41 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Helpers shared by the headless tools for opening frame sources named on the command line.
+ */
+#ifndef COMMAND_LINE_SOURCES_HPP
+#define COMMAND_LINE_SOURCES_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <cstdlib>
+#include "FrameSource.hpp"
+using namespace cv;
+
+/**
+ * Draws a bright bar sweeping across a dark frame, so the pipeline can be run with no cameras or recordings at all.
+ */
+inline void drawSyntheticFrame(unsigned long frameIndex, Mat &frame) {
+    frame.setTo(Scalar(40, 40, 40));
+    int x = (int)(frameIndex*8 % frame.cols);
+    rectangle(frame, cv::Point(x, 0), cv::Point(x + 32, frame.rows - 1), Scalar(220, 220, 220), CV_FILLED);
+}
+
+/**
+ * Open a frame source from a command line argument.
+ * @param  description A camera index, a video file, an image sequence pattern (e.g. left_%04d.png) or "synthetic".
+ * @param  frameCount  For synthetic sources, the number of frames to generate, or 0 to never stop.
+ * @return             A new source, to be deleted by the caller.
+ */
+inline FrameSource *openSource(const std::string &description, unsigned long frameCount = 0) {
+    if(description == "synthetic")
+        return new SyntheticFrameSource(cv::Size(640, 480), drawSyntheticFrame, frameCount);
+    if(!description.empty() && description.find_first_not_of("0123456789") == std::string::npos)
+        return new VideoCaptureFrameSource(atoi(description.c_str()));
+    if(description.find('%') != std::string::npos)
+        return ImageSequenceFrameSource::fromPattern(description);
+    return new VideoCaptureFrameSource(description);
+}
+
+#endif
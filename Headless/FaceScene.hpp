@@ -0,0 +1,123 @@
+/**
+ * @file
+ * @section Description
+ *
+ * A photograph of a face placed in front of the calibrated stereo rig and drawn as each camera would see it, so the tracking
+ * pipeline can be run and checked against where the mouth really is without cameras or a person.
+ */
+#ifndef FACE_SCENE_HPP
+#define FACE_SCENE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <cmath>
+#include "MouthPointFinder.hpp"
+#include "ResourceLocator.hpp"
+#include "StereoFrameGrabber.hpp"
+#include "StereoMatcher.hpp"
+using namespace cv;
+
+/**
+ * A photograph of a face moving along a known path in front of the stereo rig, drawn as each camera would see it. Positions are
+ * in the coordinates triangulateSinglePoint gives: the rectified left camera's, in calibration units.
+ */
+class FaceScene
+{
+    Mat face;
+    Point2d mouthInFace; // Where the mouth detector finds the mouth in the photograph, in its pixels.
+    double faceUnitsPerPixel;
+    Mat cameraMatrix[2], distortion[2];
+    Mat rotation[2], translation[2]; // From rectified left camera coordinates to each camera's.
+    Point3d centre;
+    double motion, period, startTime;
+    Scalar background;
+public:
+    /**
+     * Constructor for the FaceScene.
+     * @param photograph   The face.
+     * @param mouth        Where the mouth is in the photograph, in its pixels.
+     * @param faceWidth    How wide the photograph is in the scene.
+     * @param calibration  The locator to find intrinsic.yml and extrinsic.yml with.
+     * @param frameSize    The size of the frames.
+     * @param depth        Distance of the middle of the path from the left camera. The middle is in the centre of the left view.
+     * @param amplitude    How far the mouth moves from the middle along each axis.
+     * @param pathPeriod   Time to go round the path once, in seconds.
+     * Throws FileNotOpenedException if the calibration can't be read.
+     */
+    FaceScene(const Mat &photograph, Point2d mouth, double faceWidth, ResourceLocator &calibration, cv::Size frameSize, double depth,
+              double amplitude, double pathPeriod): face(photograph), mouthInFace(mouth), faceUnitsPerPixel(faceWidth/photograph.cols),
+              motion(amplitude), period(pathPeriod), startTime(StereoFrameGrabber::now()), background(90, 90, 90) {
+        FileStorage intrinsics(calibration.locate("intrinsic", "yml"), CV_STORAGE_READ);
+        FileStorage extrinsics(calibration.locate("extrinsic", "yml"), CV_STORAGE_READ);
+        if(!intrinsics.isOpened() || !extrinsics.isOpened())
+            throw FileNotOpenedException();
+        Mat R, T, R1, R2, P1, P2, Q;
+        intrinsics["M1"] >> cameraMatrix[0];
+        intrinsics["D1"] >> distortion[0];
+        intrinsics["M2"] >> cameraMatrix[1];
+        intrinsics["D2"] >> distortion[1];
+        extrinsics["R"] >> R;
+        extrinsics["T"] >> T;
+        // The same rectification as StereoMatcher, so positions here are in the frame it triangulates in.
+        stereoRectify(cameraMatrix[0], distortion[0], cameraMatrix[1], distortion[1], frameSize, R, T, R1, R2, P1, P2, Q,
+                      CALIB_ZERO_DISPARITY, -1, frameSize);
+        rotation[0] = R1.t();
+        translation[0] = Mat::zeros(3, 1, CV_64F);
+        rotation[1] = R*R1.t();
+        translation[1] = T.clone();
+        centre = Point3d((frameSize.width*0.5 - P1.at<double>(0, 2))/P1.at<double>(0, 0)*depth,
+                         (frameSize.height*0.5 - P1.at<double>(1, 2))/P1.at<double>(1, 1)*depth, depth);
+    }
+
+    /**
+     * Where the mouth is at a time, going round a figure of eight across the view while moving towards and away from the cameras.
+     * @param  time The time, in seconds on StereoFrameGrabber::now().
+     * @return      The mouth centre.
+     */
+    Point3d mouthAt(double time) const {
+        double phase = 2*CV_PI*(time - startTime)/period;
+        return centre + Point3d(sin(phase), sin(2*phase)*0.5, cos(phase))*motion;
+    }
+
+    /**
+     * Draw the scene as one camera sees it now.
+     * @param view  0 for the left camera, 1 for the right.
+     * @param frame The frame to draw into.
+     */
+    void draw(int view, Mat &frame) const {
+        frame.setTo(background);
+        Point3d mouth = mouthAt(StereoFrameGrabber::now());
+        Mat inCamera = rotation[view]*Mat(mouth) + translation[view];
+        double depth = inCamera.at<double>(2);
+        if(depth <= 0)
+            return;
+        std::vector<Point3d> points(1, Point3d(inCamera.at<double>(0), inCamera.at<double>(1), depth));
+        std::vector<Point2d> projected;
+        projectPoints(points, Mat::zeros(3, 1, CV_64F), Mat::zeros(3, 1, CV_64F), cameraMatrix[view], distortion[view], projected);
+        // The face is small against its distance, so it is scaled as a whole; only the mouth is placed through the lens model.
+        double scale = cameraMatrix[view].at<double>(0, 0)*faceUnitsPerPixel/depth;
+        Mat placement = (Mat_<double>(2, 3) << scale, 0, projected[0].x - scale*mouthInFace.x,
+                                               0, scale, projected[0].y - scale*mouthInFace.y);
+        warpAffine(face, frame, placement, frame.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+    }
+};
+
+/**
+ * Find the mouth in the photograph the way the pipeline will, with a margin of background around it so the face detector
+ * sees a whole face.
+ * @return true if a mouth was found, false otherwise.
+ */
+inline bool findMouthInFace(const Mat &face, ResourceLocator *resources, Point2d &mouth) {
+    cv::Size margin(face.cols/2, face.rows/2);
+    Mat canvas(face.rows + 2*margin.height, face.cols + 2*margin.width, face.type(), Scalar(90, 90, 90));
+    face.copyTo(canvas(cv::Rect(margin.width, margin.height, face.cols, face.rows)));
+    MouthPointFinder finder(resources);
+    finder.setTracking(false);
+    bool isOpen = false;
+    if(!finder.detectMouthCentre(canvas, mouth, isOpen))
+        return false;
+    mouth -= Point2d(margin.width, margin.height);
+    return true;
+}
+
+#endif
@@ -0,0 +1,502 @@
+/**
+ * @file
+ * @section Description
+ *
+ * GlassToArmLatency measures the time from a frame being captured to the arm command aimed from it leaving the serial port,
+ * and how far the tracked mouth is from where the mouth really was. It needs no cameras and no arm: a photograph of a face
+ * is moved along a known path in front of the calibrated stereo rig and drawn into synthetic left and right frames, and a
+ * SimulatedArm on a pseudo-terminal stands in for the arm.
+ *
+ * Everything between the two is what the app runs: StereoFrameGrabber and ThreeDMouthLocationFinder (detectMouthCentre in
+ * both views, rectifyPoints and triangulateSinglePoint) on a TrackingLoop, then a control loop stepped at the app's rate that
+ * aims an insert at the newest fix with ArmTargeting, exactly as MouthTrackerAndArmCommander does, and sends it through an
+ * ArmLink (or as a text command with --text). Every fix gets a command, so each command can be traced back to its pair.
+ *
+ * The face is drawn where the path has it at the moment each frame is grabbed, so the capture timestamp of a pair is the
+ * moment its "photons" arrived. The left and right frames are grabbed independently, as the cameras are.
+ *
+ * It reports, as JSON:
+ *   latency          p50, p95, p99 and max of each stage, in ms:
+ *                      capture_to_publish  The tracking pipeline: grab, detection, triangulation, motion model.
+ *                      publish_to_command  Waiting for the control step, then aiming and formatting the command.
+ *                      command_to_serial   Handing the command to the link until its bytes are written.
+ *                      glass_to_serial     Capture to the command leaving the serial port; the headline number.
+ *                      serial_to_ack       The link and the arm; binary protocol only.
+ *                      glass_to_ack        Capture to the arm accepting the command; binary protocol only.
+ *   position_error   In calibration units. fix is each triangulated position against the path at its capture time;
+ *                    aim is each commanded target against the path at the time it was aimed for (now plus the lead time).
+ *   pipeline_stages  Mean and max of the stages traced inside the pipeline (see Trace.hpp).
+ *
+ * A pseudo-terminal has no baud rate; at the arm's 115200 baud a binary command takes another 1.4 ms on the wire and a text
+ * command about 3 ms. The first --warmup seconds are left out, so the face has been found and the rectification maps loaded.
+ *
+ * It exits with 1 if no command reached the serial port, a command failed, or a limit given with --max-latency or --max-error
+ * was broken, so it can be used as the acceptance test for changes to the pipeline; ctest runs it this way on the test face.
+ *
+ * Usage: GlassToArmLatency --face IMAGE [options]
+ *   --face IMAGE              A frontal photograph of a face. The mouth detector must find the mouth in it.
+ *   --face-width UNITS        How wide the photograph is in the scene, in calibration units. Defaults to 16.
+ *   --resources DIR           Directory holding intrinsic.yml, extrinsic.yml and Cascades/. Defaults to the source tree.
+ *   --size WIDTHxHEIGHT       Size of the frames. Defaults to 1280x960.
+ *   --fps RATE                Frames per second from each camera. Defaults to 30.
+ *   --depth UNITS             Distance from the left camera to the middle of the path. Defaults to 60.
+ *   --motion UNITS            How far the mouth moves from the middle of the path along each axis. Defaults to 5.
+ *   --period SECONDS          Time to go round the path once. Defaults to 4.
+ *   --seconds SECONDS         How long to measure for. Defaults to 10.
+ *   --warmup SECONDS          How long to run before measuring. Defaults to 2.
+ *   --control-period SECONDS  Time between control steps. Defaults to the app's 0.05; 0 sends a command as soon as each fix is published.
+ *   --text                    Send the old text commands instead of the binary protocol.
+ *   --max-latency MS          Fail if the p95 glass_to_serial latency is longer than this.
+ *   --max-error UNITS         Fail if the p95 fix error is larger than this.
+ */
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "ThreeDMouthLocationFinder.hpp"
+#include "TrackingLoop.hpp"
+#include "MouthPointFinder.hpp"
+#include "ArmTargeting.hpp"
+#include "ArmProtocol.hpp"
+#include "ResourceLocator.hpp"
+#include "FrameSource.hpp"
+#include "Trace.hpp"
+#include "SimulatedArmEndpoint.hpp"
+#include "FaceScene.hpp"
+#include "BenchmarkStatistics.hpp"
+using namespace cv;
+
+#ifndef IGFS_RESOURCE_DIR
+#define IGFS_RESOURCE_DIR "."
+#endif
+
+/**
+ * When one command passed each point on its way from the camera to the arm, in seconds on StereoFrameGrabber::now().
+ * Points it never reached are 0.
+ */
+struct CommandTiming
+{
+    double captured;
+    double published;
+    double formatted;
+    double written;
+    double acknowledged;
+    CommandTiming(): captured(0), published(0), formatted(0), written(0), acknowledged(0) {}
+};
+
+/**
+ * The host end of the serial link to the simulated arm. It timestamps each command as its bytes are written and as its ack is
+ * read, which happens on a reader thread as it does in the app.
+ */
+class TimedArmHost
+{
+    struct SequenceSlot
+    {
+        long timing; // Index into timings of the command with this sequence number, or -1 if it hasn't been registered yet.
+        double written;
+        double acknowledged;
+        SequenceSlot(): timing(-1), written(0), acknowledged(0) {}
+    };
+
+    int descriptor;
+    std::mutex mutex; // Guards everything below. Never held while calling into link.
+    std::vector<CommandTiming> timings;
+    SequenceSlot slots[256];
+    ArmProtocol::FrameDecoder sent, received;
+    unsigned long replaced;
+    std::thread readerThread;
+    std::atomic<bool> running;
+
+    void writeToArm(const uint8_t *data, size_t length) {
+        double now = StereoFrameGrabber::now(); // Before the write, since the arm can ack before write returns
+        ssize_t written = write(descriptor, data, length); // A short write is a lost frame, which the link sends again
+        if(written <= 0)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        sent.push(data, written);
+        ArmProtocol::Frame frame;
+        while(sent.next(frame)) {
+            SequenceSlot &slot = slots[frame.sequence];
+            if(slot.written > 0)
+                continue; // Sent again
+            slot.written = now;
+            if(slot.timing >= 0)
+                timings[slot.timing].written = now;
+        }
+    }
+
+    void readReplies() {
+        uint8_t buffer[1024];
+        while(running) {
+            struct pollfd readable = {descriptor, POLLIN, 0};
+            poll(&readable, 1, 10);
+            ssize_t length;
+            while((length = ::read(descriptor, buffer, sizeof(buffer))) > 0) {
+                double now = StereoFrameGrabber::now();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    received.push(buffer, length);
+                    ArmProtocol::Frame frame;
+                    while(received.next(frame)) {
+                        if(frame.type != ArmProtocol::AckMessage && frame.type != ArmProtocol::ErrorMessage)
+                            continue;
+                        SequenceSlot &slot = slots[frame.sequence];
+                        if(slot.timing < 0) { // Acked before registerCommand; it picks this up
+                            slot.acknowledged = now;
+                            continue;
+                        }
+                        if(frame.type == ArmProtocol::AckMessage)
+                            timings[slot.timing].acknowledged = now;
+                        slot = SequenceSlot(); // Free for the next command to get this sequence number
+                    }
+                }
+                link.receive(buffer, length, now);
+            }
+        }
+    }
+public:
+    ArmLink link;
+
+    TimedArmHost(int device): descriptor(device), replaced(0), running(false),
+        link([this] (const uint8_t *data, size_t length) { writeToArm(data, length); }) {
+        link.onFailed = [this] (uint8_t sequence) {
+            std::lock_guard<std::mutex> lock(mutex);
+            slots[sequence] = SequenceSlot();
+        };
+    }
+
+    ~TimedArmHost() {
+        stop();
+    }
+
+    void start() {
+        running = true;
+        readerThread = std::thread(&TimedArmHost::readReplies, this);
+    }
+
+    void stop() {
+        running = false;
+        if(readerThread.joinable())
+            readerThread.join();
+    }
+
+    /**
+     * Keep the timing of a command just given to the link, to be filled in as it is written and acked.
+     * @param sequence The sequence number the link gave the command.
+     * @param timing   The timing so far.
+     */
+    void registerCommand(uint8_t sequence, const CommandTiming &timing) {
+        std::lock_guard<std::mutex> lock(mutex);
+        SequenceSlot &slot = slots[sequence];
+        if(slot.timing >= 0) { // A newer target took the place of one still waiting to be sent, and its sequence number
+            timings[slot.timing].written = 0;
+            timings[slot.timing].acknowledged = 0;
+            replaced++;
+        }
+        timings.push_back(timing);
+        timings.back().written = slot.written;
+        timings.back().acknowledged = slot.acknowledged;
+        if(slot.acknowledged > 0)
+            slot = SequenceSlot();
+        else
+            slot.timing = timings.size() - 1;
+    }
+
+    std::vector<CommandTiming> getTimings() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return timings;
+    }
+
+    unsigned long getReplaced() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return replaced;
+    }
+};
+
+/**
+ * What the tracking thread saw: how long each pair took and how far each fix was from the path.
+ */
+struct TrackingSamples
+{
+    std::mutex mutex;
+    double measureFrom; // Pairs captured before this are left out.
+    unsigned long pairs;
+    unsigned long pairsSkipped;
+    std::vector<double> pipelineSeconds;
+    std::vector<Point3d> fixErrors;
+    TrackingSamples(): measureFrom(0), pairs(0), pairsSkipped(0) {}
+};
+
+/**
+ * Write the distribution of a stage's latencies as a JSON object, in ms.
+ */
+static void printLatency(const std::string &name, std::vector<double> seconds, bool last) {
+    std::sort(seconds.begin(), seconds.end());
+    std::cout << "    {\"name\": \"" << name << "\", \"samples\": " << seconds.size() << ", \"p50_ms\": " << percentile(seconds, 50)*1000
+              << ", \"p95_ms\": " << percentile(seconds, 95)*1000 << ", \"p99_ms\": " << percentile(seconds, 99)*1000
+              << ", \"max_ms\": " << (seconds.empty() ? 0 : seconds.back()*1000) << "}" << (last ? "" : ",") << '\n';
+}
+
+/**
+ * Write the distribution of position errors as a JSON object: the size of the error, and its root mean square along each axis.
+ */
+static void printError(const std::string &name, const std::vector<Point3d> &errors, bool last) {
+    std::vector<double> sizes;
+    Point3d squared(0, 0, 0);
+    for(size_t i = 0; i < errors.size(); i++) {
+        sizes.push_back(norm(errors[i]));
+        squared += Point3d(errors[i].x*errors[i].x, errors[i].y*errors[i].y, errors[i].z*errors[i].z);
+    }
+    std::sort(sizes.begin(), sizes.end());
+    double count = std::max<size_t>(errors.size(), 1);
+    std::cout << "    \"" << name << "\": {\"samples\": " << errors.size() << ", \"p50\": " << percentile(sizes, 50) << ", \"p95\": "
+              << percentile(sizes, 95) << ", \"max\": " << (sizes.empty() ? 0 : sizes.back()) << ", \"rms_x\": " << sqrt(squared.x/count)
+              << ", \"rms_y\": " << sqrt(squared.y/count) << ", \"rms_z\": " << sqrt(squared.z/count) << "}" << (last ? "" : ",") << '\n';
+}
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " --face IMAGE [--face-width UNITS] [--resources DIR] [--size WIDTHxHEIGHT] [--fps RATE]\n"
+              << "       [--depth UNITS] [--motion UNITS] [--period SECONDS] [--seconds SECONDS] [--warmup SECONDS]\n"
+              << "       [--control-period SECONDS] [--text] [--max-latency MS] [--max-error UNITS]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::string faceFileName, resourceDirectory = IGFS_RESOURCE_DIR;
+    double faceWidth = 16, fps = 30, depth = 60, motion = 5, period = 4, seconds = 10, warmup = 2, controlPeriod = 0.05;
+    double maxLatency = 0, maxError = 0;
+    cv::Size frameSize(1280, 960);
+    bool text = false;
+
+    for(int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(option == "--face" && hasValue)
+            faceFileName = argv[++i];
+        else if(option == "--face-width" && hasValue)
+            faceWidth = atof(argv[++i]);
+        else if(option == "--resources" && hasValue)
+            resourceDirectory = argv[++i];
+        else if(option == "--size" && hasValue && sscanf(argv[i + 1], "%dx%d", &frameSize.width, &frameSize.height) == 2)
+            i++;
+        else if(option == "--fps" && hasValue)
+            fps = atof(argv[++i]);
+        else if(option == "--depth" && hasValue)
+            depth = atof(argv[++i]);
+        else if(option == "--motion" && hasValue)
+            motion = atof(argv[++i]);
+        else if(option == "--period" && hasValue)
+            period = atof(argv[++i]);
+        else if(option == "--seconds" && hasValue)
+            seconds = atof(argv[++i]);
+        else if(option == "--warmup" && hasValue)
+            warmup = atof(argv[++i]);
+        else if(option == "--control-period" && hasValue)
+            controlPeriod = atof(argv[++i]);
+        else if(option == "--text")
+            text = true;
+        else if(option == "--max-latency" && hasValue)
+            maxLatency = atof(argv[++i]);
+        else if(option == "--max-error" && hasValue)
+            maxError = atof(argv[++i]);
+        else {
+            printUsage(argv[0]);
+            return option == "--help" ? 0 : 2;
+        }
+    }
+    if(faceFileName.empty() || fps <= 0 || period <= 0 || frameSize.width <= 0 || frameSize.height <= 0) {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    DirectoryResourceLocator resources(resourceDirectory);
+    Mat face = imread(faceFileName, CV_LOAD_IMAGE_COLOR);
+    Point2d mouthInFace;
+    if(face.empty()) {
+        std::cerr << "Failed to open " << faceFileName << std::endl;
+        return 1;
+    }
+    if(!findMouthInFace(face, &resources, mouthInFace)) {
+        std::cerr << "No mouth found in " << faceFileName << std::endl;
+        return 1;
+    }
+
+    // The arm accepts any target the protocol can carry; this measures the path to it, not where the arm can reach.
+    SimulatedArm::Configuration configuration;
+    configuration.minimum = Point3d(-300, -300, -300);
+    configuration.maximum = Point3d(300, 300, 300);
+    configuration.telemetryPeriod = 0;
+    SimulatedArmEndpoint arm(text, configuration);
+    int device = arm.open() ? openSerialDevice(arm.getPath()) : -1;
+    if(device < 0) {
+        std::cerr << "Failed to open a simulated arm" << std::endl;
+        return 1;
+    }
+    arm.start();
+    TimedArmHost host(device);
+    host.start(); // A text arm's replies are read too, so they never back up
+
+    TrackingSamples tracking;
+    std::vector<CommandTiming> commands; // Text commands, including the warm up; binary ones are kept by host.
+    std::vector<Point3d> aimErrors;
+    unsigned long commandsRefused = 0;
+    std::vector<Trace::StageSummary> stages;
+    try {
+        FaceScene scene(face, mouthInFace, faceWidth, resources, frameSize, depth, motion, period);
+        ThreeDMouthLocationFinder finder(new SyntheticFrameSource(frameSize, [&scene] (unsigned long, Mat &frame) { scene.draw(0, frame); }),
+                                         new SyntheticFrameSource(frameSize, [&scene] (unsigned long, Mat &frame) { scene.draw(1, frame); }),
+                                         1.0/fps, &resources);
+        TrackingLoop loop(&finder, false);
+        double started = StereoFrameGrabber::now();
+        tracking.measureFrom = started + warmup;
+        loop.subscribe([&tracking, &scene] (const std::shared_ptr<const TrackingResult> &result) {
+            std::lock_guard<std::mutex> lock(tracking.mutex);
+            if(result->captureTimestamp < tracking.measureFrom)
+                return;
+            tracking.pairs++;
+            tracking.pairsSkipped += result->pairsSkipped;
+            tracking.pipelineSeconds.push_back(result->publishTimestamp - result->captureTimestamp);
+            if(result->positionIsNew)
+                tracking.fixErrors.push_back(result->position - scene.mouthAt(result->captureTimestamp));
+        });
+        loop.start();
+
+        // The control loop: what MouthTrackerAndArmCommander's controlStep does while inserting, for every new fix.
+        unsigned long lastCommanded = 0;
+        double nextStep = started;
+        while(StereoFrameGrabber::now() < tracking.measureFrom + seconds) {
+            std::shared_ptr<const TrackingResult> result;
+            if(controlPeriod > 0) {
+                nextStep += controlPeriod;
+                double wait = nextStep - StereoFrameGrabber::now();
+                if(wait > 0)
+                    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+                result = loop.latestResult();
+            } else {
+                loop.waitForResult(lastCommanded, 0.1, result);
+            }
+            double now = StereoFrameGrabber::now();
+            if(!text)
+                host.link.poll(now);
+            if(!result || result->sequenceNumber <= lastCommanded)
+                continue;
+            lastCommanded = result->sequenceNumber;
+            if(!result->positionIsNew) // Nothing new to aim at
+                continue;
+
+            CommandTiming timing;
+            timing.captured = result->captureTimestamp;
+            timing.published = result->publishTimestamp;
+            double aimedFor = now + ArmTargeting::leadTime;
+            FeedingSequence::ArmCommand command(FeedingSequence::InsertCommand, ArmTargeting::aimPoint(*result, aimedFor));
+            if(result->captureTimestamp >= tracking.measureFrom)
+                aimErrors.push_back(command.mouth - scene.mouthAt(aimedFor));
+            if(text) {
+                std::string line = ArmTargeting::textCommand(command);
+                timing.formatted = StereoFrameGrabber::now();
+                double writing = StereoFrameGrabber::now();
+                if(write(device, line.data(), line.size()) == (ssize_t)line.size())
+                    timing.written = writing;
+                else
+                    commandsRefused++;
+                commands.push_back(timing);
+            } else {
+                double arguments[ArmProtocol::commandArguments];
+                ArmTargeting::commandArguments(command, arguments);
+                timing.formatted = StereoFrameGrabber::now();
+                uint8_t sequence = 0;
+                if(host.link.sendMove(arguments, timing.formatted, &sequence, true))
+                    host.registerCommand(sequence, timing);
+                else
+                    commandsRefused++;
+            }
+        }
+        loop.stop();
+        Trace::summarise(seconds, stages);
+    } catch(std::exception &exception) {
+        std::cerr << exception.what();
+        return 1;
+    }
+
+    // Let the last acks come in.
+    double drainUntil = StereoFrameGrabber::now() + 0.5;
+    while(!text && !host.link.isIdle() && StereoFrameGrabber::now() < drainUntil) {
+        host.link.poll(StereoFrameGrabber::now());
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    host.stop();
+    arm.stop();
+    close(device);
+    if(!text)
+        commands = host.getTimings();
+
+    std::vector<double> publishToCommand, commandToSerial, glassToSerial, serialToAck, glassToAck;
+    unsigned long commandsMeasured = 0;
+    for(size_t i = 0; i < commands.size(); i++) {
+        const CommandTiming &timing = commands[i];
+        if(timing.captured < tracking.measureFrom)
+            continue;
+        commandsMeasured++;
+        publishToCommand.push_back(timing.formatted - timing.published);
+        if(timing.written == 0)
+            continue;
+        commandToSerial.push_back(timing.written - timing.formatted);
+        glassToSerial.push_back(timing.written - timing.captured);
+        if(timing.acknowledged == 0)
+            continue;
+        serialToAck.push_back(timing.acknowledged - timing.written);
+        glassToAck.push_back(timing.acknowledged - timing.captured);
+    }
+    ArmLink::Statistics link = host.link.getStatistics();
+    SimulatedArm::Statistics simulated = arm.getStatistics();
+
+    std::cout << "{\n  \"frame_width\": " << frameSize.width << ",\n  \"frame_height\": " << frameSize.height << ",\n  \"fps\": " << fps
+              << ",\n  \"protocol\": \"" << (text ? "text" : "binary") << "\",\n  \"control_period_s\": " << controlPeriod
+              << ",\n  \"pairs\": " << tracking.pairs << ",\n  \"pairs_skipped\": " << tracking.pairsSkipped
+              << ",\n  \"fixes\": " << tracking.fixErrors.size() << ",\n  \"commands\": " << commandsMeasured
+              << ",\n  \"latency\": [\n";
+    printLatency("capture_to_publish", tracking.pipelineSeconds, false);
+    printLatency("publish_to_command", publishToCommand, false);
+    printLatency("command_to_serial", commandToSerial, false);
+    printLatency("glass_to_serial", glassToSerial, text);
+    if(!text) {
+        printLatency("serial_to_ack", serialToAck, false);
+        printLatency("glass_to_ack", glassToAck, true);
+    }
+    std::cout << "  ],\n  \"position_error\": {\n";
+    printError("fix", tracking.fixErrors, false);
+    printError("aim", aimErrors, true);
+    std::cout << "  },\n  \"pipeline_stages\": [\n";
+    for(size_t i = 0; i < stages.size(); i++) {
+        std::cout << "    {\"name\": \"" << stages[i].name << "\", \"count\": " << stages[i].count << ", \"mean_ms\": "
+                  << stages[i].meanSeconds*1000 << ", \"max_ms\": " << stages[i].maxSeconds*1000 << "}"
+                  << (i + 1 < stages.size() ? "," : "") << '\n';
+    }
+    std::cout << "  ],\n  \"link\": {\"refused\": " << commandsRefused << ", \"replaced\": " << host.getReplaced() << ", \"retransmissions\": "
+              << link.retransmissions << ", \"failures\": " << link.failures << "},\n"
+              << "  \"arm\": {\"commands\": " << simulated.commands << ", \"rejected\": " << simulated.rejected << "}\n}\n";
+    std::cout.flush();
+
+    std::sort(glassToSerial.begin(), glassToSerial.end());
+    std::vector<double> fixSizes;
+    for(size_t i = 0; i < tracking.fixErrors.size(); i++)
+        fixSizes.push_back(norm(tracking.fixErrors[i]));
+    std::sort(fixSizes.begin(), fixSizes.end());
+    bool passed = !glassToSerial.empty() && link.failures == 0 && commandsRefused == 0;
+    if(maxLatency > 0 && percentile(glassToSerial, 95)*1000 > maxLatency) {
+        std::cerr << "p95 glass to serial latency is over " << maxLatency << " ms" << std::endl;
+        passed = false;
+    }
+    if(maxError > 0 && (fixSizes.empty() || percentile(fixSizes, 95) > maxError)) {
+        std::cerr << "p95 fix error is over " << maxError << std::endl;
+        passed = false;
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+/**
+ * @file
+ * @section Description
+ *
+ * HeadlessTracker runs the mouth tracking pipeline without the app: it reads a stereo pair from cameras, video files, image
+ * sequences or synthetic frames, finds the 3D mouth position in every pair and writes one CSV line per pair to stdout.
+ * It is the way to run and profile the vision code on a machine without the arm, the display or OS X.
+ *
+ * Usage: HeadlessTracker [options]
+ *   --left SOURCE, --right SOURCE  A camera index (e.g. 0), a video file, an image sequence pattern (e.g. left_%04d.png)
+ *                                  or "synthetic". Defaults to cameras 0 and 1.
+ *   --resources DIR                Directory holding intrinsic.yml, extrinsic.yml and Cascades/. Defaults to the source tree.
+ *   --frames N                     Stop after N pairs. Defaults to running until a source ends.
+ *   --period SECONDS               Minimum time between frames, to play files back at camera rate.
+ *   --sequential                   Detect in the left and right views one after the other.
+ *   --no-tracking                  Search the whole of every frame for the face.
+ *   --face-scale SCALE             Resolution faces are detected at, as a fraction of the frame.
+ *   --full-rectification           Rectify whole frames before detection instead of just the mouth points.
+ *   --dense                        Find the mouth position from dense depth inside the mouth hull.
+ *   --record FILE                  Record every pair and the position found in it (see StereoRecording.hpp).
+ *   --encoding raw|png|jpeg        How recorded frames are stored. Defaults to png.
+ *   --replay FILE                  Read pairs from a recording instead of --left and --right. Every pair is processed
+ *                                  exactly once, as fast as possible, unless --realtime is given.
+ *   --realtime                     Replay at the recorded rate, skipping pairs the pipeline is too slow for.
+ *   --trace FILE                   Write the pipeline trace as a Chrome trace (see Trace.hpp) when finished.
+ *   --stats                        Print the pipeline counters and stage latencies to stderr every second.
+ */
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include "ThreeDMouthLocationFinder.hpp"
+#include "FrameSource.hpp"
+#include "ResourceLocator.hpp"
+#include "StereoRecording.hpp"
+#include "CommandLineSources.hpp"
+#include "Trace.hpp"
+using namespace cv;
+
+#ifndef IGFS_RESOURCE_DIR
+#define IGFS_RESOURCE_DIR "."
+#endif
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " [--left SOURCE] [--right SOURCE] [--resources DIR] [--frames N] [--period SECONDS]\n"
+              << "       [--sequential] [--no-tracking] [--face-scale SCALE] [--full-rectification] [--dense]\n"
+              << "       [--record FILE] [--encoding raw|png|jpeg] [--replay FILE] [--realtime] [--trace FILE] [--stats]\n"
+              << "SOURCE is a camera index, a video file, an image sequence pattern (e.g. left_%04d.png) or synthetic." << std::endl;
+}
+
+/**
+ * Print the pipeline counters and the latency of each stage over the last second to stderr.
+ */
+static void printPipelineStatistics() {
+    Trace::PipelineCounters &counters = Trace::counters();
+    std::cerr << "captured " << counters.framesCaptured << ", processed " << counters.framesProcessed << ", detected "
+              << counters.framesDetected << ", epipolar rejections " << counters.epipolarRejections << ", confidence rejections "
+              << counters.confidenceRejections << ", frame pool exhaustions " << counters.framePoolExhaustions << '\n';
+    std::vector<Trace::StageSummary> summaries;
+    Trace::summarise(1.0, summaries);
+    for(size_t i = 0; i < summaries.size(); i++) {
+        std::cerr << "  " << summaries[i].name << ": " << summaries[i].count << " in the last second, mean "
+                  << summaries[i].meanSeconds*1000 << " ms, max " << summaries[i].maxSeconds*1000 << " ms\n";
+    }
+    std::cerr.flush();
+}
+
+int main(int argc, char **argv) {
+    std::string leftDescription = "0", rightDescription = "1", resourceDirectory = IGFS_RESOURCE_DIR;
+    std::string recordFileName, replayFileName, traceFileName;
+    bool printStats = false;
+    FrameEncoding encoding = PngFrames;
+    bool realTimeReplay = false;
+    unsigned long maxFrames = 0;
+    double framePeriod = 0, faceScale = 0;
+    bool sequential = false, tracking = true, fullRectification = false, dense = false;
+
+    for(int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(option == "--left" && hasValue)
+            leftDescription = argv[++i];
+        else if(option == "--right" && hasValue)
+            rightDescription = argv[++i];
+        else if(option == "--resources" && hasValue)
+            resourceDirectory = argv[++i];
+        else if(option == "--frames" && hasValue)
+            maxFrames = strtoul(argv[++i], 0, 10);
+        else if(option == "--period" && hasValue)
+            framePeriod = atof(argv[++i]);
+        else if(option == "--face-scale" && hasValue)
+            faceScale = atof(argv[++i]);
+        else if(option == "--sequential")
+            sequential = true;
+        else if(option == "--no-tracking")
+            tracking = false;
+        else if(option == "--full-rectification")
+            fullRectification = true;
+        else if(option == "--dense")
+            dense = true;
+        else if(option == "--record" && hasValue)
+            recordFileName = argv[++i];
+        else if(option == "--encoding" && hasValue) {
+            std::string name = argv[++i];
+            encoding = name == "raw" ? RawFrames : name == "jpeg" ? JpegFrames : PngFrames;
+        }
+        else if(option == "--replay" && hasValue)
+            replayFileName = argv[++i];
+        else if(option == "--realtime")
+            realTimeReplay = true;
+        else if(option == "--trace" && hasValue)
+            traceFileName = argv[++i];
+        else if(option == "--stats")
+            printStats = true;
+        else {
+            printUsage(argv[0]);
+            return option == "--help" ? 0 : 2;
+        }
+    }
+
+    StereoReplaySource *replaySource = 0;
+    FrameSource *leftSource = 0, *rightSource = 0;
+    if(!replayFileName.empty()) {
+        replaySource = new StereoReplaySource(replayFileName, realTimeReplay);
+        if(!replaySource->isOpened()) {
+            std::cerr << "Failed to open " << replayFileName << std::endl;
+            delete replaySource;
+            return 1;
+        }
+    } else {
+        leftSource = openSource(leftDescription);
+        rightSource = openSource(rightDescription);
+        if(!leftSource->isOpened() || !rightSource->isOpened()) {
+            std::cerr << "Failed to open " << (leftSource->isOpened() ? rightDescription : leftDescription) << std::endl;
+            delete leftSource;
+            delete rightSource;
+            return 1;
+        }
+    }
+
+    DirectoryResourceLocator resources(resourceDirectory);
+    ThreeDMouthLocationFinder *finder = 0;
+    try {
+        if(replaySource)
+            finder = new ThreeDMouthLocationFinder(replaySource, &resources);
+        else
+            finder = new ThreeDMouthLocationFinder(leftSource, rightSource, framePeriod, &resources);
+        finder->setParallelDetection(!sequential);
+        finder->setFaceTracking(tracking);
+        if(faceScale > 0)
+            finder->setFaceDetectionScale(faceScale);
+        finder->setSparseRectification(!fullRectification);
+        if(dense)
+            finder->setLocalisationMode(ThreeDMouthLocationFinder::DenseDepth);
+        if(!recordFileName.empty() && !finder->startRecording(recordFileName, encoding)) {
+            std::cerr << "Failed to open " << recordFileName << " for recording" << std::endl;
+            delete finder;
+            return 1;
+        }
+
+        std::cout << "sequence,found,x,y,z,open,confidence" << std::endl;
+        unsigned long lastSequence = 0, pairsProcessed = 0;
+        int64_t lastStats = Trace::now();
+        while(maxFrames == 0 || pairsProcessed < maxFrames) {
+            if(printStats && Trace::now() - lastStats > 1000000000) {
+                printPipelineStatistics();
+                lastStats = Trace::now();
+            }
+            bool ended = finder->hasStreamEnded(); // Read before grabbing so the last pair published is not missed.
+            finder->GrabMouthPosition();
+            unsigned long sequence = finder->getFrameSequenceNumber();
+            if(sequence == lastSequence) {
+                if(ended)
+                    break;
+                finder->waitForNewPair(0.001);
+                continue;
+            }
+            lastSequence = sequence;
+            pairsProcessed++;
+
+            Point3d position;
+            bool open = false;
+            bool found = finder->takeMouthPosition(position, open);
+            std::cout << sequence << ',' << found << ',';
+            if(found)
+                std::cout << position.x << ',' << position.y << ',' << position.z << ',' << open << ',' << finder->getFixConfidence();
+            else
+                std::cout << ",,,,";
+            std::cout << '\n';
+        }
+        std::cout.flush();
+    } catch(std::exception &exception) {
+        std::cerr << exception.what();
+        delete finder;
+        return 1;
+    }
+    delete finder; // Stops capture and finishes writing any recording.
+    if(printStats)
+        printPipelineStatistics();
+    if(!traceFileName.empty() && !Trace::writeChromeTrace(traceFileName)) {
+        std::cerr << "Failed to write " << traceFileName << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,431 @@
+/**
+ * @file
+ * @section Description
+ *
+ * PipelineBenchmark times each stage of the vision hot path over a corpus of stereo pairs and reports the p50, p95 and p99
+ * latency and the throughput of every stage, as JSON (the default) or CSV, so the results of two builds can be diffed.
+ *
+ * The corpus is a recording made with HeadlessTracker --record (the reference input; use --iterations to go over it more
+ * than once) or a single pass over a pair of frame sources. Everything runs on one thread, one pair at a time, so the
+ * stages do not compete with each other for cores, except in the parallel detection stage whose point is to measure that.
+ *
+ * Stages:
+ *   preprocessing, face_detection,         The stages inside MouthPointFinder::detectMouthCentre, one sample per view.
+ *   mouth_detection, contour_extraction    mouth_detection and contour_extraction only have samples when a face was found.
+ *   view_detection                         The whole of MouthPointFinder::detectMouthCentre, one sample per view.
+ *   stereo_detection_sequential            StereoMouthDetector in sequential mode.
+ *   stereo_detection_parallel              StereoMouthDetector in parallel mode.
+ *   rectify_points, triangulate            StereoMatcher::rectifyPoints and triangulateSinglePoint on the mouth centres.
+ *   end_to_end                             The tracking path, as wall time from the pair being in hand to its 3D position:
+ *                                          copying the frames, parallel detection, rectify_points and triangulate.
+ *   rectify_images                         StereoMatcher::rectifyImages on the whole pair.
+ *   sgbm_match                             StereoMatcher::Match on the whole pair (skip with --no-sgbm).
+ *   dense_localise                         StereoMatcher::localiseRegion over the mouth hull, when a hull was found.
+ *
+ * The localisation section compares how many pairs give a mouth position by triangulating the mouth centres and from dense
+ * depth, and how much the depth of consecutive positions jitters with each and after smoothing the triangulated positions
+ * with MouthMotionModel.
+ *
+ * The scale_accuracy section compares the mouth centres found with faces detected at the reduced scale (--face-scale, 0.5 by
+ * default) against those found at full resolution, in every view of every pair: how often only one of them finds the mouth,
+ * and how far apart the centres are when both do. Skip it with --no-scale-accuracy; it roughly doubles the run time.
+ *
+ * Usage: PipelineBenchmark [--replay FILE [--iterations N] | --left SOURCE --right SOURCE] [--frames N] [--resources DIR]
+ *                          [--face-scale SCALE] [--no-tracking] [--no-sgbm] [--no-scale-accuracy] [--warmup N] [--csv]
+ */
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "MouthPointFinder.hpp"
+#include "StereoMouthDetector.hpp"
+#include "StereoMatcher.hpp"
+#include "StereoRecording.hpp"
+#include "MouthMotionModel.hpp"
+#include "ResourceLocator.hpp"
+#include "CommandLineSources.hpp"
+#include "BenchmarkStatistics.hpp"
+using namespace cv;
+
+#ifndef IGFS_RESOURCE_DIR
+#define IGFS_RESOURCE_DIR "."
+#endif
+
+/**
+ * The latencies measured for one stage.
+ */
+struct StageSamples
+{
+    std::string name;
+    std::vector<double> seconds;
+};
+
+/**
+ * Collects stage samples, keeping the stages in the order they were first recorded.
+ */
+class StageRecorder
+{
+    std::vector<StageSamples> stages;
+    bool enabled;
+public:
+    StageRecorder(): enabled(true) {}
+    /**
+     * Turn recording on or off, e.g. off for the warm up pairs.
+     */
+    void setEnabled(bool recording) { enabled = recording; }
+    /**
+     * Record one sample.
+     * @param name    The name of the stage.
+     * @param seconds How long it took.
+     */
+    void record(const std::string &name, double seconds) {
+        if(!enabled)
+            return;
+        for(size_t i = 0; i < stages.size(); i++) {
+            if(stages[i].name == name) {
+                stages[i].seconds.push_back(seconds);
+                return;
+            }
+        }
+        stages.push_back(StageSamples());
+        stages.back().name = name;
+        stages.back().seconds.push_back(seconds);
+    }
+    std::vector<StageSamples> &getStages() { return stages; }
+};
+
+/**
+ * Accumulates how often a localisation method gives a position and how much its depth jitters between consecutive positions.
+ */
+struct LocalisationStatistics
+{
+    unsigned long fixes;
+    double lastDepth;
+    double squaredDepthSteps;
+    unsigned long depthSteps;
+    LocalisationStatistics(): fixes(0), lastDepth(0), squaredDepthSteps(0), depthSteps(0) {}
+    void addFix(double depth) {
+        if(fixes > 0) {
+            squaredDepthSteps += (depth - lastDepth)*(depth - lastDepth);
+            depthSteps++;
+        }
+        lastDepth = depth;
+        fixes++;
+    }
+    double depthJitter() const { return depthSteps > 0 ? std::sqrt(squaredDepthSteps/depthSteps) : 0; }
+};
+
+/**
+ * Accumulates how the mouth centres found with faces detected at the reduced scale compare with those found at full resolution.
+ */
+struct ScaleAccuracyStatistics
+{
+    unsigned long foundByBoth;
+    unsigned long foundOnlyAtFullScale;
+    unsigned long foundOnlyAtReducedScale;
+    std::vector<double> centreDifferences; // In pixels, for the views where both found the mouth.
+    ScaleAccuracyStatistics(): foundByBoth(0), foundOnlyAtFullScale(0), foundOnlyAtReducedScale(0) {}
+    void addView(bool foundAtReducedScale, Point2d reducedScaleCentre, bool foundAtFullScale, Point2d fullScaleCentre) {
+        if(foundAtReducedScale && foundAtFullScale) {
+            foundByBoth++;
+            Point2d difference = reducedScaleCentre - fullScaleCentre;
+            centreDifferences.push_back(std::sqrt(difference.dot(difference)));
+        } else if(foundAtFullScale) {
+            foundOnlyAtFullScale++;
+        } else if(foundAtReducedScale) {
+            foundOnlyAtReducedScale++;
+        }
+    }
+};
+
+static double secondsSince(int64 start) {
+    return (getTickCount() - start)/getTickFrequency();
+}
+
+static void recordDetectionTimings(StageRecorder &stages, const MouthDetectionTimings &timings) {
+    stages.record("preprocessing", timings.preprocessing);
+    stages.record("face_detection", timings.faceDetection);
+    if(timings.mouthDetection > 0)
+        stages.record("mouth_detection", timings.mouthDetection);
+    if(timings.contourExtraction > 0)
+        stages.record("contour_extraction", timings.contourExtraction);
+}
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " [--replay FILE [--iterations N] | --left SOURCE --right SOURCE] [--frames N]\n"
+              << "       [--resources DIR] [--face-scale SCALE] [--no-tracking] [--no-sgbm] [--no-scale-accuracy] [--warmup N] [--csv]\n"
+              << "SOURCE is a camera index, a video file, an image sequence pattern (e.g. left_%04d.png) or synthetic." << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::string replayFileName, leftDescription = "synthetic", rightDescription = "synthetic", resourceDirectory = IGFS_RESOURCE_DIR;
+    unsigned long maxFrames = 0, warmupPairs = 5;
+    int iterations = 1;
+    double faceScale = 0;
+    bool tracking = true, runSgbm = true, compareScales = true, csv = false;
+
+    for(int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(option == "--replay" && hasValue)
+            replayFileName = argv[++i];
+        else if(option == "--left" && hasValue)
+            leftDescription = argv[++i];
+        else if(option == "--right" && hasValue)
+            rightDescription = argv[++i];
+        else if(option == "--frames" && hasValue)
+            maxFrames = strtoul(argv[++i], 0, 10);
+        else if(option == "--iterations" && hasValue)
+            iterations = std::max(1, atoi(argv[++i]));
+        else if(option == "--resources" && hasValue)
+            resourceDirectory = argv[++i];
+        else if(option == "--face-scale" && hasValue)
+            faceScale = atof(argv[++i]);
+        else if(option == "--warmup" && hasValue)
+            warmupPairs = strtoul(argv[++i], 0, 10);
+        else if(option == "--no-tracking")
+            tracking = false;
+        else if(option == "--no-sgbm")
+            runSgbm = false;
+        else if(option == "--no-scale-accuracy")
+            compareScales = false;
+        else if(option == "--csv")
+            csv = true;
+        else {
+            printUsage(argv[0]);
+            return option == "--help" ? 0 : 2;
+        }
+    }
+
+    StereoRecordingReader reader;
+    FrameSource *leftSource = 0, *rightSource = 0;
+    if(!replayFileName.empty()) {
+        if(!reader.open(replayFileName)) {
+            std::cerr << "Failed to open " << replayFileName << std::endl;
+            return 1;
+        }
+    } else {
+        unsigned long syntheticFrames = maxFrames > 0 ? maxFrames : 100;
+        leftSource = openSource(leftDescription, syntheticFrames);
+        rightSource = openSource(rightDescription, syntheticFrames);
+        if(!leftSource->isOpened() || !rightSource->isOpened()) {
+            std::cerr << "Failed to open " << (leftSource->isOpened() ? rightDescription : leftDescription) << std::endl;
+            delete leftSource;
+            delete rightSource;
+            return 1;
+        }
+        iterations = 1;
+    }
+
+    DirectoryResourceLocator resources(resourceDirectory);
+    StageRecorder stages;
+    LocalisationStatistics triangulated, filtered, dense;
+    ScaleAccuracyStatistics scaleAccuracy;
+    double reducedScale = 1;
+    unsigned long pairsMeasured = 0;
+    cv::Size frameSize;
+    try {
+        MouthPointFinder leftFinder(&resources), rightFinder(&resources);
+        StereoMouthDetector sequentialDetector(false, &resources), parallelDetector(true, &resources);
+        MouthPointFinder *finders[2] = {&leftFinder, &rightFinder};
+        for(int i = 0; i < 2; i++)
+            finders[i]->setTracking(tracking);
+        sequentialDetector.setTracking(tracking);
+        parallelDetector.setTracking(tracking);
+        if(faceScale > 0) {
+            for(int i = 0; i < 2; i++)
+                finders[i]->setFaceDetectionScale(faceScale);
+            sequentialDetector.setFaceDetectionScale(faceScale);
+            parallelDetector.setFaceDetectionScale(faceScale);
+        }
+        // The same detection with faces searched for at full resolution, as the reference for the reduced scale.
+        reducedScale = leftFinder.getFaceDetectionScale();
+        compareScales = compareScales && reducedScale < 1;
+        MouthPointFinder fullScaleLeftFinder(&resources), fullScaleRightFinder(&resources);
+        MouthPointFinder *fullScaleFinders[2] = {&fullScaleLeftFinder, &fullScaleRightFinder};
+        for(int i = 0; i < 2; i++) {
+            fullScaleFinders[i]->setTracking(tracking);
+            fullScaleFinders[i]->setFaceDetectionScale(1);
+        }
+        StereoMatcher *stereoMatcher = 0;
+
+        StereoFramePair pair;
+        Mat left, right, rectifiedLeft, rectifiedRight, pointCloud, disparityMap;
+        std::vector<cv::Point> hull;
+        std::vector<Point2f> hullPoints, rectifiedHull;
+        MouthMotionModel motionModel;
+        bool haveDenseFix = false;
+        double lastDenseDepth = 0;
+        unsigned long pairsRead = 0;
+        for(int iteration = 0; iteration < iterations; iteration++) {
+            if(leftSource == 0)
+                reader.rewind();
+            for(unsigned long pairsThisIteration = 0; maxFrames == 0 || pairsThisIteration < maxFrames; pairsThisIteration++) {
+                if(leftSource) {
+                    if(!leftSource->grab() || !rightSource->grab() || !leftSource->retrieve(pair.left) || !rightSource->retrieve(pair.right))
+                        break;
+                } else if(!reader.readNextPair(pair)) {
+                    break;
+                }
+                pairsRead++;
+                bool measuring = pairsRead > warmupPairs;
+                stages.setEnabled(measuring);
+                if(!stereoMatcher) {
+                    frameSize = pair.left.size();
+                    stereoMatcher = new StereoMatcher("Resources/intrinsic.yml", "Resources/extrinsic.yml", frameSize, "", &resources);
+                }
+
+                // The tracking path first, timed as one stretch of wall time from the pair being in hand to its 3D position,
+                // so end_to_end includes the frame copies and everything between the stages that their own samples miss.
+                int64 arrival = getTickCount();
+                Point2d parallelCentres[2];
+                bool parallelOpen[2];
+                pair.left.copyTo(left);
+                pair.right.copyTo(right);
+                int64 start = getTickCount();
+                bool foundInBoth = parallelDetector.detectMouthCentres(left, right, parallelCentres[0], parallelCentres[1], parallelOpen[0], parallelOpen[1]);
+                stages.record("stereo_detection_parallel", secondsSince(start));
+
+                // The geometry is timed on the frame centres when no mouth was found, so every pair gives a sample.
+                Point2d leftPoint = foundInBoth ? parallelCentres[0] : Point2d(frameSize.width*0.5, frameSize.height*0.5);
+                Point2d rightPoint = foundInBoth ? parallelCentres[1] : Point2d(frameSize.width*0.5 - 32, frameSize.height*0.5);
+                Point3d position;
+                start = getTickCount();
+                stereoMatcher->rectifyPoints(leftPoint, rightPoint, leftPoint, rightPoint);
+                stages.record("rectify_points", secondsSince(start));
+                start = getTickCount();
+                stereoMatcher->triangulateSinglePoint(leftPoint, rightPoint, position);
+                stages.record("triangulate", secondsSince(start));
+                stages.record("end_to_end", secondsSince(arrival));
+                if(foundInBoth && fabs(leftPoint.y - rightPoint.y) < 30) {
+                    double captureTime = leftSource ? pairsRead/30.0 : pair.leftTimestamp; // Sources have no timestamps; assume 30 Hz.
+                    motionModel.update(position, captureTime);
+                    if(measuring) {
+                        triangulated.addFix(position.z);
+                        filtered.addFix(motionModel.getEstimate(captureTime).position.z);
+                    }
+                }
+
+                // Each view on its own, stage by stage. Detection draws on the frame, so it gets a copy.
+                Point2d centres[2];
+                bool isOpen[2] = {false, false};
+                bool found[2];
+                Mat *frames[2] = {&pair.left, &pair.right};
+                for(int view = 0; view < 2; view++) {
+                    frames[view]->copyTo(left);
+                    start = getTickCount();
+                    found[view] = finders[view]->detectMouthCentre(left, centres[view], isOpen[view]);
+                    stages.record("view_detection", secondsSince(start));
+                    recordDetectionTimings(stages, finders[view]->getLastTimings());
+                    if(compareScales) {
+                        frames[view]->copyTo(left);
+                        Point2d fullScaleCentre;
+                        bool fullScaleIsOpen = false;
+                        bool foundAtFullScale = fullScaleFinders[view]->detectMouthCentre(left, fullScaleCentre, fullScaleIsOpen);
+                        if(measuring)
+                            scaleAccuracy.addView(found[view], centres[view], foundAtFullScale, fullScaleCentre);
+                    }
+                }
+                if(leftFinder.getMouthHull(hull)) {
+                    hullPoints.clear();
+                    for(size_t i = 0; i < hull.size(); i++)
+                        hullPoints.push_back(Point2f(hull[i].x, hull[i].y));
+                }
+
+                Point2d sequentialCentres[2];
+                bool sequentialOpen[2];
+                pair.left.copyTo(left);
+                pair.right.copyTo(right);
+                start = getTickCount();
+                sequentialDetector.detectMouthCentres(left, right, sequentialCentres[0], sequentialCentres[1], sequentialOpen[0], sequentialOpen[1]);
+                stages.record("stereo_detection_sequential", secondsSince(start));
+
+                start = getTickCount();
+                stereoMatcher->rectifyImages(pair.left, pair.right, rectifiedLeft, rectifiedRight);
+                stages.record("rectify_images", secondsSince(start));
+                if(runSgbm) {
+                    start = getTickCount();
+                    stereoMatcher->Match(pair.left, pair.right, pointCloud, disparityMap);
+                    stages.record("sgbm_match", secondsSince(start));
+                }
+
+                if(found[0] && !hullPoints.empty()) {
+                    Point3d densePosition;
+                    double confidence = 0;
+                    start = getTickCount();
+                    stereoMatcher->rectifyLeftPoints(hullPoints, rectifiedHull);
+                    bool localised = stereoMatcher->localiseRegion(pair.left, pair.right, rectifiedHull, haveDenseFix ? lastDenseDepth : 0,
+                                                                   false, densePosition, confidence);
+                    stages.record("dense_localise", secondsSince(start));
+                    if(localised && confidence >= 0.3) {
+                        if(measuring)
+                            dense.addFix(densePosition.z);
+                        haveDenseFix = true;
+                        lastDenseDepth = densePosition.z;
+                    }
+                }
+                hullPoints.clear();
+                if(measuring)
+                    pairsMeasured++;
+            }
+        }
+        delete stereoMatcher;
+    } catch(std::exception &exception) {
+        std::cerr << exception.what();
+        delete leftSource;
+        delete rightSource;
+        return 1;
+    }
+    delete leftSource;
+    delete rightSource;
+
+    std::vector<StageSamples> &results = stages.getStages();
+    std::string corpus = replayFileName.empty() ? leftDescription + "," + rightDescription : replayFileName;
+    if(csv)
+        std::cout << "stage,samples,mean_ms,p50_ms,p95_ms,p99_ms,max_ms,throughput_hz\n";
+    else
+        std::cout << "{\n  \"corpus\": \"" << corpus << "\",\n  \"pairs\": " << pairsMeasured << ",\n  \"frame_width\": " << frameSize.width
+                  << ",\n  \"frame_height\": " << frameSize.height << ",\n  \"face_tracking\": " << (tracking ? "true" : "false")
+                  << ",\n  \"stages\": [\n";
+    for(size_t i = 0; i < results.size(); i++) {
+        std::vector<double> &sorted = results[i].seconds;
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for(size_t j = 0; j < sorted.size(); j++)
+            total += sorted[j];
+        double mean = sorted.empty() ? 0 : total/sorted.size();
+        double throughput = total > 0 ? sorted.size()/total : 0;
+        if(csv) {
+            std::cout << results[i].name << ',' << sorted.size() << ',' << mean*1000 << ',' << percentile(sorted, 50)*1000 << ','
+                      << percentile(sorted, 95)*1000 << ',' << percentile(sorted, 99)*1000 << ',' << (sorted.empty() ? 0 : sorted.back()*1000)
+                      << ',' << throughput << '\n';
+        } else {
+            std::cout << "    {\"name\": \"" << results[i].name << "\", \"samples\": " << sorted.size() << ", \"mean_ms\": " << mean*1000
+                      << ", \"p50_ms\": " << percentile(sorted, 50)*1000 << ", \"p95_ms\": " << percentile(sorted, 95)*1000
+                      << ", \"p99_ms\": " << percentile(sorted, 99)*1000 << ", \"max_ms\": " << (sorted.empty() ? 0 : sorted.back()*1000)
+                      << ", \"throughput_hz\": " << throughput << "}" << (i + 1 < results.size() ? "," : "") << '\n';
+        }
+    }
+    if(!csv) {
+        std::cout << "  ],\n  \"localisation\": {\n"
+                  << "    \"triangulated_fixes\": " << triangulated.fixes << ", \"triangulated_depth_jitter\": " << triangulated.depthJitter() << ",\n"
+                  << "    \"filtered_depth_jitter\": " << filtered.depthJitter() << ",\n"
+                  << "    \"dense_fixes\": " << dense.fixes << ", \"dense_depth_jitter\": " << dense.depthJitter() << "\n  }";
+        if(compareScales) {
+            std::vector<double> &sorted = scaleAccuracy.centreDifferences;
+            std::sort(sorted.begin(), sorted.end());
+            std::cout << ",\n  \"scale_accuracy\": {\n"
+                      << "    \"face_scale\": " << reducedScale << ", \"found_by_both\": " << scaleAccuracy.foundByBoth
+                      << ", \"found_only_at_full_scale\": " << scaleAccuracy.foundOnlyAtFullScale
+                      << ", \"found_only_at_reduced_scale\": " << scaleAccuracy.foundOnlyAtReducedScale << ",\n"
+                      << "    \"centre_difference_p50_px\": " << percentile(sorted, 50) << ", \"centre_difference_p95_px\": "
+                      << percentile(sorted, 95) << ", \"centre_difference_max_px\": " << (sorted.empty() ? 0 : sorted.back()) << "\n  }";
+        }
+        std::cout << "\n}\n";
+    }
+    std::cout.flush();
+    return 0;
+}
@@ -0,0 +1,295 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The SimulatedArm class stands in for the feeding arm at the other end of the serial link, so the control path can be run
+ * and timed with no hardware. It speaks either the binary protocol of ArmProtocol.hpp or the old text commands ("M x y z a b",
+ * "S x y z a b", "A"), answers the way the arm is expected to, and reports where it is as it moves.
+ *
+ * The arm is modelled as three joints, one for each of x, y and z in arm coordinates, each moving at its own top speed
+ * between its own limits. A move takes as long as the slowest joint, plus a settling time before the arm reports arriving.
+ * A scoop first spends a fixed time at the bowl, then moves to its target. A new move or scoop takes over from the current
+ * one at wherever the arm has got to, as a servoed insert needs. An abort goes back to rest. Targets outside the limits are
+ * rejected.
+ *
+ * Replies in the binary protocol: 'K' for every command accepted (and again for a command sent twice, which is not acted on
+ * again), 'E' with an ArmProtocol::ErrorCode for a command rejected, 'D' on arriving and 'P' with the position. In the text
+ * protocol the arm sends "D", "E" and "P x y z" lines and no acks, as the old commands have none.
+ *
+ * Nothing here knows about the serial port or the clock: bytes come in through receive, go out through the writer, and time
+ * only moves when step is called.
+ */
+#ifndef SIMULATED_ARM_HPP
+#define SIMULATED_ARM_HPP
+
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include "ArmProtocol.hpp"
+using namespace cv;
+
+class SimulatedArm
+{
+public:
+    typedef std::function<void(const uint8_t *, size_t)> Writer;
+
+    struct Configuration
+    {
+        Point3d minimum; // Lower joint limits, in arm units.
+        Point3d maximum; // Upper joint limits, in arm units.
+        Point3d speed; // Top speed of each joint, in arm units per second.
+        Point3d rest; // Where an abort sends the arm, and where it starts.
+        double settleTime; // Seconds from the joints stopping to reporting arrival.
+        double scoopTime; // Seconds spent at the bowl before a scoop moves to its target.
+        double telemetryPeriod; // Seconds between position reports, or 0 for none.
+        double textIdleTimeout; // A text command whose last number has had no byte after it for this long is complete.
+        Configuration(): minimum(-40, -40, -10), maximum(40, 40, 50), speed(40, 40, 40), rest(0, -15, 20), settleTime(0.05),
+            scoopTime(1.0), telemetryPeriod(0.05), textIdleTimeout(0.005) {}
+    };
+
+    struct Statistics
+    {
+        unsigned long commands; // Commands acted on.
+        unsigned long duplicates; // Commands received again and only acked.
+        unsigned long rejected;
+        unsigned long arrivals;
+        unsigned long positionReports;
+        Statistics(): commands(0), duplicates(0), rejected(0), arrivals(0), positionReports(0) {}
+    };
+private:
+    Writer write;
+    bool textProtocol;
+    Configuration configuration;
+    Statistics statistics;
+    ArmProtocol::FrameDecoder decoder;
+    std::string textBuffer; // Text received and not yet made into commands.
+    double lastTextByte;
+    uint8_t nextTextSequence; // Text commands have no sequence numbers; these only tell them apart here.
+    std::deque<uint8_t> recentSequences; // Binary commands already acted on, newest last.
+    Point3d from, to; // The current move.
+    double moveStarted; // When the joints start moving, after any time at the bowl.
+    double moveEnds; // When the joints stop.
+    bool moving; // True until the current move has been reported as arrived.
+    uint8_t moveSequence;
+    double lastPositionReport;
+
+    inline void sendFrame(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length);
+    inline void sendLine(const std::string &line);
+    inline bool withinLimits(const Point3d &target);
+    inline void startMove(const Point3d &target, double delay, uint8_t sequence, double now);
+    inline void reject(uint8_t sequence, ArmProtocol::ErrorCode code);
+    inline bool execute(uint8_t type, const double *arguments, uint8_t sequence, double now);
+    inline void receiveFrame(const ArmProtocol::Frame &frame, double now);
+    inline bool takeTextCommand(bool atEnd, double now);
+public:
+    /**
+     * Constructor for the SimulatedArm. The arm starts at rest.
+     * @param writer        Sends bytes to the host.
+     * @param text          true to speak the old text commands, false for the binary protocol.
+     * @param configuration The arm's limits and timing.
+     */
+    inline SimulatedArm(const Writer &writer, bool text = false, const Configuration &configuration = Configuration());
+    /**
+     * Hand over bytes from the host. Commands take effect at now.
+     */
+    inline void receive(const uint8_t *data, size_t length, double now);
+    /**
+     * Move the simulation on to now: report arriving and the position when they are due. Call often, e.g. every millisecond.
+     */
+    inline void step(double now);
+    /**
+     * Where the joints are.
+     * @param  now The current time.
+     * @return     The position, in arm units.
+     */
+    inline Point3d getPosition(double now);
+    /**
+     * Tells us if the arm is carrying out a command.
+     */
+    inline bool isMoving();
+    inline const Statistics &getStatistics() { return statistics; }
+};
+
+inline SimulatedArm::SimulatedArm(const Writer &writer, bool text, const Configuration &armConfiguration): write(writer),
+    textProtocol(text), configuration(armConfiguration), lastTextByte(0), nextTextSequence(0), from(armConfiguration.rest),
+    to(armConfiguration.rest), moveStarted(0), moveEnds(0), moving(false), moveSequence(0), lastPositionReport(0) {
+}
+
+inline void SimulatedArm::sendFrame(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length) {
+    std::vector<uint8_t> frame;
+    if(ArmProtocol::encodeFrame(type, sequence, payload, length, frame))
+        write(&frame[0], frame.size());
+}
+
+inline void SimulatedArm::sendLine(const std::string &line) {
+    std::string terminated = line + "\n";
+    write((const uint8_t *)terminated.data(), terminated.size());
+}
+
+inline bool SimulatedArm::withinLimits(const Point3d &target) {
+    return target.x >= configuration.minimum.x && target.x <= configuration.maximum.x &&
+        target.y >= configuration.minimum.y && target.y <= configuration.maximum.y &&
+        target.z >= configuration.minimum.z && target.z <= configuration.maximum.z;
+}
+
+inline Point3d SimulatedArm::getPosition(double now) {
+    if(now <= moveStarted)
+        return from;
+    if(now >= moveEnds)
+        return to;
+    double fraction = (now - moveStarted)/(moveEnds - moveStarted);
+    return from + (to - from)*fraction;
+}
+
+inline bool SimulatedArm::isMoving() {
+    return moving;
+}
+
+inline void SimulatedArm::startMove(const Point3d &target, double delay, uint8_t sequence, double now) {
+    from = getPosition(now);
+    to = target;
+    // Each joint runs at its top speed, so the slowest one decides how long the move takes.
+    double travel = std::max(std::fabs(to.x - from.x)/configuration.speed.x,
+                             std::max(std::fabs(to.y - from.y)/configuration.speed.y, std::fabs(to.z - from.z)/configuration.speed.z));
+    moveStarted = now + delay;
+    moveEnds = moveStarted + travel;
+    moving = true;
+    moveSequence = sequence;
+}
+
+inline void SimulatedArm::reject(uint8_t sequence, ArmProtocol::ErrorCode code) {
+    statistics.rejected++;
+    if(textProtocol) {
+        sendLine("E");
+    } else {
+        uint8_t payload = (uint8_t)code;
+        sendFrame(ArmProtocol::ErrorMessage, sequence, &payload, 1);
+    }
+}
+
+inline bool SimulatedArm::execute(uint8_t type, const double *arguments, uint8_t sequence, double now) {
+    if(type == ArmProtocol::AbortMessage) {
+        startMove(configuration.rest, 0, sequence, now);
+    } else {
+        Point3d target(arguments[0], arguments[1], arguments[2]);
+        if(!withinLimits(target)) {
+            reject(sequence, ArmProtocol::OutOfReachError);
+            return false;
+        }
+        startMove(target, type == ArmProtocol::ScoopMessage ? configuration.scoopTime : 0, sequence, now);
+    }
+    statistics.commands++;
+    return true;
+}
+
+inline void SimulatedArm::receiveFrame(const ArmProtocol::Frame &frame, double now) {
+    if(frame.type != ArmProtocol::MoveMessage && frame.type != ArmProtocol::ScoopMessage && frame.type != ArmProtocol::AbortMessage) {
+        reject(frame.sequence, ArmProtocol::UnknownCommandError);
+        return;
+    }
+    if(std::find(recentSequences.begin(), recentSequences.end(), frame.sequence) != recentSequences.end()) {
+        statistics.duplicates++; // Our ack was lost and the host sent it again
+        sendFrame(ArmProtocol::AckMessage, frame.sequence, 0, 0);
+        return;
+    }
+    double arguments[ArmProtocol::commandArguments] = {0, 0, 0, 0, 0};
+    if(frame.type != ArmProtocol::AbortMessage && !ArmProtocol::decodeArguments(frame.payload, arguments)) {
+        reject(frame.sequence, ArmProtocol::BadArgumentsError);
+        return;
+    }
+    if(!execute(frame.type, arguments, frame.sequence, now))
+        return;
+    recentSequences.push_back(frame.sequence);
+    if(recentSequences.size() > 32) // Far more than the host keeps in flight, far less than the sequence numbers wrap in.
+        recentSequences.pop_front();
+    sendFrame(ArmProtocol::AckMessage, frame.sequence, 0, 0);
+}
+
+inline bool SimulatedArm::takeTextCommand(bool atEnd, double now) {
+    size_t start = textBuffer.find_first_of("MSA");
+    if(start == std::string::npos) { // Nothing but noise
+        textBuffer.clear();
+        return false;
+    }
+    textBuffer.erase(0, start);
+    char type = textBuffer[0];
+    size_t position = 1;
+    double arguments[ArmProtocol::commandArguments] = {0, 0, 0, 0, 0};
+    const char *separators = " ,\t\r\n";
+    for(size_t count = 0; type != 'A' && count < ArmProtocol::commandArguments; count++) {
+        size_t begin = textBuffer.find_first_not_of(separators, position);
+        if(begin == std::string::npos)
+            return false; // Wait for the rest
+        size_t end = textBuffer.find_first_of(" ,\t\r\nMSA", begin);
+        if(end == std::string::npos) {
+            if(!atEnd)
+                return false; // The number may not be finished
+            end = textBuffer.size();
+        }
+        std::string token = textBuffer.substr(begin, end - begin);
+        char *stop = 0;
+        arguments[count] = strtod(token.c_str(), &stop);
+        if(token.empty() || *stop != 0) { // Not a number, e.g. the next command before this one was finished
+            textBuffer.erase(0, 1);
+            reject(nextTextSequence++, ArmProtocol::BadArgumentsError);
+            return true;
+        }
+        position = end;
+    }
+    textBuffer.erase(0, position);
+    execute((uint8_t)type, arguments, nextTextSequence++, now);
+    return true;
+}
+
+inline void SimulatedArm::receive(const uint8_t *data, size_t length, double now) {
+    if(!textProtocol) {
+        decoder.push(data, length);
+        ArmProtocol::Frame frame;
+        while(decoder.next(frame))
+            receiveFrame(frame, now);
+        return;
+    }
+    textBuffer.append((const char *)data, length);
+    lastTextByte = now;
+    while(takeTextCommand(false, now)) {
+    }
+}
+
+inline void SimulatedArm::step(double now) {
+    // The old commands end without a newline, so the last number of one is only known to be finished when nothing follows it.
+    if(textProtocol && !textBuffer.empty() && now - lastTextByte >= configuration.textIdleTimeout) {
+        while(takeTextCommand(true, now)) {
+        }
+    }
+    if(moving && now >= moveEnds + configuration.settleTime) {
+        moving = false;
+        statistics.arrivals++;
+        if(textProtocol)
+            sendLine("D");
+        else
+            sendFrame(ArmProtocol::ArrivedMessage, moveSequence, 0, 0);
+    }
+    if(configuration.telemetryPeriod > 0 && now - lastPositionReport >= configuration.telemetryPeriod) {
+        lastPositionReport = now;
+        statistics.positionReports++;
+        Point3d position = getPosition(now);
+        if(textProtocol) {
+            char line[64];
+            snprintf(line, sizeof(line), "P %1.2f %1.2f %1.2f", position.x, position.y, position.z);
+            sendLine(line);
+        } else {
+            double arguments[ArmProtocol::commandArguments] = {position.x, position.y, position.z, 0, 0};
+            std::vector<uint8_t> payload;
+            if(ArmProtocol::encodeArguments(arguments, payload))
+                sendFrame(ArmProtocol::PositionMessage, moveSequence, &payload[0], payload.size());
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,191 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Puts a SimulatedArm on a POSIX pseudo-terminal, so anything that talks to the arm through a serial device (the app, or a
+ * headless tool through openSerialDevice) can be pointed at the terminal's path and drive it as it would the real arm.
+ *
+ * The arm runs on its own thread, waking for every byte from the host and at least every millisecond to move on.
+ */
+#ifndef SIMULATED_ARM_ENDPOINT_HPP
+#define SIMULATED_ARM_ENDPOINT_HPP
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "SimulatedArm.hpp"
+#include "StereoFrameGrabber.hpp"
+
+/**
+ * Open a serial device for raw, non-blocking reads and writes, as the app's serial port does.
+ * @param  path The device, e.g. the path of a SimulatedArmEndpoint.
+ * @return      The file descriptor, or -1 on failure.
+ */
+inline int openSerialDevice(const std::string &path) {
+    int descriptor = open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(descriptor < 0)
+        return -1;
+    struct termios options;
+    if(tcgetattr(descriptor, &options) == 0) {
+        cfmakeraw(&options);
+        tcsetattr(descriptor, TCSANOW, &options);
+    }
+    return descriptor;
+}
+
+/**
+ * Read one of the command line options shared by the tools that run a simulated arm:
+ *   --speed UNITS_PER_SECOND  Top speed of every joint.
+ *   --scoop-time SECONDS      Time spent at the bowl at the start of a scoop.
+ *   --settle-time SECONDS     Time from the joints stopping to reporting arrival.
+ *   --telemetry-period SECONDS  Time between position reports, 0 for none.
+ * @param  option        The option.
+ * @param  value         The argument after it.
+ * @param  configuration The configuration to set.
+ * @return               true if the option was one of these, false otherwise.
+ */
+inline bool parseSimulatedArmOption(const std::string &option, const char *value, SimulatedArm::Configuration &configuration) {
+    if(option == "--speed")
+        configuration.speed = Point3d(1, 1, 1)*atof(value);
+    else if(option == "--scoop-time")
+        configuration.scoopTime = atof(value);
+    else if(option == "--settle-time")
+        configuration.settleTime = atof(value);
+    else if(option == "--telemetry-period")
+        configuration.telemetryPeriod = atof(value);
+    else
+        return false;
+    return true;
+}
+
+class SimulatedArmEndpoint
+{
+    int master;
+    int slave; // Held open so the terminal stays up while no host has it open.
+    std::string path;
+    std::mutex armMutex;
+    SimulatedArm arm;
+    std::thread armThread;
+    std::atomic<bool> running;
+
+    inline void writeToHost(const uint8_t *data, size_t length);
+    inline void run();
+
+    SimulatedArmEndpoint(const SimulatedArmEndpoint&);
+    SimulatedArmEndpoint& operator=(const SimulatedArmEndpoint&);
+public:
+    /**
+     * Constructor for the SimulatedArmEndpoint. Call open, then start.
+     * @param text          true for the old text commands, false for the binary protocol.
+     * @param configuration The arm's limits and timing.
+     */
+    inline SimulatedArmEndpoint(bool text = false, const SimulatedArm::Configuration &configuration = SimulatedArm::Configuration());
+    /**
+     * Destructor for the SimulatedArmEndpoint. Stops the arm and closes the terminal.
+     */
+    inline ~SimulatedArmEndpoint();
+    /**
+     * Create the pseudo-terminal.
+     * @return true on success, false otherwise.
+     */
+    inline bool open();
+    /**
+     * The path for the host to open, e.g. /dev/pts/3. Empty until open succeeds.
+     */
+    inline const std::string &getPath() { return path; }
+    /**
+     * Start the arm's thread.
+     */
+    inline void start();
+    /**
+     * Stop the arm's thread and wait for it to finish.
+     */
+    inline void stop();
+    /**
+     * What the arm has done so far.
+     */
+    inline SimulatedArm::Statistics getStatistics();
+};
+
+inline SimulatedArmEndpoint::SimulatedArmEndpoint(bool text, const SimulatedArm::Configuration &configuration): master(-1), slave(-1),
+    arm([this] (const uint8_t *data, size_t length) { writeToHost(data, length); }, text, configuration), running(false) {
+}
+
+inline SimulatedArmEndpoint::~SimulatedArmEndpoint() {
+    stop();
+    if(slave >= 0)
+        close(slave);
+    if(master >= 0)
+        close(master);
+}
+
+inline bool SimulatedArmEndpoint::open() {
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+        return false;
+    const char *name = ptsname(master);
+    if(!name)
+        return false;
+    slave = openSerialDevice(name); // Raw mode is a property of the terminal, so this sets it for the host too
+    if(slave < 0)
+        return false;
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    path = name;
+    return true;
+}
+
+inline void SimulatedArmEndpoint::writeToHost(const uint8_t *data, size_t length) {
+    while(length > 0) {
+        ssize_t written = write(master, data, length);
+        if(written < 0) {
+            if(errno != EAGAIN && errno != EINTR)
+                return;
+            struct pollfd writable = {master, POLLOUT, 0};
+            poll(&writable, 1, 10); // A real arm's transmitter would stall too
+            continue;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+inline void SimulatedArmEndpoint::run() {
+    uint8_t buffer[1024];
+    while(running) {
+        struct pollfd readable = {master, POLLIN, 0};
+        poll(&readable, 1, 1);
+        double now = StereoFrameGrabber::now();
+        std::lock_guard<std::mutex> lock(armMutex);
+        ssize_t length;
+        while((length = read(master, buffer, sizeof(buffer))) > 0)
+            arm.receive(buffer, length, now);
+        arm.step(now);
+    }
+}
+
+inline void SimulatedArmEndpoint::start() {
+    if(running || master < 0)
+        return;
+    running = true;
+    armThread = std::thread(&SimulatedArmEndpoint::run, this);
+}
+
+inline void SimulatedArmEndpoint::stop() {
+    running = false;
+    if(armThread.joinable())
+        armThread.join();
+}
+
+inline SimulatedArm::Statistics SimulatedArmEndpoint::getStatistics() {
+    std::lock_guard<std::mutex> lock(armMutex);
+    return arm.getStatistics();
+}
+
+#endif
@@ -15,11 +15,18 @@
     commandAndTrack = [[MouthTrackerAndArmCommander alloc] init];
     commandAndTrack.delegate = self;
     
-    videoUpdateTimer = [NSTimer scheduledTimerWithTimeInterval:0.067
+    // Only refreshes the display; tracking runs on its own thread at the camera rate.
+    videoUpdateTimer = [NSTimer scheduledTimerWithTimeInterval:1.0/30.0
                                                         target:commandAndTrack selector:@selector(updateImagesAndCoordinates)
                                                       userInfo:nil repeats:YES];
 }
 
+- (void)applicationWillTerminate:(NSNotification *)aNotification
+{
+    // Keep the last few seconds of pipeline timings so a laggy session can be looked at afterwards.
+    [commandAndTrack saveTraceToFile:[NSTemporaryDirectory() stringByAppendingPathComponent:@"ImageGuidedFeedingSystemTrace.json"]];
+}
+
 - (IBAction)buttonPressedWithButton:(id)sender {
     NSButton* button = sender;
     NSString* buttonName = button.title;
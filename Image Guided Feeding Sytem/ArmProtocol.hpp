@@ -0,0 +1,480 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The binary protocol spoken to the feeding arm over its serial link, and ArmLink, which keeps a bounded pipeline of commands
+ * in flight over it. Neither depends on the platform: ArmLink writes through a function it is given and is handed the bytes
+ * that arrive, so it can be driven by ORSSerialPort in the app or a POSIX file descriptor (e.g. a pseudo-terminal) anywhere else.
+ *
+ * Every message is one frame:
+ *     0xA5 | type | sequence | length | payload (length bytes) | CRC-16 (little endian)
+ * The CRC is CRC-16/CCITT-FALSE over type, sequence, length and payload. A receiver that sees a bad CRC or an impossible
+ * length drops the sync byte and looks for the next one, so it recovers from noise without any other resynchronisation.
+ *
+ * Commands ('M' move, 'S' scoop, 'A' abort) carry the five arguments of the old text commands as little endian int16 in
+ * hundredths, 16 bytes a frame rather than about 35 characters. The arm answers each command it accepts with an 'K' ack
+ * carrying the same sequence number, sends 'D' with that number when it has finished the move, and 'E' with an error code
+ * when it rejects a command. Commands are sent again when their ack doesn't come back in time, so an arm given a command with
+ * the sequence number of one it has already accepted must ack it again without acting on it a second time. A move or scoop
+ * is never sent again once a newer one has been sent, nor once an abort has, so the arm can act on commands in the order
+ * they arrive without an old one taking it back to a stale target. An arm may also report its position with 'P' frames,
+ * which ArmLink ignores.
+ */
+#ifndef ARM_PROTOCOL_HPP
+#define ARM_PROTOCOL_HPP
+
+#include <stdint.h>
+#include <cmath>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <mutex>
+
+namespace ArmProtocol
+{
+    const uint8_t syncByte = 0xA5;
+    const size_t headerLength = 4; // Sync, type, sequence, length
+    const size_t crcLength = 2;
+    const size_t maxPayloadLength = 32;
+    const size_t commandArguments = 5;
+
+    enum MessageType {
+        MoveMessage = 'M', // Host to arm: move to the arguments.
+        ScoopMessage = 'S', // Host to arm: scoop, then move to the arguments.
+        AbortMessage = 'A', // Host to arm: stop and go to rest. No arguments.
+        AckMessage = 'K', // Arm to host: the command with this sequence number was accepted.
+        ArrivedMessage = 'D', // Arm to host: the command with this sequence number has finished.
+        ErrorMessage = 'E', // Arm to host: the command with this sequence number was rejected. One byte of error code.
+        PositionMessage = 'P' // Arm to host, unasked: where the arm is, as five arguments like a command's. Optional.
+    };
+
+    enum ErrorCode {
+        UnknownCommandError = 1,
+        BadArgumentsError = 2,
+        OutOfReachError = 3 // A target outside the arm's workspace.
+    };
+
+    /**
+     * One decoded frame.
+     */
+    struct Frame
+    {
+        uint8_t type;
+        uint8_t sequence;
+        std::vector<uint8_t> payload;
+        Frame(): type(0), sequence(0) {}
+    };
+
+    /**
+     * CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF).
+     */
+    inline uint16_t crc16(const uint8_t *data, size_t length, uint16_t crc = 0xFFFF);
+    /**
+     * Append a frame to a buffer.
+     * @param  type     The message type.
+     * @param  sequence The sequence number.
+     * @param  payload  The payload, or null if length is 0.
+     * @param  length   The length of the payload. At most maxPayloadLength.
+     * @param  out      The buffer the frame is appended to.
+     * @return          true if the frame was encoded, false if the payload is too long.
+     */
+    inline bool encodeFrame(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length, std::vector<uint8_t> &out);
+    /**
+     * Append the payload of a command to a buffer.
+     * @param  arguments commandArguments values, sent in hundredths.
+     * @param  out       The buffer the payload is appended to.
+     * @return           true if every value fits, false if one is out of range (nothing is appended).
+     */
+    inline bool encodeArguments(const double *arguments, std::vector<uint8_t> &out);
+    /**
+     * Read the arguments of a command payload.
+     * @param  payload   The payload of a move or scoop frame.
+     * @param  arguments Where the commandArguments values will be stored.
+     * @return           true if the payload is the right length, false otherwise.
+     */
+    inline bool decodeArguments(const std::vector<uint8_t> &payload, double *arguments);
+
+    /**
+     * Splits a byte stream into frames. Bytes can be pushed in whatever pieces they arrive in.
+     */
+    class FrameDecoder
+    {
+        std::vector<uint8_t> buffer;
+        unsigned long badFrames;
+    public:
+        FrameDecoder(): badFrames(0) {}
+        /**
+         * Add bytes from the link.
+         */
+        inline void push(const uint8_t *data, size_t length);
+        /**
+         * Take the next complete frame.
+         * @param  frame reference to where the frame will be stored.
+         * @return       true if a frame was stored, false if more bytes are needed.
+         */
+        inline bool next(Frame &frame);
+        /**
+         * The number of candidate frames thrown away for a bad CRC or length.
+         */
+        unsigned long getBadFrames() { return badFrames; }
+    };
+}
+
+/**
+ * Sends commands to the arm with acknowledgement and retransmission, keeping up to maxInFlight unacknowledged commands
+ * on the wire and up to maxQueued more waiting behind them. Safe to use from several threads, e.g. receive on the serial
+ * port's reader and everything else on the main thread. The callbacks run on the thread that called receive or poll, with
+ * no lock held, so they may call back into the link.
+ */
+class ArmLink
+{
+public:
+    typedef std::function<void(const uint8_t *, size_t)> Writer;
+    typedef std::function<void(uint8_t)> SequenceCallback;
+
+    struct Statistics
+    {
+        unsigned long commandsSent;
+        unsigned long retransmissions;
+        unsigned long acks;
+        unsigned long arrivals;
+        unsigned long failures; // Commands given up on after maxRetries, or rejected by the arm.
+        unsigned long replacedMoves; // Queued moves replaced by a newer target before they were sent.
+        unsigned long supersededMoves; // Unacknowledged moves and scoops not sent again because a newer command had been sent.
+        Statistics(): commandsSent(0), retransmissions(0), acks(0), arrivals(0), failures(0), replacedMoves(0), supersededMoves(0) {}
+    };
+private:
+    struct Command
+    {
+        uint8_t type;
+        uint8_t sequence;
+        std::vector<uint8_t> frame;
+        double lastSent;
+        int retries;
+        bool servo; // A servo target, which a newer one may replace while both are queued.
+    };
+
+    std::mutex mutex; // Guards everything below. Held while writing, so the writer must not block.
+    Writer write;
+    std::deque<Command> inFlight; // Sent and not yet acknowledged, oldest first.
+    std::deque<Command> queued; // Waiting for room in inFlight.
+    ArmProtocol::FrameDecoder decoder;
+    size_t maxInFlight;
+    size_t maxQueued;
+    double ackTimeout; // Seconds before an unacknowledged command is sent again.
+    int maxRetries;
+    uint8_t nextSequence;
+    Statistics statistics;
+
+    inline bool enqueue(uint8_t type, const double *arguments, double now, uint8_t *sequence, bool replaceQueuedMove);
+    inline void transmit(Command &command, double now);
+    inline void fill(double now);
+    inline static bool isMotion(const Command &command);
+public:
+    SequenceCallback onArrived; // Called when the arm reports a command finished. Set both before the link is used.
+    SequenceCallback onFailed; // Called when a command is rejected or never acknowledged.
+
+    /**
+     * Constructor for the ArmLink.
+     * @param writer          Writes bytes to the link.
+     * @param inFlightWindow  The most commands sent and not yet acknowledged.
+     * @param queueLength     The most commands waiting to be sent.
+     * @param timeout         How long to wait for an ack before sending a command again, in seconds.
+     * @param retries         How many times to send a command again before giving up on it.
+     */
+    inline ArmLink(const Writer &writer, size_t inFlightWindow = 4, size_t queueLength = 8, double timeout = 0.1, int retries = 3);
+    /**
+     * Send a move, or queue it if the window is full.
+     * @param  arguments         ArmProtocol::commandArguments values.
+     * @param  now               The current time, in seconds.
+     * @param  sequence          If not null, where the sequence number of the command will be stored.
+     * @param  replaceQueuedMove true for a servo target, where only the newest matters: it overwrites a servo target that is
+     *                           still waiting to be sent instead of queueing behind it. Other queued moves are never replaced.
+     * @return                   true if the command was sent or queued, false if the queue is full or a value is out of range.
+     */
+    inline bool sendMove(const double *arguments, double now, uint8_t *sequence = 0, bool replaceQueuedMove = false);
+    /**
+     * Send a scoop, or queue it if the window is full. See sendMove.
+     */
+    inline bool sendScoop(const double *arguments, double now, uint8_t *sequence = 0);
+    /**
+     * Drop every queued command and every unacknowledged move and scoop, and send an abort straight away. Dropped commands
+     * are not reported to onFailed.
+     * @param  now      The current time, in seconds.
+     * @param  sequence If not null, where the sequence number of the abort will be stored.
+     */
+    inline void sendAbort(double now, uint8_t *sequence = 0);
+    /**
+     * Hand over bytes that arrived from the arm.
+     */
+    inline void receive(const uint8_t *data, size_t length, double now);
+    /**
+     * Send again anything not acknowledged in time, except moves and scoops a newer one has followed. Call regularly.
+     */
+    inline void poll(double now);
+    /**
+     * Tells us if every command has been acknowledged.
+     */
+    inline bool isIdle();
+    inline Statistics getStatistics();
+    inline unsigned long getBadFrames();
+};
+
+inline uint16_t ArmProtocol::crc16(const uint8_t *data, size_t length, uint16_t crc) {
+    for(size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for(int bit = 0; bit < 8; bit++)
+            crc = crc & 0x8000 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+inline bool ArmProtocol::encodeFrame(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length, std::vector<uint8_t> &out) {
+    if(length > maxPayloadLength)
+        return false;
+    size_t start = out.size();
+    out.push_back(syncByte);
+    out.push_back(type);
+    out.push_back(sequence);
+    out.push_back((uint8_t)length);
+    out.insert(out.end(), payload, payload + length);
+    uint16_t crc = crc16(&out[start + 1], headerLength - 1 + length);
+    out.push_back((uint8_t)(crc & 0xFF));
+    out.push_back((uint8_t)(crc >> 8));
+    return true;
+}
+
+inline bool ArmProtocol::encodeArguments(const double *arguments, std::vector<uint8_t> &out) {
+    int16_t values[commandArguments];
+    for(size_t i = 0; i < commandArguments; i++) {
+        double hundredths = std::floor(arguments[i]*100 + 0.5);
+        if(!(hundredths >= -32768 && hundredths <= 32767)) // Also catches NaN
+            return false;
+        values[i] = (int16_t)hundredths;
+    }
+    for(size_t i = 0; i < commandArguments; i++) {
+        uint16_t value = (uint16_t)values[i];
+        out.push_back((uint8_t)(value & 0xFF));
+        out.push_back((uint8_t)(value >> 8));
+    }
+    return true;
+}
+
+inline bool ArmProtocol::decodeArguments(const std::vector<uint8_t> &payload, double *arguments) {
+    if(payload.size() != commandArguments*2)
+        return false;
+    for(size_t i = 0; i < commandArguments; i++)
+        arguments[i] = (int16_t)(payload[2*i] | payload[2*i + 1] << 8)/100.0;
+    return true;
+}
+
+inline void ArmProtocol::FrameDecoder::push(const uint8_t *data, size_t length) {
+    buffer.insert(buffer.end(), data, data + length);
+}
+
+inline bool ArmProtocol::FrameDecoder::next(Frame &frame) {
+    size_t start = 0;
+    bool found = false;
+    while(!found) {
+        while(start < buffer.size() && buffer[start] != syncByte)
+            start++;
+        if(buffer.size() - start < headerLength)
+            break;
+        size_t length = buffer[start + 3];
+        if(length > maxPayloadLength) {
+            badFrames++;
+            start++;
+            continue;
+        }
+        if(buffer.size() - start < headerLength + length + crcLength)
+            break;
+        const uint8_t *bytes = &buffer[start];
+        uint16_t crc = bytes[headerLength + length] | bytes[headerLength + length + 1] << 8;
+        if(crc != crc16(bytes + 1, headerLength - 1 + length)) {
+            badFrames++;
+            start++;
+            continue;
+        }
+        frame.type = bytes[1];
+        frame.sequence = bytes[2];
+        frame.payload.assign(bytes + headerLength, bytes + headerLength + length);
+        start += headerLength + length + crcLength;
+        found = true;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + start);
+    return found;
+}
+
+inline ArmLink::ArmLink(const Writer &writer, size_t inFlightWindow, size_t queueLength, double timeout, int retries): write(writer),
+    maxInFlight(inFlightWindow), maxQueued(queueLength), ackTimeout(timeout), maxRetries(retries), nextSequence(0) {
+}
+
+inline void ArmLink::transmit(Command &command, double now) {
+    command.lastSent = now;
+    write(&command.frame[0], command.frame.size());
+}
+
+inline void ArmLink::fill(double now) {
+    while(!queued.empty() && inFlight.size() < maxInFlight) {
+        inFlight.push_back(queued.front());
+        queued.pop_front();
+        transmit(inFlight.back(), now);
+        statistics.commandsSent++;
+    }
+}
+
+inline bool ArmLink::isMotion(const Command &command) {
+    return command.type == ArmProtocol::MoveMessage || command.type == ArmProtocol::ScoopMessage;
+}
+
+inline bool ArmLink::enqueue(uint8_t type, const double *arguments, double now, uint8_t *sequence, bool replaceQueuedMove) {
+    std::vector<uint8_t> payload;
+    if(arguments && !ArmProtocol::encodeArguments(arguments, payload))
+        return false;
+    Command *command = 0;
+    if(replaceQueuedMove && !queued.empty() && queued.back().type == type && queued.back().servo) {
+        command = &queued.back(); // Keeps its place and sequence number; only the target changes.
+        command->frame.clear();
+        statistics.replacedMoves++;
+    } else {
+        if(queued.size() >= maxQueued)
+            return false;
+        queued.push_back(Command());
+        command = &queued.back();
+        command->type = type;
+        command->sequence = nextSequence++;
+        command->lastSent = 0;
+        command->retries = 0;
+        command->servo = replaceQueuedMove;
+    }
+    ArmProtocol::encodeFrame(type, command->sequence, payload.empty() ? 0 : &payload[0], payload.size(), command->frame);
+    if(sequence)
+        *sequence = command->sequence;
+    fill(now);
+    return true;
+}
+
+inline bool ArmLink::sendMove(const double *arguments, double now, uint8_t *sequence, bool replaceQueuedMove) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return enqueue(ArmProtocol::MoveMessage, arguments, now, sequence, replaceQueuedMove);
+}
+
+inline bool ArmLink::sendScoop(const double *arguments, double now, uint8_t *sequence) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return enqueue(ArmProtocol::ScoopMessage, arguments, now, sequence, false);
+}
+
+inline void ArmLink::sendAbort(double now, uint8_t *sequence) {
+    std::lock_guard<std::mutex> lock(mutex);
+    queued.clear();
+    for(size_t i = 0; i < inFlight.size();) {
+        if(isMotion(inFlight[i]))
+            inFlight.erase(inFlight.begin() + i);
+        else
+            i++;
+    }
+    Command abort;
+    abort.type = ArmProtocol::AbortMessage;
+    abort.sequence = nextSequence++;
+    abort.retries = 0;
+    abort.servo = false;
+    ArmProtocol::encodeFrame(abort.type, abort.sequence, 0, 0, abort.frame);
+    inFlight.push_back(abort); // Goes out even if the window is full.
+    transmit(inFlight.back(), now);
+    statistics.commandsSent++;
+    if(sequence)
+        *sequence = abort.sequence;
+}
+
+inline void ArmLink::receive(const uint8_t *data, size_t length, double now) {
+    std::vector<uint8_t> arrived, failed;
+    std::unique_lock<std::mutex> lock(mutex);
+    decoder.push(data, length);
+    ArmProtocol::Frame frame;
+    while(decoder.next(frame)) {
+        if(frame.type == ArmProtocol::AckMessage || frame.type == ArmProtocol::ErrorMessage) {
+            for(size_t i = 0; i < inFlight.size(); i++) {
+                if(inFlight[i].sequence != frame.sequence)
+                    continue;
+                inFlight.erase(inFlight.begin() + i);
+                if(frame.type == ArmProtocol::AckMessage) {
+                    statistics.acks++;
+                } else {
+                    statistics.failures++;
+                    failed.push_back(frame.sequence);
+                }
+                break;
+            }
+        } else if(frame.type == ArmProtocol::ArrivedMessage) {
+            for(size_t i = 0; i < inFlight.size(); i++) {
+                if(inFlight[i].sequence == frame.sequence) { // The ack was lost, but the arm clearly has the command.
+                    inFlight.erase(inFlight.begin() + i);
+                    break;
+                }
+            }
+            statistics.arrivals++;
+            arrived.push_back(frame.sequence);
+        }
+    }
+    fill(now);
+    lock.unlock();
+    for(size_t i = 0; i < failed.size(); i++)
+        if(onFailed)
+            onFailed(failed[i]);
+    for(size_t i = 0; i < arrived.size(); i++)
+        if(onArrived)
+            onArrived(arrived[i]);
+}
+
+inline void ArmLink::poll(double now) {
+    std::vector<uint8_t> failed;
+    std::unique_lock<std::mutex> lock(mutex);
+    bool newerMotion = false; // Whether a move or scoop after this one has been sent
+    for(size_t i = inFlight.size(); i-- > 0;) {
+        if(!isMotion(inFlight[i]))
+            continue;
+        if(newerMotion && now - inFlight[i].lastSent >= ackTimeout) {
+            inFlight.erase(inFlight.begin() + i);
+            statistics.supersededMoves++;
+        }
+        newerMotion = true;
+    }
+    for(size_t i = 0; i < inFlight.size();) {
+        Command &command = inFlight[i];
+        if(now - command.lastSent < ackTimeout) {
+            i++;
+        } else if(command.retries < maxRetries) {
+            command.retries++;
+            statistics.retransmissions++;
+            transmit(command, now);
+            i++;
+        } else {
+            uint8_t sequence = command.sequence;
+            inFlight.erase(inFlight.begin() + i);
+            statistics.failures++;
+            failed.push_back(sequence);
+        }
+    }
+    fill(now);
+    lock.unlock();
+    for(size_t i = 0; i < failed.size(); i++)
+        if(onFailed)
+            onFailed(failed[i]);
+}
+
+inline bool ArmLink::isIdle() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return inFlight.empty() && queued.empty();
+}
+
+inline ArmLink::Statistics ArmLink::getStatistics() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return statistics;
+}
+
+inline unsigned long ArmLink::getBadFrames() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return decoder.getBadFrames();
+}
+
+#endif
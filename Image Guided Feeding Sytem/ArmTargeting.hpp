@@ -0,0 +1,88 @@
+/**
+ * @file
+ * @section Description
+ *
+ * How a tracked mouth position becomes a command for the arm: the point to aim at, the change from the cameras' coordinates
+ * to the arm's, and the arguments and text of each command. MouthTrackerAndArmCommander sends what these give, and the
+ * headless tools use the same functions, so what they measure is what the app sends.
+ */
+#ifndef ARM_TARGETING_HPP
+#define ARM_TARGETING_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <cstdio>
+#include "FeedingSequence.hpp"
+#include "TrackingLoop.hpp"
+#include "ArmProtocol.hpp"
+using namespace cv;
+
+namespace ArmTargeting
+{
+    // Rough time from sending a move to the arm reaching the mouth, in seconds. Moves aim at where the mouth will be by then.
+    const double leadTime = 0.3;
+
+    /**
+     * Where the mouth in a tracking result is expected to be at a given time.
+     * @param  result The tracking result.
+     * @param  time   The time, in seconds on StereoFrameGrabber::now().
+     * @return        The smoothed position brought forward to time, or the last position found if there is no motion estimate.
+     */
+    inline Point3d aimPoint(const TrackingResult &result, double time);
+    /**
+     * The mouth position as the app shows it: the tracker's position scaled and flipped to face the user.
+     */
+    inline Point3d displayCoordinates(const Point3d &mouth);
+    /**
+     * The arm's coordinates of a position from displayCoordinates.
+     */
+    inline Point3d armCoordinates(const Point3d &display);
+    /**
+     * The arguments of a move or scoop command.
+     * @param command   The command. Moves other than inserts stop clear of the mouth; only retrieves stop level with it.
+     * @param arguments Where the ArmProtocol::commandArguments values will be stored.
+     */
+    inline void commandArguments(const FeedingSequence::ArmCommand &command, double *arguments);
+    /**
+     * A command in the old text protocol, e.g. "M 10.00 -20.00 5.50 0.00 1.00". Rest commands are "A".
+     */
+    inline std::string textCommand(const FeedingSequence::ArmCommand &command);
+}
+
+inline Point3d ArmTargeting::aimPoint(const TrackingResult &result, double time) {
+    return result.motion.valid ? result.motion.predict(time) : result.position;
+}
+
+inline Point3d ArmTargeting::displayCoordinates(const Point3d &mouth) {
+    return Point3d(mouth.x * -2.0, mouth.y * 2.0, mouth.z * -2.0);
+}
+
+inline Point3d ArmTargeting::armCoordinates(const Point3d &display) {
+    return Point3d(display.x - 22.0, display.z - 18, display.y + 19.5);
+}
+
+inline void ArmTargeting::commandArguments(const FeedingSequence::ArmCommand &command, double *arguments) {
+    Point3d arm = armCoordinates(displayCoordinates(command.mouth));
+    arguments[0] = arm.x;
+    arguments[1] = arm.y;
+    arguments[2] = arm.z;
+    arguments[3] = 0.0;
+    arguments[4] = 1.0;
+    if(command.type != FeedingSequence::InsertCommand)
+        arguments[1] -= 15; // Clear of the mouth
+    if(command.type != FeedingSequence::RetrieveCommand)
+        arguments[2] += 3.0;
+}
+
+inline std::string ArmTargeting::textCommand(const FeedingSequence::ArmCommand &command) {
+    if(command.type == FeedingSequence::RestCommand)
+        return "A";
+    double arguments[ArmProtocol::commandArguments];
+    commandArguments(command, arguments);
+    char text[128];
+    snprintf(text, sizeof(text), "%c %1.2f %1.2f %1.2f %1.2f %1.2f", command.type == FeedingSequence::ScoopCommand ? 'S' : 'M',
+             arguments[0], arguments[1], arguments[2], arguments[3], arguments[4]);
+    return text;
+}
+
+#endif
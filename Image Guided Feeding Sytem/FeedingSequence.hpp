@@ -0,0 +1,223 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The FeedingSequence class decides what the arm does during one feed: scoop, insert, retrieve, rest. It is stepped at a fixed
+ * control rate with the latest view of the mouth and returns the command to send, if any.
+ *
+ * While inserting it servos: a new target is sent whenever the mouth moves further than a dead band from the last one, and the
+ * insert is abandoned if the mouth closes or tracking loses it. Each phase ends when the arm reports that it has arrived, so
+ * a feed takes as long as the arm does. Arms that never report still get through a feed, as each phase also ends after the
+ * time the old fixed sequence allowed for it.
+ *
+ * It knows nothing of the serial port or of arm coordinates; positions are mouth positions as tracked, in the units of the
+ * calibration, and times are in seconds on any monotonic clock.
+ */
+#ifndef FEEDING_SEQUENCE_HPP
+#define FEEDING_SEQUENCE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <cmath>
+using namespace cv;
+
+class FeedingSequence
+{
+public:
+    enum Phase {
+        Idle,
+        Scooping, // Waiting for the arm to finish the scoop.
+        Inserting, // Servoing the spoon to the mouth.
+        Retrieving // Waiting for the arm to back away from the mouth.
+    };
+
+    enum CommandType {
+        NoCommand,
+        ScoopCommand, // Scoop, then wait clear of the mouth. Sent once at the start.
+        InsertCommand, // Move the spoon into the mouth. Sent every time the target moves.
+        RetrieveCommand, // Back away from the mouth.
+        RestCommand // Stop and go to rest. Ends the feed.
+    };
+
+    /**
+     * What the arm should do, aimed at the mouth position given.
+     */
+    struct ArmCommand
+    {
+        CommandType type;
+        Point3d mouth;
+        ArmCommand(): type(NoCommand), mouth(0, 0, 0) {}
+        ArmCommand(CommandType commandType, const Point3d &target): type(commandType), mouth(target) {}
+    };
+
+    /**
+     * The mouth as the tracker currently sees it.
+     */
+    struct MouthObservation
+    {
+        bool tracked; // False if the mouth has not been found recently enough to aim at.
+        Point3d position; // Where to aim, e.g. the position predicted for when the arm will get there.
+        bool isOpen;
+        MouthObservation(): tracked(false), position(0, 0, 0), isOpen(false) {}
+    };
+
+    /**
+     * How long each phase may last when the arm doesn't report arriving, and when to give up on an insert.
+     */
+    struct Timing
+    {
+        double scoopTimeout; // Seconds
+        double insertTimeout;
+        double retrieveTimeout;
+        double closedGrace; // How long the mouth may look closed before the insert is abandoned, to ride out detection flicker.
+        Timing(): scoopTimeout(15.0), insertTimeout(5.0), retrieveTimeout(5.0), closedGrace(0.2) {}
+    };
+private:
+    Phase phase;
+    Timing timing;
+    double deadBand; // How far the mouth must move before the insert target is updated, in calibration units.
+    double phaseStarted;
+    bool arrived; // True if the arm has reported arriving since the last command was sent.
+    bool mouthWasOpen;
+    double closedSince;
+    Point3d lastTarget;
+    std::string stopReason;
+
+    inline void enterPhase(Phase newPhase, double now);
+    inline ArmCommand send(CommandType type, const Point3d &target);
+    inline ArmCommand stop(const std::string &reason);
+public:
+    /**
+     * Constructor for the FeedingSequence.
+     * @param phaseTiming   Fallback phase lengths and the closed mouth grace period.
+     * @param targetDeadBand How far the mouth must move before a new insert target is sent, in calibration units.
+     */
+    inline FeedingSequence(const Timing &phaseTiming = Timing(), double targetDeadBand = 0.5);
+    /**
+     * Start a feed. Does nothing if one is already running, and refuses, as if the feed had been stopped at once, if the mouth
+     * isn't tracked.
+     * @param  mouth The mouth as currently seen.
+     * @param  now   The current time.
+     * @return       The command to send: ScoopCommand, or RestCommand if the feed was refused.
+     */
+    inline ArmCommand start(const MouthObservation &mouth, double now);
+    /**
+     * Step the sequence. Call at the control rate while a feed is running.
+     * @param  mouth The mouth as currently seen.
+     * @param  now   The current time.
+     * @return       The command to send, which is NoCommand if the arm should carry on with the last one.
+     */
+    inline ArmCommand update(const MouthObservation &mouth, double now);
+    /**
+     * Tell the sequence that the arm has finished its last move.
+     */
+    inline void armArrived();
+    /**
+     * Abandon the feed. Safe to call when no feed is running.
+     * @param  reason Why, for getStopReason.
+     * @return        The command to send (always RestCommand).
+     */
+    inline ArmCommand abort(const std::string &reason);
+    /**
+     * The phase the feed is in.
+     * @return the phase, or Idle if no feed is running.
+     */
+    inline Phase getPhase();
+    /**
+     * Why the last feed ended early.
+     * @return the reason, or an empty string if it finished normally or is still running.
+     */
+    inline const std::string &getStopReason();
+};
+
+inline FeedingSequence::FeedingSequence(const Timing &phaseTiming, double targetDeadBand): phase(Idle), timing(phaseTiming),
+    deadBand(targetDeadBand), phaseStarted(0), arrived(false), mouthWasOpen(true), closedSince(0), lastTarget(0, 0, 0) {
+}
+
+inline void FeedingSequence::enterPhase(Phase newPhase, double now) {
+    phase = newPhase;
+    phaseStarted = now;
+}
+
+inline FeedingSequence::ArmCommand FeedingSequence::send(CommandType type, const Point3d &target) {
+    arrived = false;
+    lastTarget = target;
+    return ArmCommand(type, target);
+}
+
+inline FeedingSequence::ArmCommand FeedingSequence::stop(const std::string &reason) {
+    phase = Idle;
+    stopReason = reason;
+    return ArmCommand(RestCommand, lastTarget);
+}
+
+inline FeedingSequence::ArmCommand FeedingSequence::start(const MouthObservation &mouth, double now) {
+    if(phase != Idle)
+        return ArmCommand();
+    if(!mouth.tracked)
+        return stop("Mouth not tracked");
+    stopReason.clear();
+    mouthWasOpen = true;
+    enterPhase(Scooping, now);
+    return send(ScoopCommand, mouth.position);
+}
+
+inline FeedingSequence::ArmCommand FeedingSequence::update(const MouthObservation &mouth, double now) {
+    double elapsed = now - phaseStarted;
+    switch(phase) {
+        case Idle:
+            return ArmCommand();
+        case Scooping:
+            if(!arrived && elapsed < timing.scoopTimeout)
+                return ArmCommand();
+            enterPhase(Inserting, now);
+            if(!mouth.tracked)
+                return stop("Mouth lost before the insert");
+            return send(InsertCommand, mouth.position);
+        case Inserting: {
+            if(!mouth.tracked)
+                return stop("Mouth lost during the insert");
+            if(mouth.isOpen) {
+                mouthWasOpen = true;
+            } else {
+                if(mouthWasOpen)
+                    closedSince = now;
+                mouthWasOpen = false;
+                if(now - closedSince >= timing.closedGrace)
+                    return stop("Mouth closed during the insert");
+            }
+            Point3d offset = mouth.position - lastTarget;
+            bool targetMoved = std::sqrt(offset.dot(offset)) > deadBand;
+            if((arrived && !targetMoved) || elapsed >= timing.insertTimeout) { // At the mouth, or out of time
+                enterPhase(Retrieving, now);
+                return send(RetrieveCommand, lastTarget);
+            }
+            if(targetMoved)
+                return send(InsertCommand, mouth.position);
+            return ArmCommand();
+        }
+        case Retrieving:
+            if(!arrived && elapsed < timing.retrieveTimeout)
+                return ArmCommand();
+            return stop("");
+    }
+    return ArmCommand();
+}
+
+inline void FeedingSequence::armArrived() {
+    arrived = true;
+}
+
+inline FeedingSequence::ArmCommand FeedingSequence::abort(const std::string &reason) {
+    return stop(phase == Idle ? std::string() : reason); // Nothing was stopped if no feed was running
+}
+
+inline FeedingSequence::Phase FeedingSequence::getPhase() {
+    return phase;
+}
+
+inline const std::string &FeedingSequence::getStopReason() {
+    return stopReason;
+}
+
+#endif
@@ -0,0 +1,176 @@
+/**
+ * @file
+ * @section Description
+ *
+ * A FrameSource is anything the StereoFrameGrabber can read frames from: a camera, a video file, a sequence of image files or
+ * frames generated in code. Frames are read the same way as from a VideoCapture, with grab() to take the frame and retrieve()
+ * to decode it, so the time a frame was taken can be recorded before it is decoded.
+ */
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdio>
+#include <unistd.h>
+using namespace cv;
+
+class FrameSource
+{
+public:
+    virtual ~FrameSource() {}
+    /**
+     * Tells us if the source was opened and can deliver frames.
+     * @return true if the source is open, otherwise false.
+     */
+    virtual bool isOpened() = 0;
+    /**
+     * Take the next frame.
+     * @return true if there was a frame, false at the end of the source.
+     */
+    virtual bool grab() = 0;
+    /**
+     * Decode the frame taken by the last grab().
+     * @param  frame The Mat in which to store the frame. Its buffer is reused if it is the right size.
+     * @return       true if successful, false otherwise.
+     */
+    virtual bool retrieve(Mat &frame) = 0;
+};
+
+/**
+ * Reads frames through an OpenCV VideoCapture: a camera, a video file, or an image sequence named with a printf style pattern.
+ */
+class VideoCaptureFrameSource: public FrameSource
+{
+    VideoCapture capture;
+public:
+    /**
+     * Open a camera.
+     * @param cameraIndex The index of the camera, e.g. 0 for the first camera.
+     */
+    inline VideoCaptureFrameSource(int cameraIndex): capture(cameraIndex) {}
+    /**
+     * Open a video file or an image sequence (e.g. left_%04d.png).
+     * @param fileName The path to the file or the pattern.
+     */
+    inline VideoCaptureFrameSource(const std::string &fileName): capture(fileName) {}
+    inline bool isOpened() { return capture.isOpened(); }
+    inline bool grab() { return capture.grab(); }
+    inline bool retrieve(Mat &frame) { return capture.retrieve(frame); }
+};
+
+/**
+ * Reads a list of image files in order, optionally starting over at the end.
+ */
+class ImageSequenceFrameSource: public FrameSource
+{
+    std::vector<std::string> fileNames;
+    size_t nextFrame;
+    size_t grabbedFrame;
+    bool loop;
+public:
+    /**
+     * Constructor for the ImageSequenceFrameSource.
+     * @param files       The paths of the images, in the order they should be read.
+     * @param loopForever true to start again from the first image after the last one.
+     */
+    inline ImageSequenceFrameSource(const std::vector<std::string> &files, bool loopForever = false);
+    /**
+     * Make a source from a printf style pattern such as frames/left_%04d.png, numbered from firstIndex until a file is missing.
+     * @param  pattern     The pattern of the file names.
+     * @param  firstIndex  The number of the first file.
+     * @param  loopForever true to start again from the first image after the last one.
+     * @return             A new source, to be deleted by the caller.
+     */
+    static inline ImageSequenceFrameSource *fromPattern(const std::string &pattern, int firstIndex = 0, bool loopForever = false);
+    inline bool isOpened();
+    inline bool grab();
+    inline bool retrieve(Mat &frame);
+};
+
+/**
+ * Generates frames in code, e.g. a scene with a known moving target for testing the pipeline without cameras.
+ */
+class SyntheticFrameSource: public FrameSource
+{
+public:
+    /**
+     * Draws frame number frameIndex into frame, which is already the size and type given to the SyntheticFrameSource.
+     */
+    typedef std::function<void(unsigned long frameIndex, Mat &frame)> FrameGenerator;
+private:
+    cv::Size frameSize;
+    int frameType;
+    unsigned long frameCount;
+    unsigned long nextFrame;
+    FrameGenerator generator;
+public:
+    /**
+     * Constructor for the SyntheticFrameSource.
+     * @param size      The size of the frames.
+     * @param generate  The function that draws each frame.
+     * @param count     The number of frames to generate, or 0 to never stop.
+     * @param type      The type of the frames.
+     */
+    inline SyntheticFrameSource(cv::Size size, FrameGenerator generate, unsigned long count = 0, int type = CV_8UC3):
+        frameSize(size), frameType(type), frameCount(count), nextFrame(0), generator(generate) {}
+    inline bool isOpened() { return true; }
+    inline bool grab();
+    inline bool retrieve(Mat &frame);
+};
+
+inline ImageSequenceFrameSource::ImageSequenceFrameSource(const std::vector<std::string> &files, bool loopForever):
+    fileNames(files), nextFrame(0), grabbedFrame(0), loop(loopForever) {
+}
+
+inline ImageSequenceFrameSource *ImageSequenceFrameSource::fromPattern(const std::string &pattern, int firstIndex, bool loopForever) {
+    std::vector<std::string> files;
+    for(int index = firstIndex; ; index++) {
+        char fileName[1024];
+        snprintf(fileName, sizeof(fileName), pattern.c_str(), index);
+        if(access(fileName, R_OK) != 0)
+            break;
+        files.push_back(fileName);
+    }
+    return new ImageSequenceFrameSource(files, loopForever);
+}
+
+inline bool ImageSequenceFrameSource::isOpened() {
+    return !fileNames.empty();
+}
+
+inline bool ImageSequenceFrameSource::grab() {
+    if(nextFrame >= fileNames.size()) {
+        if(!loop || fileNames.empty())
+            return false;
+        nextFrame = 0;
+    }
+    grabbedFrame = nextFrame++;
+    return true;
+}
+
+inline bool ImageSequenceFrameSource::retrieve(Mat &frame) {
+    if(grabbedFrame >= fileNames.size())
+        return false;
+    frame = imread(fileNames[grabbedFrame], CV_LOAD_IMAGE_COLOR);
+    return !frame.empty();
+}
+
+inline bool SyntheticFrameSource::grab() {
+    if(frameCount != 0 && nextFrame >= frameCount)
+        return false;
+    nextFrame++;
+    return true;
+}
+
+inline bool SyntheticFrameSource::retrieve(Mat &frame) {
+    if(nextFrame == 0)
+        return false;
+    frame.create(frameSize, frameType);
+    generator(nextFrame - 1, frame);
+    return true;
+}
+
+#endif
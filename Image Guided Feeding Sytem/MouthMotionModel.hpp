@@ -0,0 +1,143 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The MouthMotionModel class tracks the position and velocity of the mouth with a constant velocity Kalman filter fed with
+ * every position the pipeline finds. It smooths the frame to frame jitter of triangulation, and lets the arm commander aim at
+ * where the mouth will be when the arm gets there rather than where it was when the frames were captured.
+ *
+ * Positions are in the units of the calibration and times in seconds on StereoFrameGrabber::now(). Each measurement is
+ * applied at the time its frames were captured, so processing delays don't distort the velocity.
+ */
+#ifndef MOUTH_MOTION_MODEL_HPP
+#define MOUTH_MOTION_MODEL_HPP
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+using namespace cv;
+
+/**
+ * The state of a MouthMotionModel at one moment. Cheap to copy, so it can be published with each tracking result.
+ */
+struct MouthMotionEstimate
+{
+    bool valid; // False until the mouth has been found, and again once it has been lost for too long.
+    Point3d position; // Filtered position at timestamp.
+    Point3d velocity; // Units per second.
+    double timestamp; // When the estimate applies, in seconds on StereoFrameGrabber::now().
+    MouthMotionEstimate(): valid(false), position(0, 0, 0), velocity(0, 0, 0), timestamp(0) {}
+    /**
+     * Extrapolate the position to another time.
+     * @param  time              The time to predict the position at, in seconds on StereoFrameGrabber::now().
+     * @param  maxLeadSeconds    The furthest past timestamp to extrapolate. Later times get the position at timestamp + maxLeadSeconds,
+     *                           so a brief movement can't throw the prediction far away.
+     * @return                   The predicted position.
+     */
+    inline Point3d predict(double time, double maxLeadSeconds = 0.5) const {
+        double lead = std::min(std::max(time - timestamp, 0.0), maxLeadSeconds);
+        return position + velocity*lead;
+    }
+};
+
+class MouthMotionModel
+{
+    KalmanFilter filter; // State is x, y, z, vx, vy, vz; measurements are x, y, z.
+    MouthMotionEstimate estimate;
+    double accelerationNoise; // Standard deviation of the unmodelled acceleration, in units per second squared.
+    double measurementNoise; // Standard deviation of a position with a confidence of 1, in units.
+    double maxGap; // Longest time without a measurement before the track is dropped, in seconds.
+
+    inline void initialise(const Point3d &position, double timestamp);
+public:
+    /**
+     * Constructor for the MouthMotionModel.
+     * @param acceleration  How hard the head is expected to accelerate, as a standard deviation in units per second squared.
+     *                      Larger values follow movements more quickly but smooth less.
+     * @param noise         The jitter of a measured position, as a standard deviation in units.
+     * @param maxGapSeconds The track is dropped and restarted from the next measurement after this long without one.
+     */
+    inline MouthMotionModel(double acceleration = 20.0, double noise = 0.5, double maxGapSeconds = 1.0);
+    /**
+     * Forget the track. The next measurement starts a new one.
+     */
+    inline void reset();
+    /**
+     * Add a measured position.
+     * @param position   The measured mouth centre.
+     * @param timestamp  When the frames it was found in were captured.
+     * @param confidence The confidence of the measurement, from 0 to 1. Less confident measurements move the estimate less.
+     */
+    inline void update(const Point3d &position, double timestamp, double confidence = 1.0);
+    /**
+     * The estimate as of the last measurement.
+     * @param  now The current time, used to tell whether the track has been lost.
+     * @return     The estimate, which is not valid if there is no track.
+     */
+    inline MouthMotionEstimate getEstimate(double now) const;
+};
+
+inline MouthMotionModel::MouthMotionModel(double acceleration, double noise, double maxGapSeconds): filter(6, 3, 0, CV_64F),
+    accelerationNoise(acceleration), measurementNoise(noise), maxGap(maxGapSeconds) {
+    filter.measurementMatrix = Mat::zeros(3, 6, CV_64F);
+    for(int i = 0; i < 3; i++)
+        filter.measurementMatrix.at<double>(i, i) = 1;
+}
+
+inline void MouthMotionModel::reset() {
+    estimate = MouthMotionEstimate();
+}
+
+inline void MouthMotionModel::initialise(const Point3d &position, double timestamp) {
+    filter.statePost = Mat::zeros(6, 1, CV_64F);
+    filter.statePost.at<double>(0) = position.x;
+    filter.statePost.at<double>(1) = position.y;
+    filter.statePost.at<double>(2) = position.z;
+    // Position as uncertain as one measurement; velocity unknown, so a second fix sets it almost on its own.
+    filter.errorCovPost = Mat::zeros(6, 6, CV_64F);
+    for(int i = 0; i < 3; i++) {
+        filter.errorCovPost.at<double>(i, i) = measurementNoise*measurementNoise;
+        filter.errorCovPost.at<double>(i + 3, i + 3) = 1e4;
+    }
+    estimate.valid = true;
+    estimate.position = position;
+    estimate.velocity = Point3d(0, 0, 0);
+    estimate.timestamp = timestamp;
+}
+
+inline void MouthMotionModel::update(const Point3d &position, double timestamp, double confidence) {
+    if(!estimate.valid || timestamp - estimate.timestamp > maxGap || timestamp < estimate.timestamp) {
+        initialise(position, timestamp);
+        return;
+    }
+    double dt = timestamp - estimate.timestamp;
+    // Constant velocity over dt, with white noise acceleration in each axis.
+    filter.transitionMatrix = Mat::eye(6, 6, CV_64F);
+    filter.processNoiseCov = Mat::zeros(6, 6, CV_64F);
+    double q = accelerationNoise*accelerationNoise;
+    for(int i = 0; i < 3; i++) {
+        filter.transitionMatrix.at<double>(i, i + 3) = dt;
+        filter.processNoiseCov.at<double>(i, i) = q*dt*dt*dt*dt/4;
+        filter.processNoiseCov.at<double>(i, i + 3) = q*dt*dt*dt/2;
+        filter.processNoiseCov.at<double>(i + 3, i) = q*dt*dt*dt/2;
+        filter.processNoiseCov.at<double>(i + 3, i + 3) = q*dt*dt;
+    }
+    double sigma = measurementNoise/std::max(confidence, 0.05);
+    filter.measurementNoiseCov = Mat::eye(3, 3, CV_64F)*(sigma*sigma);
+    filter.predict();
+    Mat measurement(3, 1, CV_64F);
+    measurement.at<double>(0) = position.x;
+    measurement.at<double>(1) = position.y;
+    measurement.at<double>(2) = position.z;
+    const Mat &state = filter.correct(measurement);
+    estimate.position = Point3d(state.at<double>(0), state.at<double>(1), state.at<double>(2));
+    estimate.velocity = Point3d(state.at<double>(3), state.at<double>(4), state.at<double>(5));
+    estimate.timestamp = timestamp;
+}
+
+inline MouthMotionEstimate MouthMotionModel::getEstimate(double now) const {
+    if(estimate.valid && now - estimate.timestamp > maxGap)
+        return MouthMotionEstimate();
+    return estimate;
+}
+
+#endif
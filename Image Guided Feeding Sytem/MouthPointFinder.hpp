@@ -13,7 +13,10 @@
 #include <vector>
 #include <string>
 #include <exception>
-#include "CoreFoundation/CoreFoundation.h"
+#include <cmath>
+#include <algorithm>
+#include "ResourceLocator.hpp"
+#include "Trace.hpp"
 using namespace cv;
 
 class FileFailedToLoad: public std::exception
@@ -24,14 +27,89 @@ class FileFailedToLoad: public std::exception
     }
 };
 
+/**
+ * How long each stage of the last call to MouthPointFinder::detectMouthCentre took, in seconds. Stages that did not run are 0.
+ */
+struct MouthDetectionTimings
+{
+    double preprocessing; // cvtColor and equalizeHist
+    double faceDetection; // The face cascade, including any decimation and the fallback full frame search.
+    double mouthDetection; // The mouth cascade
+    double contourExtraction; // blur, threshold, Canny, findContours and the hull
+    MouthDetectionTimings(): preprocessing(0), faceDetection(0), mouthDetection(0), contourExtraction(0) {}
+};
+
 class MouthPointFinder
 {
     std::string faceCascadeName;
     std::string mouthCascadeName;
     CascadeClassifier faceCascade; // The face cascade classifier
     CascadeClassifier mouthCascade; // The mouth cascade classifier
+    bool trackingEnabled; // Search around the predicted face position instead of the whole frame.
+    int fullSearchInterval; // Number of frames between forced full frame searches while tracking.
+    double searchMargin; // How far the search region extends past the predicted face, as a fraction of the face size.
+    bool faceIsTracked; // True if the face was found in the previous frame.
+    cv::Rect lastFace; // The face found in the previous frame.
+    Point2d faceVelocity; // Movement of the face centre between the last two frames, in pixels per frame.
+    int framesSinceFullSearch;
+    double faceDetectionScale; // Scale of the image the face cascade runs on, relative to the frame.
+
+    /**
+     * Buffers kept from frame to frame so that detectMouthCentre reuses their memory instead of allocating new ones every call.
+     * The face search image and the mouth buffers only ever grow and are used through a view of the size each frame needs
+     * (see reuseBuffer), since the search region and the mouth change size from frame to frame.
+     */
+    struct DetectionWorkspace
+    {
+        Mat grayScaleFrame;
+        Mat decimatedSearchImage;
+        Mat mouthPatch;
+        Mat mouthEdges;
+        std::vector<cv::Rect> faces;
+        std::vector<cv::Rect> mouths;
+        std::vector<std::vector<cv::Point> > contours;
+        std::vector<Vec4i> hierarchy;
+        std::vector<cv::Point> hull;
+    } workspace;
+    bool hullIsValid; // True if workspace.hull holds the mouth found by the last call to detectMouthCentre.
+    cv::Point hullOffset; // Position of the mouth patch the hull was found in, in frame coordinates.
+    MouthDetectionTimings timings; // Stage timings of the last call to detectMouthCentre.
+
+    /**
+     * Predict where the face will be in this frame from its last position and velocity, and grow that by the search margin.
+     * @param  frameSize The size of the frame being searched.
+     * @return           The region of the frame to search, clipped to the frame.
+     */
+    inline cv::Rect predictedFaceRegion(cv::Size frameSize);
+    /**
+     * Update the face track with the result of this frame's search.
+     * @param found true if a face was found.
+     * @param face  The face that was found.
+     */
+    inline void updateTrack(bool found, const cv::Rect &face);
+    /**
+     * Run the face cascade over part of the frame, on a copy decimated by faceDetectionScale.
+     * The faces found are mapped back to full resolution frame coordinates.
+     * @param grayScaleFrame The equalized grayscale frame.
+     * @param searchRegion   The part of the frame to search.
+     * @param faces          reference to a vector where the faces will be stored.
+     */
+    inline void detectFaces(Mat &grayScaleFrame, const cv::Rect &searchRegion, std::vector<cv::Rect> &faces);
+    /**
+     * A view of the given size and type onto a buffer kept between frames. The buffer is only reallocated if it is too small
+     * or of another type.
+     * @param  buffer The buffer.
+     * @param  size   The size needed.
+     * @param  type   The type needed.
+     * @return        The top left size.width by size.height of the buffer.
+     */
+    static inline Mat reuseBuffer(Mat &buffer, cv::Size size, int type);
 public:
-	inline MouthPointFinder();
+	/**
+	 * Constructor for the MouthPointFinder. Loads the face and mouth haar cascades.
+	 * @param resources The locator used to find the cascade files. If null, defaultResourceLocator() is used.
+	 */
+	inline MouthPointFinder(ResourceLocator *resources = 0);
 	/**
 	 * detectMouthCentre finds the centre of the mouth if there is a face in the frame given to it. It uses haar cascade calssifiers
 	 * to segment that image. First it finds a rectangle arount the face and then a rectangle arount the mouth. Then the area aroiund the mouth
@@ -44,43 +122,92 @@ public:
 	 * @return             true if successful, false otherwise
 	 */
 	inline bool detectMouthCentre(Mat &frame, Point2d &mouthCentre, bool &mouthIsOpen);
+	/**
+	 * Turn tracking on or off. While tracking, the face cascade is only run over a region around where the face is predicted
+	 * to be (constant velocity from the last two frames). The whole frame is searched when the face is lost and every
+	 * fullSearchInterval frames.
+	 * @param enabled          true to track the face between frames.
+	 * @param fullSearchFrames Number of frames between full frame searches.
+	 * @param margin           How far the search region extends past the predicted face on each side, as a fraction of the face size.
+	 */
+	inline void setTracking(bool enabled, int fullSearchFrames = 15, double margin = 0.25);
+	/**
+	 * Set the resolution the face is searched for at. The mouth is always found on the full resolution image, so this only
+	 * trades face detection time against how small a face can be found. A face must be at least 400 pixels across at full
+	 * resolution, so scales down to 0.25 still leave the cascade plenty of pixels to work with.
+	 * @param scale Fraction of the full resolution to detect faces at, in (0, 1]. 1 searches the full resolution frame.
+	 */
+	inline void setFaceDetectionScale(double scale);
+	/**
+	 * Get the resolution the face is searched for at. See setFaceDetectionScale.
+	 * @return the fraction of the full resolution faces are detected at.
+	 */
+	inline double getFaceDetectionScale();
+	/**
+	 * Get the convex hull around the mouth found by the last call to detectMouthCentre.
+	 * @param  hull reference to a vector where the hull points will be stored, in frame coordinates.
+	 * @return      true if the last call found a mouth, false otherwise.
+	 */
+	inline bool getMouthHull(std::vector<cv::Point> &hull);
+	/**
+	 * Get how long each stage of the last call to detectMouthCentre took.
+	 * @return the stage timings.
+	 */
+	inline MouthDetectionTimings getLastTimings();
+	/**
+	 * Get the pixel buffers detectMouthCentre keeps from call to call, so a test can check they are reused rather than
+	 * reallocated: the grayscale frame, the decimated face search image, the mouth patch and its edges.
+	 * @param buffers reference to a vector where the data pointers will be stored, null for a buffer not used yet.
+	 */
+	inline void getWorkspaceBuffers(std::vector<const uchar*> &buffers);
 };
 
-inline MouthPointFinder::MouthPointFinder() {
+inline MouthPointFinder::MouthPointFinder(ResourceLocator *resources): trackingEnabled(true), fullSearchInterval(15), searchMargin(0.25), faceIsTracked(false),
+    faceVelocity(0, 0), framesSinceFullSearch(0), faceDetectionScale(0.5), hullIsValid(false) {
     FileFailedToLoad exception;
-    faceCascadeName = "Resources/Cascades/haarcascade_frontalface_alt.xml"; // File path for the face haar cascade classifier
-    mouthCascadeName = "Resources/Cascades/haarcascade_mcs_mouth.xml"; // File path for the mouth haar cascade classifier
-    
-    CFBundleRef mainBundle = CFBundleGetMainBundle();
-    CFURLRef fileURL1 = CFBundleCopyResourceURL( mainBundle, CFSTR("haarcascade_frontalface_alt"), CFSTR("xml"), NULL );
-    char path1[512];
-    if (!CFURLGetFileSystemRepresentation(fileURL1, TRUE, (UInt8 *)path1, 512))
-        throw exception;
-    
-    
-    CFURLRef fileURL2 = CFBundleCopyResourceURL( mainBundle, CFSTR("haarcascade_mcs_mouth"), CFSTR("xml"), NULL );
-    char path2[512];
-    if (!CFURLGetFileSystemRepresentation(fileURL2, TRUE, (UInt8 *)path2, 512))
+    if(!resources)
+        resources = defaultResourceLocator();
+    faceCascadeName = resources->locate("haarcascade_frontalface_alt", "xml"); // File path for the face haar cascade classifier
+    mouthCascadeName = resources->locate("haarcascade_mcs_mouth", "xml"); // File path for the mouth haar cascade classifier
+    if(faceCascadeName.empty() || mouthCascadeName.empty())
         throw exception;
     
-    if(!faceCascade.load(path1)){
+    if(!faceCascade.load(faceCascadeName)){
         throw exception;
     }
-    if(!mouthCascade.load(path2)){
+    if(!mouthCascade.load(mouthCascadeName)){
         throw exception;
     }
 }
 
 inline bool MouthPointFinder::detectMouthCentre(Mat &frame, Point2d &mouthCentre, bool &mouthIsOpen) {
     bool retFlg = false;
-    std::vector<cv::Rect> faces;
-    Mat grayScaleFrame;
+    hullIsValid = false;
+    TRACE_SCOPE("detectMouthCentre");
+    timings = MouthDetectionTimings();
+    std::vector<cv::Rect> &faces = workspace.faces;
+    Mat &grayScaleFrame = workspace.grayScaleFrame;
+    int64_t stageStart = Trace::now();
     
     cvtColor(frame, grayScaleFrame, CV_BGR2GRAY);
     equalizeHist(grayScaleFrame, grayScaleFrame);
+    timings.preprocessing = Trace::record("preprocessing", stageStart);
+    stageStart = Trace::now();
     
-    // Detect faces
-    faceCascade.detectMultiScale(grayScaleFrame, faces, 1.25, 2, 0|CV_HAAR_SCALE_IMAGE, cv::Size(400, 400));
+    // Detect faces, near the last known face if we are tracking one, otherwise over the whole frame.
+    cv::Rect searchRegion(0, 0, grayScaleFrame.cols, grayScaleFrame.rows);
+    bool regionSearch = trackingEnabled && faceIsTracked && framesSinceFullSearch < fullSearchInterval;
+    if(regionSearch)
+        searchRegion = predictedFaceRegion(grayScaleFrame.size());
+    detectFaces(grayScaleFrame, searchRegion, faces);
+    if(regionSearch && faces.empty()) { // Lost the track, look everywhere before giving up on this frame.
+        searchRegion = cv::Rect(0, 0, grayScaleFrame.cols, grayScaleFrame.rows);
+        regionSearch = false;
+        detectFaces(grayScaleFrame, searchRegion, faces);
+    }
+    timings.faceDetection = Trace::record("faceDetection", stageStart);
+    framesSinceFullSearch = regionSearch ? framesSinceFullSearch + 1 : 0;
+    updateTrack(!faces.empty(), faces.empty() ? cv::Rect() : faces[0]);
     
     for( int i = 0; i < faces.size() && i < 1; i++ ) {
         //faces[i].height += faces[i].height/5;
@@ -90,10 +217,12 @@ inline bool MouthPointFinder::detectMouthCentre(Mat &frame, Point2d &mouthCentre
             faceRect.y = faceRect.y + faceRect.height/2;
             faceRect.height = faceRect.height/2 + 1;
             Mat faceROI = grayScaleFrame(faceRect);
-            std::vector<cv::Rect> mouths;
+            std::vector<cv::Rect> &mouths = workspace.mouths;
             
             // In each face, detect mouths
+            stageStart = Trace::now();
             mouthCascade.detectMultiScale(faceROI, mouths, 1.25, 2, 0 |CV_HAAR_SCALE_IMAGE, cv::Size(faceRect.width/3, faceRect.height/10));
+            timings.mouthDetection = Trace::record("mouthDetection", stageStart);
             
             for( int j = 0; j < mouths.size() && j < 1; j++ ) {
                 mouths[j].y = mouths[j].y - mouths[j].height/10;
@@ -103,29 +232,39 @@ inline bool MouthPointFinder::detectMouthCentre(Mat &frame, Point2d &mouthCentre
                 
                 Mat facePointsLocal;
                 if(mouths[j].height > 0 && mouths[j].width > 0 && mouths[j].x > 0 && mouths[j].y > 0) {
+                    stageStart = Trace::now();
                     facePointsLocal =faceROI(mouths[j]);
                     equalizeHist(facePointsLocal, facePointsLocal);
-                    Mat copy = facePointsLocal.clone();
+                    Mat copy = reuseBuffer(workspace.mouthPatch, facePointsLocal.size(), facePointsLocal.type());
+                    Mat edges = reuseBuffer(workspace.mouthEdges, facePointsLocal.size(), CV_8UC1);
                     
-                    blur(copy, copy, cv::Size(4,4));
+                    blur(facePointsLocal, copy, cv::Size(4,4));
                     threshold(copy, copy, 50, 255, 0);
-                    Canny(copy, copy, 10, 30, 3, true);
+                    Canny(copy, edges, 10, 30, 3, true);
                     
-                    std::vector<std::vector<cv::Point> > contours;
-                    std::vector<Vec4i> hierarchy;
-                    findContours(copy, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, cv::Point(0, 0));
+                    std::vector<std::vector<cv::Point> > &contours = workspace.contours;
+                    std::vector<Vec4i> &hierarchy = workspace.hierarchy;
+                    findContours(edges, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, cv::Point(0, 0));
                     
-                    std::vector<cv::Point> hull;
+                    // Only the hull of the largest contour is used, so find that first and build a single hull.
+                    std::vector<cv::Point> &hull = workspace.hull;
                     double maxArea = 0.0;
+                    int largestContour = -1;
                     RotatedRect boundingRect;
                     for(int i = 0; i < contours.size(); i++) {
                         double area = contourArea(contours[i], false);
                         if(area > maxArea) {
                             maxArea = area;
-                            convexHull(Mat(contours[i]), hull, false);
-                            boundingRect = minAreaRect(hull);
+                            largestContour = i;
                         }
                     }
+                    if(largestContour >= 0) {
+                        convexHull(contours[largestContour], hull, false);
+                        boundingRect = minAreaRect(hull);
+                        hullOffset = cv::Point(mouths[j].x + faceRect.x, mouths[j].y + faceRect.y);
+                        hullIsValid = true;
+                    }
+                    timings.contourExtraction = Trace::record("contourExtraction", stageStart);
                     
                     Point2f boundingRectVertices[4];
                     boundingRect.points(boundingRectVertices);
@@ -147,5 +286,89 @@ inline bool MouthPointFinder::detectMouthCentre(Mat &frame, Point2d &mouthCentre
     return retFlg;
 }
 
+inline bool MouthPointFinder::getMouthHull(std::vector<cv::Point> &hull) {
+    hull.clear();
+    if(!hullIsValid)
+        return false;
+    for(int i = 0; i < workspace.hull.size(); i++)
+        hull.push_back(workspace.hull[i] + hullOffset);
+    return true;
+}
+
+inline MouthDetectionTimings MouthPointFinder::getLastTimings() {
+    return timings;
+}
+
+inline void MouthPointFinder::getWorkspaceBuffers(std::vector<const uchar*> &buffers) {
+    buffers.clear();
+    buffers.push_back(workspace.grayScaleFrame.data);
+    buffers.push_back(workspace.decimatedSearchImage.data);
+    buffers.push_back(workspace.mouthPatch.data);
+    buffers.push_back(workspace.mouthEdges.data);
+}
+
+inline void MouthPointFinder::setTracking(bool enabled, int fullSearchFrames, double margin) {
+    trackingEnabled = enabled;
+    fullSearchInterval = fullSearchFrames;
+    searchMargin = margin;
+    faceIsTracked = false;
+}
+
+inline void MouthPointFinder::setFaceDetectionScale(double scale) {
+    if(scale > 0 && scale <= 1)
+        faceDetectionScale = scale;
+}
+
+inline double MouthPointFinder::getFaceDetectionScale() {
+    return faceDetectionScale;
+}
+
+inline void MouthPointFinder::detectFaces(Mat &grayScaleFrame, const cv::Rect &searchRegion, std::vector<cv::Rect> &faces) {
+    Mat searchImage = grayScaleFrame(searchRegion);
+    if(faceDetectionScale < 1) {
+        cv::Size decimatedSize(std::max(1, cvRound(searchImage.cols*faceDetectionScale)), std::max(1, cvRound(searchImage.rows*faceDetectionScale)));
+        Mat decimated = reuseBuffer(workspace.decimatedSearchImage, decimatedSize, searchImage.type());
+        resize(searchImage, decimated, decimatedSize, 0, 0, INTER_AREA);
+        searchImage = decimated;
+    }
+    int minFaceSize = cvRound(400*faceDetectionScale);
+    faceCascade.detectMultiScale(searchImage, faces, 1.25, 2, 0|CV_HAAR_SCALE_IMAGE, cv::Size(minFaceSize, minFaceSize));
+    
+    // Map back to full resolution frame coordinates
+    for(int i = 0; i < faces.size(); i++) {
+        faces[i] = cv::Rect(cvRound(faces[i].x/faceDetectionScale) + searchRegion.x, cvRound(faces[i].y/faceDetectionScale) + searchRegion.y,
+                            cvRound(faces[i].width/faceDetectionScale), cvRound(faces[i].height/faceDetectionScale));
+        faces[i] &= cv::Rect(0, 0, grayScaleFrame.cols, grayScaleFrame.rows);
+    }
+}
+
+inline Mat MouthPointFinder::reuseBuffer(Mat &buffer, cv::Size size, int type) {
+    if(buffer.empty() || buffer.type() != type)
+        buffer.create(size, type);
+    else if(buffer.cols < size.width || buffer.rows < size.height)
+        buffer.create(std::max(size.height, buffer.rows), std::max(size.width, buffer.cols), type);
+    return buffer(cv::Rect(0, 0, size.width, size.height));
+}
+
+inline cv::Rect MouthPointFinder::predictedFaceRegion(cv::Size frameSize) {
+    int marginX = (int)(lastFace.width*searchMargin + fabs(faceVelocity.x));
+    int marginY = (int)(lastFace.height*searchMargin + fabs(faceVelocity.y));
+    cv::Rect region((int)(lastFace.x + faceVelocity.x) - marginX, (int)(lastFace.y + faceVelocity.y) - marginY,
+                    lastFace.width + 2*marginX, lastFace.height + 2*marginY);
+    return region & cv::Rect(0, 0, frameSize.width, frameSize.height);
+}
+
+inline void MouthPointFinder::updateTrack(bool found, const cv::Rect &face) {
+    if(found && faceIsTracked) {
+        faceVelocity = Point2d((face.x + face.width*0.5) - (lastFace.x + lastFace.width*0.5),
+                               (face.y + face.height*0.5) - (lastFace.y + lastFace.height*0.5));
+    } else {
+        faceVelocity = Point2d(0, 0);
+    }
+    faceIsTracked = found;
+    if(found)
+        lastFace = face;
+}
+
 
 #endif
\ No newline at end of file
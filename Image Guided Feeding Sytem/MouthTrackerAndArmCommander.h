@@ -8,6 +8,10 @@
 
 #import <Foundation/Foundation.h>
 #import "ThreeDMouthLocationFinder.hpp"
+#import "TrackingLoop.hpp"
+#import "FeedingSequence.hpp"
+#import "ArmProtocol.hpp"
+#import "ArmTargeting.hpp"
 #import "NSImage_OpenCV.h"
 #import "ORSSerialPort.h"
 
@@ -23,8 +27,14 @@
 @interface MouthTrackerAndArmCommander: NSObject <ORSSerialPortDelegate> {
     cv::Mat leftImageMat, rightImageMat;
     ThreeDMouthLocationFinder mouthFinder;
+    TrackingLoop* trackingLoop; // Runs mouthFinder on its own thread
+    unsigned long displayedSequence; // Sequence number of the pair on display
     ORSSerialPort* serialPort;
-    NSTimer* nextStepTimer;
+    FeedingSequence* feedingSequence; // Decides what the arm does during a feed
+    NSTimer* controlTimer; // Steps feedingSequence while a feed is running
+    ArmLink* armLink; // Null if the arm speaks the old text commands
+    uint8_t lastCommandSequence; // Sequence number of the last command sent over armLink
+    BOOL armLinkFailed; // Set when a command can't be delivered; ends the feed
 }
 @property NSImage *leftImage;
 @property NSImage *rightImage;
@@ -42,6 +52,7 @@
 -(void) updateImagesAndCoordinates;
 -(void) feedUser;
 -(void) Abort;
+-(BOOL) saveTraceToFile: (NSString*) path;
 -(MouthTrackerAndArmCommander*) init;
 
 - (void)serialPort:(ORSSerialPort *)serialPort didReceiveData:(NSData *)data;
@@ -11,28 +11,72 @@
 @implementation MouthTrackerAndArmCommander
 
 -(double) xArm {
-    return self.x - 22.0;
+    return ArmTargeting::armCoordinates(Point3d(self.x, self.y, self.z)).x;
 }
 
 -(double) yArm {
-    return self.z - 18;
+    return ArmTargeting::armCoordinates(Point3d(self.x, self.y, self.z)).y;
 }
 
 -(double) zArm {
-    return self.y + 19.5;
+    return ArmTargeting::armCoordinates(Point3d(self.x, self.y, self.z)).z;
+}
+
+// How often the feeding sequence is stepped, in seconds. Insert targets are corrected at this rate.
+static const double feedingControlPeriod = 0.05;
+// The mouth counts as lost for the feeding sequence once it hasn't been found for this long, in seconds.
+static const double mouthLostAfter = 0.5;
+// Where the arm is plugged in, unless the ArmSerialPort user default says otherwise.
+static NSString* const defaultArmSerialPort = @"/dev/cu.usbmodem14121";
+// The line an arm speaking the old text commands sends when it has finished a move.
+static NSString* const armArrivedReply = @"D";
+
+-(void) setMouthPosition: (const Point3d&) position {
+    Point3d display = ArmTargeting::displayCoordinates(position);
+    self.x = display.x;
+    self.y = display.y;
+    self.z = display.z;
+}
+
+-(void) updatePositionWithResult: (const TrackingResult&) result leadTime: (double) lead {
+    // The smoothed position, brought forward from when the frames were captured to now plus the lead.
+    Point3d position = ArmTargeting::aimPoint(result, StereoFrameGrabber::now() + lead);
+    self.MouthIsOpen = result.mouthIsOpen ? FALSE : TRUE;
+    [self setMouthPosition:position];
+}
+
+-(FeedingSequence::MouthObservation) observeMouth {
+    FeedingSequence::MouthObservation mouth;
+    std::shared_ptr<const TrackingResult> result = trackingLoop->latestResult();
+    if(!result)
+        return mouth;
+    double now = StereoFrameGrabber::now();
+    [self updatePositionWithResult:*result leadTime:ArmTargeting::leadTime];
+    mouth.tracked = result->motion.valid && now - result->motion.timestamp < mouthLostAfter;
+    mouth.position = ArmTargeting::aimPoint(*result, now + ArmTargeting::leadTime);
+    mouth.isOpen = self.MouthIsOpen;
+    return mouth;
 }
 
 -(void) updateHelperWithDelegate: (id<ThreeDMouthLocationFinderDelegate>) delegate {
-    cv::Point3f point;
-    bool isOpen = false;
-    mouthFinder.getData(leftImageMat, rightImageMat, isOpen, point);
-    self.MouthIsOpen = isOpen ? FALSE : TRUE;
-    self.x = point.x * -2.0;
-    self.y = point.y * 2.0;
-    self.z = point.z * -2.0;
+    // Tracking runs on its own thread; this only shows the newest result it has published.
+    std::shared_ptr<const TrackingResult> result;
+    if(!trackingLoop->tryGetResult(displayedSequence, result)) // Nothing new since the last update
+        return;
+    displayedSequence = result->sequenceNumber;
+    [self updatePositionWithResult:*result leadTime:0];
     
-    self.leftImage = [NSImage imageWithCVMat:leftImageMat];
-    self.rightImage = [NSImage imageWithCVMat:rightImageMat];
+    // Published frames are never changed and imageWithCVMat doesn't touch its source, so rectified frames are shown as they are.
+    if(!result->frames) {
+        // Nothing to show yet
+    } else if(result->framesAreRectified) {
+        self.leftImage = [NSImage imageWithCVMat:result->frames->left];
+        self.rightImage = [NSImage imageWithCVMat:result->frames->right];
+    } else {
+        mouthFinder.rectifyForDisplay(result->frames->left, result->frames->right, false, leftImageMat, rightImageMat);
+        self.leftImage = [NSImage imageWithCVMat:leftImageMat];
+        self.rightImage = [NSImage imageWithCVMat:rightImageMat];
+    }
     [self.delegate newDataIsAvailableWithSender: self];
 }
 
@@ -40,66 +84,102 @@
     [self updateHelperWithDelegate:self.delegate];
 }
 
--(void) Abort {
-    //[serialPort open];
-    
-    [nextStepTimer invalidate];
-    NSString* command = @"A";
-    NSLog(@"Command: %@",command);
-    [serialPort sendData:[command dataUsingEncoding:NSUTF8StringEncoding]];
-    //[serialPort close];
+-(void) sendArmCommand: (const FeedingSequence::ArmCommand&) command {
+    if(command.type == FeedingSequence::NoCommand)
+        return;
+    double now = StereoFrameGrabber::now();
+    if(command.type == FeedingSequence::RestCommand) {
+        if(armLink)
+            armLink->sendAbort(now, &lastCommandSequence);
+        else
+            [serialPort sendData:[@"A" dataUsingEncoding:NSUTF8StringEncoding]];
+        NSLog(@"Command: A");
+        return;
+    }
+    double arguments[ArmProtocol::commandArguments];
+    ArmTargeting::commandArguments(command, arguments);
+    NSString* text = [NSString stringWithUTF8String:ArmTargeting::textCommand(command).c_str()];
+    NSLog(@"Command: %@",text);
+    if(!armLink) {
+        // An insert target still waiting to go out is replaced by the newer one
+        NSString* key = command.type == FeedingSequence::InsertCommand ? @"InsertTarget" : nil;
+        if(![serialPort sendData:[text dataUsingEncoding:NSUTF8StringEncoding] coalescingKey:key completion:nil]) {
+            NSLog(@"Command not sent: serial port closed or backed up");
+            armLinkFailed = YES;
+        }
+        return;
+    }
+    bool sent;
+    if(command.type == FeedingSequence::ScoopCommand)
+        sent = armLink->sendScoop(arguments, now, &lastCommandSequence);
+    else // Only the newest insert target matters, so it replaces one still waiting to go out.
+        sent = armLink->sendMove(arguments, now, &lastCommandSequence, command.type == FeedingSequence::InsertCommand);
+    if(!sent) {
+        NSLog(@"Command not sent: target out of range or too many commands waiting");
+        armLinkFailed = YES;
+    }
 }
 
--(void) rest {
-    [self Abort];
+-(void) armDidArrive: (uint8_t) sequence {
+    if(sequence == lastCommandSequence) // Earlier targets the arm reached don't count
+        feedingSequence->armArrived();
 }
 
--(void) retrieve {
-    //[serialPort open];
-
-    
-    NSString* command = [NSString stringWithFormat:@"M %1.2f %1.2f %1.2f %1.2f %1.2f",self.xArm, self.yArm-15, self.zArm, 0.0, 1.0];
-    [serialPort sendData:[command dataUsingEncoding:NSUTF8StringEncoding]];
-    //[serialPort close];
-    NSLog(@"Command: %@",command);
-    
-    nextStepTimer = [NSTimer scheduledTimerWithTimeInterval:5.0
-                                                     target:self selector:@selector(rest)
-                                                   userInfo:nil repeats:NO];
+-(void) armDidFail: (uint8_t) sequence {
+    NSLog(@"Command %d was rejected or never acknowledged", sequence);
+    armLinkFailed = YES;
 }
 
--(void) insert {
-    //[serialPort open];
-
-    
-    NSString* command =[NSString stringWithFormat:@"M %1.2f %1.2f %1.2f %1.2f %1.2f",self.xArm, self.yArm, self.zArm+3.0, 0.0, 1.0];
-    [serialPort sendData:[command dataUsingEncoding:NSUTF8StringEncoding]];
-    //[serialPort close];
-    NSLog(@"Command: %@",command);
-    
-    nextStepTimer = [NSTimer scheduledTimerWithTimeInterval:5.0
-                                                     target:self selector:@selector(retrieve)
-                                                   userInfo:nil repeats:NO];
+-(void) startControlTimer {
+    if(controlTimer)
+        return;
+    controlTimer = [NSTimer scheduledTimerWithTimeInterval:feedingControlPeriod
+                                                    target:self selector:@selector(controlStep)
+                                                  userInfo:nil repeats:YES];
+}
 
+-(void) logStopReason {
+    if(!feedingSequence->getStopReason().empty())
+        NSLog(@"Feed stopped: %s", feedingSequence->getStopReason().c_str());
 }
--(void) scoop {
-    //[serialPort open];
-    
-    NSString* command = [NSString stringWithFormat:@"S %1.2f %1.2f %1.2f %1.2f %1.2f",self.xArm, self.yArm-15, self.zArm+3.0, 0.0, 1.0];
-    
-    [serialPort sendData:[command dataUsingEncoding:NSUTF8StringEncoding]];
-    //[serialPort close];
-    NSLog(@"Command: %@",command);
-    
-    nextStepTimer = [NSTimer scheduledTimerWithTimeInterval:15.0
-                                                    target:self selector:@selector(insert)
-                                                   userInfo:nil repeats:NO];
 
+-(void) controlStep {
+    double now = StereoFrameGrabber::now();
+    if(armLink)
+        armLink->poll(now); // Sends again anything not acknowledged in time
+    if(feedingSequence->getPhase() != FeedingSequence::Idle) {
+        if(armLinkFailed)
+            [self sendArmCommand:feedingSequence->abort("Lost contact with the arm")];
+        else
+            [self sendArmCommand:feedingSequence->update([self observeMouth], now)];
+        if(feedingSequence->getPhase() == FeedingSequence::Idle)
+            [self logStopReason];
+    }
+    // Keep stepping until the arm has every command, so the last ones are sent again if they are lost.
+    if(feedingSequence->getPhase() == FeedingSequence::Idle && (!armLink || armLink->isIdle())) {
+        [controlTimer invalidate];
+        controlTimer = nil;
+    }
 }
 
+-(void) Abort {
+    [self sendArmCommand:feedingSequence->abort("Aborted by the user")];
+    [self logStopReason];
+    [self startControlTimer];
+}
 
 -(void) feedUser {
-        [self scoop];
+    if(feedingSequence->getPhase() != FeedingSequence::Idle)
+        return;
+    armLinkFailed = NO;
+    [self sendArmCommand:feedingSequence->start([self observeMouth], StereoFrameGrabber::now())];
+    if(feedingSequence->getPhase() == FeedingSequence::Idle) // Refused
+        [self logStopReason];
+    [self startControlTimer];
+}
+
+-(BOOL) saveTraceToFile: (NSString*) path {
+    return Trace::writeChromeTrace([path fileSystemRepresentation]);
 }
 
 -(NSString*) CoordinateString {
@@ -111,22 +191,74 @@
     _y = 0.0;
     _z = 0.0;
     _MouthIsOpen = NO;
-    serialPort = [ORSSerialPort serialPortWithPath:@"/dev/cu.usbmodem14121"];
+    displayedSequence = 0;
+    trackingLoop = new TrackingLoop(&mouthFinder);
+    feedingSequence = new FeedingSequence();
+    armLink = 0;
+    lastCommandSequence = 0;
+    armLinkFailed = NO;
+    trackingLoop->start();
+    // Another arm, or Headless/ArmSimulator's pseudo-terminal, is selected with: defaults write <bundle id> ArmSerialPort PATH
+    NSString* armPath = [[NSUserDefaults standardUserDefaults] stringForKey:@"ArmSerialPort"];
+    serialPort = [ORSSerialPort serialPortWithPath:armPath ? armPath : defaultArmSerialPort];
+    if(!serialPort)
+        NSLog(@"No serial port at %@", armPath ? armPath : defaultArmSerialPort);
     serialPort.baudRate = [NSNumber numberWithInt:115200];
     serialPort.numberOfStopBits = 1;
     serialPort.parity = ORSSerialPortParityNone;
     serialPort.delegate = self;
+    // The arm speaks the text commands unless its firmware has the binary protocol, which is selected with:
+    // defaults write <bundle id> ArmProtocol binary
+    if([[[NSUserDefaults standardUserDefaults] stringForKey:@"ArmProtocol"] isEqualToString:@"binary"]) {
+        __weak ORSSerialPort* port = serialPort;
+        __weak MouthTrackerAndArmCommander* weakSelf = self;
+        armLink = new ArmLink([port] (const uint8_t *bytes, size_t length) {
+            [port sendData:[NSData dataWithBytes:bytes length:length]]; // A refused frame is sent again when it isn't acknowledged
+        });
+        // Replies are parsed on the port's reader straight from its buffer, so acks never wait for the main run loop and
+        // reads aren't copied. Only the feeding sequence lives on the main queue.
+        armLink->onArrived = [weakSelf] (uint8_t sequence) {
+            dispatch_async(dispatch_get_main_queue(), ^{ [weakSelf armDidArrive:sequence]; });
+        };
+        armLink->onFailed = [weakSelf] (uint8_t sequence) {
+            dispatch_async(dispatch_get_main_queue(), ^{ [weakSelf armDidFail:sequence]; });
+        };
+        ArmLink *link = armLink;
+        serialPort.receiveBytesBlock = ^(const uint8_t *bytes, NSUInteger length) {
+            link->receive(bytes, length, StereoFrameGrabber::now());
+        };
+    } else {
+        serialPort.packetLengthBlock = ^NSInteger(const uint8_t *bytes, NSUInteger length) { // One reply a line
+            const uint8_t *newline = (const uint8_t *)memchr(bytes, '\n', length);
+            return newline ? newline - bytes + 1 : 0;
+        };
+    }
     [serialPort open];
     return self;
 }
 
 
+// Not called: replies in the binary protocol go to armLink through the port's receiveBytesBlock, and text replies come as lines.
 - (void)serialPort:(ORSSerialPort *)serialPort didReceiveData:(NSData *)data {
-    NSString *string = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
-    NSLog(@"%@", string);
-    
+}
+
+// Called on the main queue with each line from an arm speaking the text commands.
+- (void)serialPort:(ORSSerialPort *)serialPort didReceivePacket:(NSData *)packet {
+    NSString *line = [[[NSString alloc] initWithData:packet encoding:NSUTF8StringEncoding] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    NSLog(@"%@", line);
+    if([line isEqualToString:armArrivedReply])
+        feedingSequence->armArrived();
 }
 - (void)serialPortWasRemovedFromSystem:(ORSSerialPort *)serialPort {
     
 }
+
+-(void) dealloc {
+    [controlTimer invalidate];
+    serialPort.delegate = nil;
+    [serialPort close]; // Waits for a read already handing bytes to armLink
+    delete feedingSequence;
+    delete armLink;
+    delete trackingLoop; // Stops the tracking thread before mouthFinder goes away
+}
 @end
@@ -15,30 +15,112 @@
 - (cv::Ptr<cv::Mat>)cvMat;
 @end
 
+#include <mutex>
+#include <vector>
+
 using namespace cv;
+
+/**
+ * The pixels behind an NSImage made by initWithCVMat. The CGImage keeps one of these alive until it is released,
+ * either sharing the source Mat's buffer or holding a converted copy taken from a small pool.
+ */
+struct DisplayBuffer
+{
+    cv::Mat pixels;
+    bool pooled; // True if pixels came from the pool and should go back to it.
+};
+
+/**
+ * Converted display buffers that are no longer in use, kept so the next frames of the same size don't allocate.
+ */
+struct DisplayBufferPool
+{
+    std::mutex mutex;
+    std::vector<DisplayBuffer *> freeBuffers;
+    static const size_t maxFreeBuffers = 4; // Two views, with one frame still on screen while the next is made.
+};
+
+static DisplayBufferPool &displayBufferPool() {
+    static DisplayBufferPool pool;
+    return pool;
+}
+
+static DisplayBuffer *acquireDisplayBuffer(int rows, int cols, int type) {
+    DisplayBufferPool &pool = displayBufferPool();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        for(size_t i = 0; i < pool.freeBuffers.size(); i++) {
+            DisplayBuffer *buffer = pool.freeBuffers[i];
+            if(buffer->pixels.rows == rows && buffer->pixels.cols == cols && buffer->pixels.type() == type) {
+                pool.freeBuffers.erase(pool.freeBuffers.begin() + i);
+                return buffer;
+            }
+        }
+    }
+    DisplayBuffer *buffer = new DisplayBuffer;
+    buffer->pixels.create(rows, cols, type);
+    buffer->pooled = true;
+    return buffer;
+}
+
+// CGDataProviderReleaseDataCallback: called when the last CGImage using the buffer goes away.
+static void releaseDisplayBuffer(void *info, const void *data, size_t size) {
+    DisplayBuffer *buffer = (DisplayBuffer *)info;
+    if(buffer->pooled) {
+        DisplayBufferPool &pool = displayBufferPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if(pool.freeBuffers.size() < DisplayBufferPool::maxFreeBuffers) {
+            pool.freeBuffers.push_back(buffer);
+            return;
+        }
+    }
+    delete buffer; // Drops our reference to a shared source buffer, or frees a converted one.
+}
+
 @implementation NSImage (OpenCV)
 
+/**
+ * Make an image that shows cvMat. 8 bit grayscale and BGRA frames are shown straight from cvMat's buffer, which the image
+ * keeps alive, so the caller must not draw into that buffer while the image is on screen. BGR frames are converted to RGB
+ * once, into a pooled buffer. cvMat itself is never changed.
+ */
 - (id)initWithCVMat:(const cv::Mat&)cvMat {
-    cvtColor( cvMat, cvMat, CV_BGR2RGB);
-    NSData *data = [NSData dataWithBytes:cvMat.data
-                                  length:cvMat.total()*cvMat.elemSize()];
-    CGDataProviderRef provider = CGDataProviderCreateWithCFData((__bridge CFDataRef)data);
-    CGColorSpaceRef colourSpace =  CGColorSpaceCreateDeviceRGB();
+    DisplayBuffer *buffer;
+    CGColorSpaceRef colourSpace;
+    CGBitmapInfo bitmapInfo;
+    if(cvMat.type() == CV_8UC1 || cvMat.type() == CV_8UC4) {
+        buffer = new DisplayBuffer;
+        buffer->pixels = cvMat; // Shares the buffer
+        buffer->pooled = false;
+        if(cvMat.channels() == 1) {
+            colourSpace = CGColorSpaceCreateDeviceGray();
+            bitmapInfo = kCGImageAlphaNone | kCGBitmapByteOrderDefault;
+        } else {
+            colourSpace = CGColorSpaceCreateDeviceRGB();
+            bitmapInfo = kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little; // BGRA in memory
+        }
+    } else {
+        buffer = acquireDisplayBuffer(cvMat.rows, cvMat.cols, CV_8UC3);
+        cvtColor(cvMat, buffer->pixels, CV_BGR2RGB);
+        colourSpace = CGColorSpaceCreateDeviceRGB();
+        bitmapInfo = kCGImageAlphaNone | kCGBitmapByteOrderDefault;
+    }
+    const cv::Mat &pixels = buffer->pixels;
+    CGDataProviderRef provider = CGDataProviderCreateWithData(buffer, pixels.data, pixels.step[0]*pixels.rows, releaseDisplayBuffer);
     
-    CGImageRef imageRef = CGImageCreate(cvMat.cols,
-                                        cvMat.rows,
+    CGImageRef imageRef = CGImageCreate(pixels.cols,
+                                        pixels.rows,
                                         8,
-                                        8 * cvMat.elemSize(),
-                                        cvMat.step[0],
+                                        8 * pixels.elemSize(),
+                                        pixels.step[0],
                                         colourSpace,
-                                        kCGImageAlphaNone |
-                                        kCGBitmapByteOrderDefault,
+                                        bitmapInfo,
                                         provider,
                                         NULL,
                                         false,
                                         kCGRenderingIntentDefault);
     
-    NSImage *image = [[NSImage alloc] initWithCGImage:imageRef size:CGSizeMake(cvMat.cols,cvMat.rows)];
+    NSImage *image = [[NSImage alloc] initWithCGImage:imageRef size:CGSizeMake(pixels.cols,pixels.rows)];
     
     CGColorSpaceRelease(colourSpace);
     CGDataProviderRelease(provider);
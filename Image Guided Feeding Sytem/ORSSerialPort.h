@@ -38,6 +38,25 @@ enum {
 
 @protocol ORSSerialPortDelegate;
 
+/**
+ *  Finds the first packet in received data. See `packetLengthBlock`.
+ *
+ *  @param bytes  The received bytes not yet delivered, starting where the last packet ended.
+ *  @param length The number of bytes.
+ *
+ *  @return The length of the packet at the start of `bytes` if it is complete, 0 if more data
+ *  is needed, or minus the number of bytes to discard if `bytes` doesn't start with a packet.
+ */
+typedef NSInteger (^ORSSerialPortPacketLengthBlock)(const uint8_t *bytes, NSUInteger length);
+
+/**
+ *  Takes bytes as they are read. See `receiveBytesBlock`.
+ *
+ *  @param bytes  The bytes read, in the port's own buffer. Only valid during the call.
+ *  @param length The number of bytes.
+ */
+typedef void (^ORSSerialPortReceiveBytesBlock)(const uint8_t *bytes, NSUInteger length);
+
 /**
  *  The ORSSerialPort class represents a serial port, and includes methods to
  *  configure, open and close a port, and send and receive data to and from
@@ -82,14 +101,19 @@ enum {
  *  	NSData *dataToSend = [self.sendTextField.stringValue dataUsingEncoding:NSUTF8StringEncoding];
  *  	[self.serialPort sendData:dataToSend];
  *
+ *  Sending never blocks. Data the port can't take straight away is queued and
+ *  written in the background as the port drains. Use
+ *  `-sendData:coalescingKey:completion:` to be told when data has gone out, or to
+ *  have a newer command replace one that is still waiting.
+ *
  *  Receiving Data
  *  --------------
  *
  *  To receive data, you must implement the `ORSSerialPortDelegate`
  *  protocol's `-serialPort:didReceiveData:` method, and set the
  *  `ORSSerialPort` instance's delegate property. As noted in the documentation
- *  for ORSSerialPortDelegate, this method is always called on the main queue.
- *  An example implementation is included below:
+ *  for ORSSerialPortDelegate, this method is called on `receiveQueue`, which is
+ *  the main queue unless you set it. An example implementation is included below:
  *
  *  	- (void)serialPort:(ORSSerialPort *)serialPort didReceiveData:(NSData *)data
  *  	{
@@ -97,6 +121,9 @@ enum {
  *  		[self.receivedDataTextView.textStorage.mutableString appendString:string];
  *  		[self.receivedDataTextView setNeedsDisplay:YES];
  *  	}
+ *
+ *  Data is read as soon as it arrives. To have it split into messages first, set
+ *  `packetLengthBlock` and implement `-serialPort:didReceivePacket:` instead.
  */
 
 @interface ORSSerialPort : NSObject
@@ -110,7 +137,8 @@ enum {
  *  Returns an `ORSSerialPort` instance representing the serial port at `devicePath`.
  *
  *  `devicePath` must be the full, callout (cu.) or tty (tty.) path to an available
- *  serial port device on the system.
+ *  serial port device on the system, or the path of another terminal device such as
+ *  a pseudo-terminal (e.g. one with a simulated device on the other end).
  *
  *  @param devicePath The full path (e.g. /dev/cu.usbserial) to the device.
  *
@@ -143,7 +171,8 @@ enum {
  *  Returns an `ORSSerialPort` instance representing the serial port at `devicePath`.
  *
  *  `devicePath` must be the full, callout (cu.) or tty (tty.) path to an available
- *  serial port device on the system.
+ *  serial port device on the system, or the path of another terminal device such as
+ *  a pseudo-terminal (e.g. one with a simulated device on the other end).
  *
  *  @param devicePath The full path (e.g. /dev/cu.usbserial) to the device.
  *
@@ -213,22 +242,94 @@ enum {
 /**
  *  Sends data out through the serial port represented by the receiver.
  *
- *  This method attempts to send all data synchronously. If the serial port
- *  is unable to accept all the passed in data in a single write operation,
- *  The remaining data is buffered and sent later asynchronously.
+ *  This method never blocks. It writes as much of the data as the port will
+ *  take straight away, and queues the rest to be written in order on a background
+ *  queue as soon as the port has room. Data is never left half sent: what was
+ *  accepted is written in full unless the port is closed or a write fails.
  *
- *  If an error occurs, the ORSSerialPortDelegate method `-serialPort:didEncounterError:` will
- *  be called. The exception to this is if sending data fails because the port
- *  is closed. In that case, this method returns NO, but `-serialPort:didEncounterError:`
- *  is *not* called. You can ensure that the port is open by calling `-isOpen` before 
- *  calling this method.
+ *  If an error occurs while writing, the ORSSerialPortDelegate method `-serialPort:didEncounterError:`
+ *  will be called and everything still queued is dropped. Sending fails without
+ *  `-serialPort:didEncounterError:` being called if the port is closed, or if the
+ *  data would take the queue past `maximumWriteBacklog`. You can ensure that the
+ *  port is open by calling `-isOpen` before calling this method.
  *
  *  @param data An `NSData` object containing the data to be sent.
  *
- *  @return YES if sending data failed, NO if an error occurred.
+ *  @return YES if the data was sent or queued, NO if it was refused.
+ *
+ *  @see -sendData:coalescingKey:completion:
  */
 - (BOOL)sendData:(NSData *)data;
 
+/**
+ *  Sends data out through the serial port represented by the receiver, as `-sendData:` does.
+ *
+ *  If `key` is not nil and data sent earlier with the same key is still queued
+ *  and not yet started, the new data takes its place in the queue and the earlier
+ *  data is never sent. Use this for commands where only the latest one matters,
+ *  such as a target position.
+ *
+ *  @param data       An `NSData` object containing the data to be sent.
+ *  @param key        A key identifying commands that supersede each other, or nil.
+ *  @param completion Called on the main queue once the data has been handed to the
+ *                    port (sent is YES), or once it has been replaced, dropped on
+ *                    an error or dropped by closing the port (sent is NO). Not called
+ *                    if this method returns NO. May be nil.
+ *
+ *  @return YES if the data was sent or queued, NO if it was refused.
+ */
+- (BOOL)sendData:(NSData *)data coalescingKey:(NSString *)key completion:(void (^)(BOOL sent))completion;
+
+/**
+ *  The number of bytes queued and not yet handed to the port. (read-only)
+ */
+@property (readonly) NSUInteger bytesWaitingToBeSent;
+
+/**
+ *  The most bytes that may wait to be sent. Sends that would queue more are
+ *  refused, and the ORSSerialPortDelegate method `-serialPortIsReadyToSend:` is called
+ *  once the queue has drained to half of this. Data sent while the queue is empty is
+ *  always accepted. 0 means no limit. The default is 4096.
+ */
+@property NSUInteger maximumWriteBacklog;
+
+/** ---------------------------------------------------------------------------------------
+ * @name Receiving Data
+ *  ---------------------------------------------------------------------------------------
+ */
+
+/**
+ *  The queue `-serialPort:didReceiveData:` and `-serialPort:didReceivePacket:` are called on.
+ *
+ *  The default is the main queue. Set a serial queue of your own to handle replies without
+ *  waiting for the main run loop. Setting nil restores the main queue. Set it before opening the port.
+ */
+#if OS_OBJECT_HAVE_OBJC_SUPPORT
+@property (nonatomic, strong) dispatch_queue_t receiveQueue;
+#else
+@property (nonatomic) dispatch_queue_t receiveQueue;
+#endif
+
+/**
+ *  Splits received data into packets, or nil to deliver data as it is read.
+ *
+ *  When set, received data is kept until the block reports a complete packet, and each packet
+ *  is delivered whole with `-serialPort:didReceivePacket:`. The block is called on the port's
+ *  reader queue, so it must be quick and must not touch state used elsewhere. Packets longer than
+ *  4096 bytes can't be received.
+ */
+@property (copy) ORSSerialPortPacketLengthBlock packetLengthBlock;
+
+/**
+ *  Takes received data straight from the port's reader queue, or nil to deliver it with `-serialPort:didReceiveData:`.
+ *
+ *  When set, the block is handed each read from the port's receive buffer, with nothing copied or
+ *  dispatched, so it suits a consumer that parses a stream itself and is safe to call from another thread.
+ *  It must be quick and must not keep `bytes`. It is not called again once `close` returns. Ignored
+ *  while `packetLengthBlock` is set. Set it before opening the port.
+ */
+@property (copy) ORSSerialPortReceiveBytesBlock receiveBytesBlock;
+
 /** ---------------------------------------------------------------------------------------
  * @name Delegate
  *  ---------------------------------------------------------------------------------------
@@ -400,9 +501,9 @@ enum {
  *  The ORSSerialPortDelegate protocol defines methods to be implemented
  *  by the delegate of an `ORSSerialPort` object.
  *
- *  *Note*: All `ORSSerialPortDelegate` methods are always called on the main queue.
- *  If you need to handle them on a background queue, you must dispatch your handling
- *  to a background queue in your implementation of the delegate method.
+ *  *Note*: `-serialPort:didReceiveData:` and `-serialPort:didReceivePacket:` are called on
+ *  the port's `receiveQueue`, the main queue by default. All other `ORSSerialPortDelegate`
+ *  methods are always called on the main queue.
  */
 
 @protocol ORSSerialPortDelegate
@@ -431,6 +532,14 @@ enum {
 
 @optional
 
+/**
+ *  Called with each packet received, when the port's `packetLengthBlock` is set.
+ *
+ *  @param serialPort The `ORSSerialPort` instance representing the port that received `packet`.
+ *  @param packet     An `NSData` instance containing one whole packet.
+ */
+- (void)serialPort:(ORSSerialPort *)serialPort didReceivePacket:(NSData *)packet;
+
 /**
  *  Called when an error occurs during an operation involving a serial port.
  *
@@ -465,4 +574,13 @@ enum {
  */
 - (void)serialPortWasClosed:(ORSSerialPort *)serialPort;
 
+/**
+ *  Called when the send queue has drained after a send was refused because it was full.
+ *
+ *  @param serialPort The `ORSSerialPort` instance representing the port that can take more data.
+ *
+ *  @see -[ORSSerialPort maximumWriteBacklog]
+ */
+- (void)serialPortIsReadyToSend:(ORSSerialPort *)serialPort;
+
 @end
\ No newline at end of file
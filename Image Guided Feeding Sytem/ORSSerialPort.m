@@ -42,6 +42,7 @@
 #import <sys/param.h>
 #import <sys/filio.h>
 #import <sys/ioctl.h>
+#import <sys/stat.h>
 
 #ifdef LOG_SERIAL_PORT_ERRORS
 #define LOG_SERIAL_PORT_ERROR(fmt, ...) NSLog(fmt, ## __VA_ARGS__)
@@ -51,16 +52,52 @@
 
 static __strong NSMutableArray *allSerialPorts;
 
+// Bytes read and not yet delivered are kept in a fixed buffer, reused for every read.
+// A packet longer than this can never be completed, so it is dropped.
+enum { ORSSerialPortReceiveBufferSize = 4096 };
+
+// Default for maximumWriteBacklog: about a third of a second at 115200 baud.
+static const NSUInteger ORSSerialPortDefaultMaximumWriteBacklog = 4096;
+
+/**
+ *  One call to -sendData:coalescingKey:completion: waiting to be written.
+ */
+@interface ORSSerialPortPendingWrite : NSObject
+
+@property (strong) NSData *data;
+@property NSUInteger bytesWritten;
+@property (copy) NSString *coalescingKey;
+@property (copy) void (^completion)(BOOL sent);
+
+@end
+
+@implementation ORSSerialPortPendingWrite
+@end
+
 @interface ORSSerialPort ()
 {	
 	struct termios originalPortAttributes;
+	
+	// Only touched on readQueue
+	uint8_t receiveBuffer[ORSSerialPortReceiveBufferSize]; // Bytes read and not yet delivered, from the start
+	NSUInteger receiveBufferLength;
+	int lastModemLines;
+	int sourcesOpen; // The read and write sources not yet cancelled. The descriptor is closed when none are left.
+	int closeError; // Set on readQueue before descriptorClosed is signalled
+	dispatch_semaphore_t descriptorClosed;
 }
 
 + (void)addSerialPort:(ORSSerialPort *)port;
 + (void)removeSerialPort:(ORSSerialPort *)port;
 + (ORSSerialPort *)existingPortWithPath:(NSString *)path;
 
+- (id)initWithBSDPath:(NSString *)bsdPath device:(io_object_t)device;
 - (void)receiveData:(NSData *)data;
+- (void)receivePacket:(NSData *)packet;
+- (void)readAvailableData;
+- (void)deliverReceivedData;
+- (void)sampleModemLines;
+- (void)sourceWasCancelledForDescriptor:(int)descriptor;
 
 - (void)setPortOptions;
 + (io_object_t)deviceFromBSDPath:(NSString *)bsdPath;
@@ -72,13 +109,22 @@ static __strong NSMutableArray *allSerialPorts;
 + (NSString *)modemNameFromDevice:(io_object_t)aDevice;
 + (NSString *)suffixFromDevice:(io_object_t)aDevice;
 
+- (void)writePendingData;
+- (void)finishWrite:(ORSSerialPortPendingWrite *)pending sent:(BOOL)sent;
+- (void)discardPendingWrites;
+
 - (void)notifyDelegateOfPosixError;
+- (void)notifyDelegateOfPosixErrorCode:(int)code;
 
 @property (copy, readwrite) NSString *path;
 @property (readwrite) io_object_t IOKitDevice;
 @property (copy, readwrite) NSString *name;
 
-@property (strong) NSMutableData *writeBuffer;
+// Everything below up to fileDescriptor is only touched on writeQueue
+@property (strong) NSMutableArray *pendingWrites;
+@property (readwrite) NSUInteger bytesWaitingToBeSent;
+@property BOOL writeSourceSuspended;
+@property BOOL sendWasRefused; // So the delegate is told when there is room again
 @property int fileDescriptor;
 
 @property (nonatomic, readwrite) BOOL CTS;
@@ -87,8 +133,16 @@ static __strong NSMutableArray *allSerialPorts;
 
 #if OS_OBJECT_HAVE_OBJC_SUPPORT
 @property (nonatomic, strong) dispatch_source_t pinPollTimer;
+@property (nonatomic, strong) dispatch_queue_t readQueue;
+@property (nonatomic, strong) dispatch_source_t readSource;
+@property (nonatomic, strong) dispatch_queue_t writeQueue;
+@property (nonatomic, strong) dispatch_source_t writeSource;
 #else
 @property (nonatomic) dispatch_source_t pinPollTimer;
+@property (nonatomic) dispatch_queue_t readQueue;
+@property (nonatomic) dispatch_source_t readSource;
+@property (nonatomic) dispatch_queue_t writeQueue;
+@property (nonatomic) dispatch_source_t writeSource;
 #endif
 
 @end
@@ -153,8 +207,15 @@ static __strong NSMutableArray *allSerialPorts;
  	io_object_t device = [[self class] deviceFromBSDPath:devicePath];
  	if (device == 0) 
  	{
- 		self = nil;
- 		return self;
+		// Not a serial port IOKit knows about, but any terminal device can be used as one,
+		// e.g. a pseudo-terminal with a simulated device on the other end.
+		struct stat status;
+		if (stat([devicePath fileSystemRepresentation], &status) != 0 || !S_ISCHR(status.st_mode))
+		{
+			self = nil;
+			return self;
+		}
+		return [self initWithBSDPath:devicePath device:0];
  	}
  	
  	return [self initWithDevice:device];
@@ -164,7 +225,11 @@ static __strong NSMutableArray *allSerialPorts;
 {
 	NSAssert(device != 0, @"%s requires non-zero device argument.", __PRETTY_FUNCTION__);
 	
-	NSString *bsdPath = [[self class] bsdCalloutPathFromDevice:device];
+	return [self initWithBSDPath:[[self class] bsdCalloutPathFromDevice:device] device:device];
+}
+
+- (id)initWithBSDPath:(NSString *)bsdPath device:(io_object_t)device;
+{
 	ORSSerialPort *existingPort = [[self class] existingPortWithPath:bsdPath];
 	
 	if (existingPort != nil)
@@ -179,8 +244,17 @@ static __strong NSMutableArray *allSerialPorts;
 	{
 		self.ioKitDevice = device;
 		self.path = bsdPath;
-		self.name = [[self class] modemNameFromDevice:device];
-		self.writeBuffer = [NSMutableData data];
+		self.name = device != 0 ? [[self class] modemNameFromDevice:device] : [bsdPath lastPathComponent];
+		self.pendingWrites = [NSMutableArray array];
+		self.maximumWriteBacklog = ORSSerialPortDefaultMaximumWriteBacklog;
+		dispatch_queue_t writeQueue = dispatch_queue_create("com.openreelsoftware.ORSSerialPort.write", DISPATCH_QUEUE_SERIAL);
+		self.writeQueue = writeQueue;
+		ORS_GCD_RELEASE(writeQueue);
+		dispatch_queue_t readQueue = dispatch_queue_create("com.openreelsoftware.ORSSerialPort.read", DISPATCH_QUEUE_SERIAL);
+		dispatch_set_target_queue(readQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+		self.readQueue = readQueue;
+		ORS_GCD_RELEASE(readQueue);
+		self.receiveQueue = dispatch_get_main_queue();
 		self.baudRate = @B19200;
 		self.numberOfStopBits = 1;
 		self.parity = ORSSerialPortParityNone;
@@ -213,6 +287,23 @@ static __strong NSMutableArray *allSerialPorts;
 		dispatch_source_cancel(_pinPollTimer);
 		ORS_GCD_RELEASE(_pinPollTimer);
 	}
+	
+	if (_readSource) {
+		
+		dispatch_source_cancel(_readSource);
+		ORS_GCD_RELEASE(_readSource);
+	}
+	if (_readQueue) ORS_GCD_RELEASE(_readQueue);
+	if (_receiveQueue) ORS_GCD_RELEASE(_receiveQueue);
+	
+	if (_writeSource) {
+		
+		if (_writeSourceSuspended) dispatch_resume(_writeSource); // A suspended source can't be released
+		dispatch_source_cancel(_writeSource);
+		ORS_GCD_RELEASE(_writeSource);
+	}
+	if (_writeQueue) ORS_GCD_RELEASE(_writeQueue);
+	if (descriptorClosed) ORS_GCD_RELEASE(descriptorClosed);
 }
 
 - (NSString *)description
@@ -252,14 +343,10 @@ static __strong NSMutableArray *allSerialPorts;
 		return;
 	}
 	
-	// Now that the device is open, clear the O_NONBLOCK flag so subsequent I/O will block.
+	// O_NONBLOCK is left set, so a write never waits for the port to drain. The reader only
+	// reads when the read source says there is data, and the writer only writes when the port has room.
 	// See fcntl(2) ("man 2 fcntl") for details.
 	
-	if (fcntl(descriptor, F_SETFL, 0) == -1)
-	{
-		LOG_SERIAL_PORT_ERROR(@"Error clearing O_NONBLOCK %@ - %s(%d).\n", self.path, strerror(errno), errno);
-	}
-	
 	self.fileDescriptor = descriptor;
 	
 	// Port opened successfully, set options
@@ -288,104 +375,75 @@ static __strong NSMutableArray *allSerialPorts;
 		}
 	});
 	
-	// Start a read poller in the background
-	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-		
-		int localPortFD = self.fileDescriptor;
-		struct timeval timeout;
-		int result=0;
-		
-		while (self.isOpen) 
-		{
-			fd_set localReadFDSet;
-			FD_ZERO(&localReadFDSet);
-			FD_SET(descriptor, &localReadFDSet);
-
-			timeout.tv_sec = 0; 
-			timeout.tv_usec = 100000; // Check to see if port closed every 100ms
-			
-			result = select(localPortFD+1, &localReadFDSet, NULL, NULL, &timeout);
-			if (!self.isOpen) break; // Port closed while select call was waiting
-			if (result < 0) 
-			{
-				dispatch_sync(mainQueue, ^{[self notifyDelegateOfPosixError];});
-				continue;
-			}
-			
-			if (result == 0 || !FD_ISSET(localPortFD, &localReadFDSet)) continue;
-			
-			// Data is available
-			char buf[1024];
-			long lengthRead = read(localPortFD, buf, sizeof(buf));
-			if (lengthRead>0)
-			{
-				NSData *readData = [NSData dataWithBytes:buf length:lengthRead];
-				if (readData != nil) dispatch_async(dispatch_get_main_queue(), ^{
-					[self receiveData:readData];
-				});
-			}
-		}
-	});
+	// Read whenever data arrives, on readQueue. Data goes to receiveBytesBlock there, or data and packets go to
+	// receiveQueue from there without passing through the main queue unless receiveQueue is the main queue.
+	dispatch_source_t readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, descriptor, 0, self.readQueue);
+	dispatch_source_set_event_handler(readSource, ^{ [self readAvailableData]; });
+	dispatch_source_set_cancel_handler(readSource, ^{ [self sourceWasCancelledForDescriptor:descriptor]; });
 	
-	// Start another poller to check status of CTS and DSR
-	dispatch_queue_t pollQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-	dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, pollQueue);
+	// macOS has no event for changes of CTS, DSR and DCD, so they are still sampled, but on readQueue and
+	// against the last sample taken there. Only actual changes are posted to the main queue.
+	dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.readQueue);
 	dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, 0), 10*NSEC_PER_MSEC, 5*NSEC_PER_MSEC);
-	dispatch_source_set_event_handler(timer, ^{
-		if (!self.isOpen) {
-			dispatch_async(pollQueue, ^{ dispatch_source_cancel(timer); });
-			return;
-		}
-		
-		int32_t modemLines=0;
-		if (ioctl(self.fileDescriptor, TIOCMGET, &modemLines) < 0)
-		{
-			dispatch_sync(mainQueue, ^{[self notifyDelegateOfPosixError];});
-			return;
-		}
-		
-		BOOL CTSPin = (modemLines & TIOCM_CTS) != 0;
-		BOOL DSRPin = (modemLines & TIOCM_DSR) != 0;
-		BOOL DCDPin = (modemLines & TIOCM_CAR) != 0;
-		
-		if (CTSPin != self.CTS) 
-			dispatch_sync(mainQueue, ^{self.CTS = CTSPin;});
-		if (DSRPin != self.DSR) 
-			dispatch_sync(mainQueue, ^{self.DSR = DSRPin;});
-		if (DCDPin != self.DCD) 
-			dispatch_sync(mainQueue, ^{self.DCD = DCDPin;});
+	dispatch_source_set_event_handler(timer, ^{ [self sampleModemLines]; });
+	
+	dispatch_sync(self.readQueue, ^{
+		receiveBufferLength = 0;
+		lastModemLines = modemLines;
+		sourcesOpen = 2;
+		if (descriptorClosed) ORS_GCD_RELEASE(descriptorClosed);
+		descriptorClosed = dispatch_semaphore_create(0);
+		self.readSource = readSource;
+		self.pinPollTimer = timer;
 	});
-	self.pinPollTimer = timer;
-	dispatch_resume(self.pinPollTimer);
+	dispatch_resume(readSource);
+	dispatch_resume(timer);
+	ORS_GCD_RELEASE(readSource);
 	ORS_GCD_RELEASE(timer);
+	
+	// Writes that don't fit in the port's buffer wait on writeQueue, and are drained by this source
+	// whenever the port has room. It is suspended while there is nothing to write.
+	dispatch_source_t writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, descriptor, 0, self.writeQueue);
+	dispatch_source_set_event_handler(writeSource, ^{ [self writePendingData]; });
+	dispatch_source_set_cancel_handler(writeSource, ^{
+		dispatch_async(self.readQueue, ^{ [self sourceWasCancelledForDescriptor:descriptor]; });
+	});
+	dispatch_sync(self.writeQueue, ^{
+		self.writeSource = writeSource;
+		self.writeSourceSuspended = YES; // Sources are created suspended
+	});
+	ORS_GCD_RELEASE(writeSource);
 }
 
 - (BOOL)close;
 {
 	if (!self.isOpen) return YES;
 	
-	[self.writeBuffer replaceBytesInRange:NSMakeRange(0, [self.writeBuffer length]) withBytes:NULL length:0];
-	
-	// The next tcsetattr() call can fail if the port is waiting to send data. This is likely to happen
-	// e.g. if flow control is on and the CTS line is low. So, turn off flow control before proceeding
-	struct termios options;
-	tcgetattr(self.fileDescriptor, &options);
-	options.c_cflag &= ~CRTSCTS; // RTS/CTS Flow Control
-	options.c_cflag &= ~(CDTR_IFLOW | CDSR_OFLOW); // DTR/DSR Flow Control
-	options.c_cflag &= ~CCAR_OFLOW; // DCD Flow Control
-	tcsetattr(self.fileDescriptor, TCSANOW, &options);
-	
-	// Set port back the way it was before we used it
-	tcsetattr(self.fileDescriptor, TCSADRAIN, &originalPortAttributes);
+	// Stop reading and writing. Anything not yet sent or delivered is dropped. The descriptor is closed by
+	// whichever source finishes cancelling last, since until then GCD may still be watching it.
+	dispatch_sync(self.readQueue, ^{
+		if (self.readSource != nil) dispatch_source_cancel(self.readSource);
+		if (self.pinPollTimer != nil) dispatch_source_cancel(self.pinPollTimer);
+		self.readSource = nil;
+		self.pinPollTimer = nil;
+		receiveBufferLength = 0;
+	});
+	dispatch_sync(self.writeQueue, ^{
+		if (self.writeSource == nil) return;
+		if (self.writeSourceSuspended) dispatch_resume(self.writeSource);
+		dispatch_source_cancel(self.writeSource);
+		self.writeSource = nil;
+		self.writeSourceSuspended = NO;
+		[self discardPendingWrites];
+	});
 	
-	int localFD = self.fileDescriptor;
 	self.fileDescriptor = 0; // So other threads know that the port should be closed and can stop I/O operations
+	dispatch_semaphore_wait(descriptorClosed, DISPATCH_TIME_FOREVER);
 	
-	if (close(localFD))
+	if (closeError)
 	{
-		self.fileDescriptor = localFD;
-		LOG_SERIAL_PORT_ERROR(@"Error closing serial port with file descriptor %i:%i", self.fileDescriptor, errno);
-		[self notifyDelegateOfPosixError];
+		LOG_SERIAL_PORT_ERROR(@"Error closing serial port:%i", closeError);
+		[self notifyDelegateOfPosixErrorCode:closeError];
 		return NO;
 	}
 	
@@ -406,23 +464,57 @@ static __strong NSMutableArray *allSerialPorts;
 }
 
 - (BOOL)sendData:(NSData *)data;
+{
+	return [self sendData:data coalescingKey:nil completion:nil];
+}
+
+- (BOOL)sendData:(NSData *)data coalescingKey:(NSString *)key completion:(void (^)(BOOL sent))completion;
 {
 	if (!self.isOpen) return NO;
 	
-	[self.writeBuffer appendData:data];
-	
-	if ([self.writeBuffer length] < 1) return YES;
+	ORSSerialPortPendingWrite *pending = [[ORSSerialPortPendingWrite alloc] init];
+	pending.data = [data copy];
+	pending.coalescingKey = key;
+	pending.completion = completion;
 	
-	long numBytesWritten = write(self.fileDescriptor, [self.writeBuffer bytes], [self.writeBuffer length]);
-	if (numBytesWritten < 0)
-	{
-		LOG_SERIAL_PORT_ERROR(@"Error writing to serial port:%d", errno);
-		[self notifyDelegateOfPosixError];
-		return NO;
-	}
-	if (numBytesWritten > 0) [self.writeBuffer replaceBytesInRange:NSMakeRange(0, numBytesWritten) withBytes:NULL length:0];
+	__block BOOL accepted = YES;
+	dispatch_sync(self.writeQueue, ^{
+		if (self.writeSource == nil) { accepted = NO; return; } // Closed since the check above
+		
+		// Only a write that hasn't started can be replaced, or the port would get half a command
+		NSUInteger replacedIndex = NSNotFound;
+		if (key != nil)
+		{
+			replacedIndex = [self.pendingWrites indexOfObjectPassingTest:^BOOL(ORSSerialPortPendingWrite *queued, NSUInteger idx, BOOL *stop) {
+				return queued.bytesWritten == 0 && [queued.coalescingKey isEqualToString:key];
+			}];
+		}
+		ORSSerialPortPendingWrite *replaced = replacedIndex == NSNotFound ? nil : self.pendingWrites[replacedIndex];
+		
+		NSUInteger backlog = self.bytesWaitingToBeSent - [replaced.data length];
+		if (self.maximumWriteBacklog > 0 && backlog > 0 && backlog + [pending.data length] > self.maximumWriteBacklog)
+		{
+			self.sendWasRefused = YES;
+			accepted = NO;
+			return;
+		}
+		
+		if (replaced != nil)
+		{
+			self.pendingWrites[replacedIndex] = pending;
+			[self finishWrite:replaced sent:NO];
+		}
+		else
+		{
+			[self.pendingWrites addObject:pending];
+		}
+		self.bytesWaitingToBeSent = backlog + [pending.data length];
+		
+		// Most writes fit in the port's buffer straight away; the write source only waits for the rest
+		[self writePendingData];
+	});
 	
-	return YES;
+	return accepted;
 }
 
 #pragma mark - Private Methods
@@ -437,6 +529,198 @@ static __strong NSMutableArray *allSerialPorts;
 	}
 }
 
+- (void)receivePacket:(NSData *)packet;
+{
+	if ([(id)[self delegate] respondsToSelector:@selector(serialPort:didReceivePacket:)])
+	{
+		[[self delegate] serialPort:self didReceivePacket:packet];
+	}
+}
+
+// Called on readQueue when the read source says there is data.
+- (void)readAvailableData;
+{
+	long lengthRead = read(self.fileDescriptor, receiveBuffer + receiveBufferLength, ORSSerialPortReceiveBufferSize - receiveBufferLength);
+	if (lengthRead < 0)
+	{
+		if (errno == EAGAIN || errno == EINTR) return;
+		int code = errno;
+		dispatch_async(dispatch_get_main_queue(), ^{ [self notifyDelegateOfPosixErrorCode:code]; });
+	}
+	if (lengthRead <= 0)
+	{
+		// The device has gone, or the other end of a pseudo-terminal was closed. The source would keep
+		// saying there is something to read, so stop reading and close the port, unless it has been closed already.
+		int descriptor = self.fileDescriptor;
+		dispatch_source_cancel(self.readSource);
+		dispatch_async(dispatch_get_main_queue(), ^{ if (self.fileDescriptor == descriptor) [self close]; });
+		return;
+	}
+	
+	receiveBufferLength += lengthRead;
+	[self deliverReceivedData];
+}
+
+// Called on readQueue. Hands whatever is complete to receiveBytesBlock or receiveQueue and keeps the rest for the next read.
+- (void)deliverReceivedData;
+{
+	dispatch_queue_t queue = self.receiveQueue;
+	ORSSerialPortPacketLengthBlock packetLength = self.packetLengthBlock;
+	ORSSerialPortReceiveBytesBlock receiveBytes = self.receiveBytesBlock;
+	if (packetLength == nil && receiveBytes != nil)
+	{
+		receiveBytes(receiveBuffer, receiveBufferLength);
+		receiveBufferLength = 0;
+		return;
+	}
+	if (packetLength == nil)
+	{
+		NSData *data = [NSData dataWithBytes:receiveBuffer length:receiveBufferLength];
+		receiveBufferLength = 0;
+		dispatch_async(queue, ^{ [self receiveData:data]; });
+		return;
+	}
+	
+	NSUInteger start = 0;
+	while (start < receiveBufferLength)
+	{
+		NSInteger length = packetLength(receiveBuffer + start, receiveBufferLength - start);
+		if (length == 0) break; // The rest is the start of a packet
+		if (length < 0) // Not part of any packet
+		{
+			start += MIN((NSUInteger)-length, receiveBufferLength - start);
+			continue;
+		}
+		
+		length = MIN((NSUInteger)length, receiveBufferLength - start);
+		NSData *packet = [NSData dataWithBytes:receiveBuffer + start length:length];
+		start += length;
+		dispatch_async(queue, ^{ [self receivePacket:packet]; });
+	}
+	
+	if (start == 0 && receiveBufferLength == ORSSerialPortReceiveBufferSize)
+	{
+		LOG_SERIAL_PORT_ERROR(@"Dropping %lu bytes that don't make a packet", (unsigned long)receiveBufferLength);
+		start = receiveBufferLength;
+	}
+	memmove(receiveBuffer, receiveBuffer + start, receiveBufferLength - start);
+	receiveBufferLength -= start;
+}
+
+// Called on readQueue once for each of the read and write sources, when it has been cancelled.
+- (void)sourceWasCancelledForDescriptor:(int)descriptor;
+{
+	if (--sourcesOpen > 0) return;
+	
+	// The next tcsetattr() call can fail if the port is waiting to send data. This is likely to happen
+	// e.g. if flow control is on and the CTS line is low. So, turn off flow control before proceeding
+	struct termios options;
+	tcgetattr(descriptor, &options);
+	options.c_cflag &= ~CRTSCTS; // RTS/CTS Flow Control
+	options.c_cflag &= ~(CDTR_IFLOW | CDSR_OFLOW); // DTR/DSR Flow Control
+	options.c_cflag &= ~CCAR_OFLOW; // DCD Flow Control
+	tcsetattr(descriptor, TCSANOW, &options);
+	
+	// Set port back the way it was before we used it
+	tcsetattr(descriptor, TCSADRAIN, &originalPortAttributes);
+	
+	closeError = close(descriptor) ? errno : 0;
+	dispatch_semaphore_signal(descriptorClosed);
+}
+
+// Called on readQueue by the modem line timer.
+- (void)sampleModemLines;
+{
+	int modemLines=0;
+	if (ioctl(self.fileDescriptor, TIOCMGET, &modemLines) < 0)
+	{
+		// Reported once: a device without modem lines, such as a pseudo-terminal, would fail every time.
+		int code = errno;
+		dispatch_source_cancel(self.pinPollTimer);
+		dispatch_async(dispatch_get_main_queue(), ^{ [self notifyDelegateOfPosixErrorCode:code]; });
+		return;
+	}
+	
+	int changed = (modemLines ^ lastModemLines) & (TIOCM_CTS | TIOCM_DSR | TIOCM_CAR);
+	lastModemLines = modemLines;
+	if (changed == 0) return;
+	
+	BOOL CTSPin = (modemLines & TIOCM_CTS) != 0;
+	BOOL DSRPin = (modemLines & TIOCM_DSR) != 0;
+	BOOL DCDPin = (modemLines & TIOCM_CAR) != 0;
+	dispatch_async(dispatch_get_main_queue(), ^{
+		if (changed & TIOCM_CTS) self.CTS = CTSPin;
+		if (changed & TIOCM_DSR) self.DSR = DSRPin;
+		if (changed & TIOCM_CAR) self.DCD = DCDPin;
+	});
+}
+
+// Called on writeQueue. Writes as much as the port will take, then waits for the write source
+// to say there is room for the rest.
+- (void)writePendingData;
+{
+	while ([self.pendingWrites count] > 0)
+	{
+		ORSSerialPortPendingWrite *pending = self.pendingWrites[0];
+		NSUInteger remaining = [pending.data length] - pending.bytesWritten;
+		long numBytesWritten = remaining == 0 ? 0 : write(self.fileDescriptor, (const char *)[pending.data bytes] + pending.bytesWritten, remaining);
+		if (numBytesWritten < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break; // Port is full; try again when it has room
+			
+			int code = errno;
+			LOG_SERIAL_PORT_ERROR(@"Error writing to serial port:%d", code);
+			dispatch_async(dispatch_get_main_queue(), ^{ [self notifyDelegateOfPosixErrorCode:code]; });
+			[self discardPendingWrites]; // The rest would arrive without this command in front of it
+			break;
+		}
+		
+		pending.bytesWritten += numBytesWritten;
+		self.bytesWaitingToBeSent -= numBytesWritten;
+		if (pending.bytesWritten < [pending.data length]) break;
+		
+		[self.pendingWrites removeObjectAtIndex:0];
+		[self finishWrite:pending sent:YES];
+	}
+	
+	BOOL idle = [self.pendingWrites count] == 0;
+	if (idle != self.writeSourceSuspended && self.writeSource != nil)
+	{
+		if (idle) dispatch_suspend(self.writeSource);
+		else dispatch_resume(self.writeSource);
+		self.writeSourceSuspended = idle;
+	}
+	
+	if (self.sendWasRefused && self.bytesWaitingToBeSent <= self.maximumWriteBacklog / 2)
+	{
+		self.sendWasRefused = NO;
+		dispatch_async(dispatch_get_main_queue(), ^{
+			if ([(id)self.delegate respondsToSelector:@selector(serialPortIsReadyToSend:)])
+			{
+				[self.delegate serialPortIsReadyToSend:self];
+			}
+		});
+	}
+}
+
+// Called on writeQueue
+- (void)finishWrite:(ORSSerialPortPendingWrite *)pending sent:(BOOL)sent;
+{
+	void (^completion)(BOOL) = pending.completion;
+	if (completion != nil) dispatch_async(dispatch_get_main_queue(), ^{ completion(sent); });
+}
+
+// Called on writeQueue
+- (void)discardPendingWrites;
+{
+	NSArray *discarded = [self.pendingWrites copy];
+	[self.pendingWrites removeAllObjects];
+	self.bytesWaitingToBeSent = 0;
+	self.sendWasRefused = NO;
+	for (ORSSerialPortPendingWrite *pending in discarded) [self finishWrite:pending sent:NO];
+}
+
 #pragma mark Port Propeties Methods
 
 - (void)setPortOptions;
@@ -568,13 +852,18 @@ static __strong NSMutableArray *allSerialPorts;
 #pragma mark Helper Methods
 
 - (void)notifyDelegateOfPosixError;
+{
+	[self notifyDelegateOfPosixErrorCode:errno];
+}
+
+- (void)notifyDelegateOfPosixErrorCode:(int)code;
 {
 	if (![(id)self.delegate respondsToSelector:@selector(serialPort:didEncounterError:)]) return;
 	
-	NSDictionary *errDict = @{NSLocalizedDescriptionKey: @(strerror(errno)),
+	NSDictionary *errDict = @{NSLocalizedDescriptionKey: @(strerror(code)),
 							 NSFilePathErrorKey: self.path};
 	NSError *error = [NSError errorWithDomain:NSPOSIXErrorDomain
-										 code:errno
+										 code:code
 									 userInfo:errDict];
 	[self.delegate serialPort:self didEncounterError:error];
 }
@@ -754,9 +1043,29 @@ static __strong NSMutableArray *allSerialPorts;
 @synthesize DSR = _DSR;
 @synthesize DCD = _DCD;
 
+@synthesize receiveQueue = _receiveQueue;
+- (void)setReceiveQueue:(dispatch_queue_t)queue
+{
+	if (queue == nil) queue = dispatch_get_main_queue();
+	if (queue != _receiveQueue)
+	{
+		if (_receiveQueue) { ORS_GCD_RELEASE(_receiveQueue); }
+		
+		ORS_GCD_RETAIN(queue);
+		_receiveQueue = queue;
+	}
+}
+
+@synthesize packetLengthBlock = _packetLengthBlock;
+@synthesize receiveBytesBlock = _receiveBytesBlock;
+
 #pragma mark Private Properties
 
-@synthesize writeBuffer = _writeBuffer;
+@synthesize pendingWrites = _pendingWrites;
+@synthesize bytesWaitingToBeSent = _bytesWaitingToBeSent;
+@synthesize maximumWriteBacklog = _maximumWriteBacklog;
+@synthesize writeSourceSuspended = _writeSourceSuspended;
+@synthesize sendWasRefused = _sendWasRefused;
 @synthesize fileDescriptor = _fileDescriptor;
 @synthesize pinPollTimer = _pinPollTimer;
 - (void)setPinPollTimer:(dispatch_source_t)timer
@@ -770,4 +1079,52 @@ static __strong NSMutableArray *allSerialPorts;
 	}
 }
 
+@synthesize readQueue = _readQueue;
+- (void)setReadQueue:(dispatch_queue_t)queue
+{
+	if (queue != _readQueue)
+	{
+		if (_readQueue) { ORS_GCD_RELEASE(_readQueue); }
+		
+		ORS_GCD_RETAIN(queue);
+		_readQueue = queue;
+	}
+}
+
+@synthesize readSource = _readSource;
+- (void)setReadSource:(dispatch_source_t)source
+{
+	if (source != _readSource)
+	{
+		if (_readSource) { ORS_GCD_RELEASE(_readSource); }
+		
+		ORS_GCD_RETAIN(source);
+		_readSource = source;
+	}
+}
+
+@synthesize writeQueue = _writeQueue;
+- (void)setWriteQueue:(dispatch_queue_t)queue
+{
+	if (queue != _writeQueue)
+	{
+		if (_writeQueue) { ORS_GCD_RELEASE(_writeQueue); }
+		
+		ORS_GCD_RETAIN(queue);
+		_writeQueue = queue;
+	}
+}
+
+@synthesize writeSource = _writeSource;
+- (void)setWriteSource:(dispatch_source_t)source
+{
+	if (source != _writeSource)
+	{
+		if (_writeSource) { ORS_GCD_RELEASE(_writeSource); }
+		
+		ORS_GCD_RETAIN(source);
+		_writeSource = source;
+	}
+}
+
 @end
@@ -0,0 +1,304 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The RectificationCache class describes an on-disk cache of the matrices the StereoMatcher derives from the calibration files
+ * (the calibration itself, the rectification transforms and the four undistort/rectify maps). Computing the maps takes a
+ * noticeable time, so they are written once to a compact binary file and mapped straight into memory on later launches.
+ *
+ * Each cache file is named after a key built from the contents of the calibration files and the image size, so a new
+ * calibration or camera resolution simply misses the cache and writes a new file. The file layout is a fixed header
+ * followed by one record per matrix (rows, cols, type and the raw data padded to 16 bytes).
+ *
+ * The cache lives in a directory only the user can write to, and files are created under an unpredictable name before being
+ * renamed into place, so nobody else can plant a cache file or redirect a write through a symbolic link. A file that doesn't
+ * describe valid matrices is treated as a miss, so the maps are rebuilt and the file replaced.
+ */
+#ifndef RECTIFICATION_CACHE_HPP
+#define RECTIFICATION_CACHE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pwd.h>
+using namespace cv;
+
+class RectificationCache
+{
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t matrixCount;
+        uint64_t key;
+        uint64_t reserved;
+    };
+    struct MatrixHeader
+    {
+        int32_t rows;
+        int32_t cols;
+        int32_t type;
+        int32_t reserved;
+    };
+    static const uint32_t formatVersion = 1;
+    static const size_t alignment = 16;
+
+    std::string directory;
+    void *mapping; // The mapped cache file. The matrices returned by load() point into it.
+    size_t mappingLength;
+
+    static inline std::string defaultDirectory();
+    static inline bool isPrivateDirectory(const std::string &path);
+    static inline bool isValidType(int32_t type);
+    static inline size_t padded(size_t length);
+    static inline uint64_t hashBytes(uint64_t hash, const void *data, size_t length);
+    inline std::string fileNameForKey(uint64_t key);
+    inline void unmap();
+public:
+    /**
+     * Constructor for the RectificationCache.
+     * @param cacheDirectory The directory to keep cache files in, created if it doesn't exist. If empty,
+     *                       ~/Library/Caches/ImageGuidedFeedingSystem on OS X or $XDG_CACHE_HOME/ImageGuidedFeedingSystem
+     *                       (~/.cache by default) elsewhere. Nothing is cached if the directory can be written by anyone but
+     *                       the user.
+     */
+    inline RectificationCache(std::string cacheDirectory = "");
+    /**
+     * Destructor for the RectificationCache. Unmaps the cache file, so matrices returned by load() must not outlive the cache.
+     */
+    inline ~RectificationCache();
+    /**
+     * Build the cache key for a calibration.
+     * @param  intrinsicFileName The path to the intrinsic parameter file.
+     * @param  extrinsicFileName The path to the extrinsic parameter file.
+     * @param  imageSize         The size of the images that will be rectified.
+     * @param  key               reference to where the key will be stored.
+     * @return                   true if both files could be read, false otherwise.
+     */
+    static inline bool calibrationKey(const std::string &intrinsicFileName, const std::string &extrinsicFileName, cv::Size imageSize, uint64_t &key);
+    /**
+     * Load the matrices cached for key. The matrices share memory with the mapped file rather than being copied.
+     * @param  key      The key built by calibrationKey().
+     * @param  matrices reference to a vector where the matrices will be stored, in the order they were stored.
+     * @return          true if a valid cache file was found, false otherwise.
+     */
+    inline bool load(uint64_t key, std::vector<Mat> &matrices);
+    /**
+     * Write matrices to the cache file for key. The file is written under a temporary name and then renamed, so a reader
+     * never sees a partly written file. Failing to write the cache is not an error; it just means it is rebuilt next time.
+     * @param  key      The key built by calibrationKey().
+     * @param  matrices The matrices to store.
+     * @return          true if the cache file was written, false otherwise.
+     */
+    inline bool store(uint64_t key, const std::vector<Mat> &matrices);
+};
+
+inline RectificationCache::RectificationCache(std::string cacheDirectory): directory(cacheDirectory), mapping(0), mappingLength(0) {
+    if(directory.empty())
+        directory = defaultDirectory();
+    if(!directory.empty() && !isPrivateDirectory(directory))
+        directory.clear(); // Disables the cache
+    if(!directory.empty() && directory[directory.size() - 1] != '/')
+        directory += "/";
+}
+
+inline std::string RectificationCache::defaultDirectory() {
+    std::string home;
+    const char *environmentHome = getenv("HOME");
+    if(environmentHome && *environmentHome) {
+        home = environmentHome;
+    } else {
+        struct passwd *user = getpwuid(getuid());
+        if(user && user->pw_dir)
+            home = user->pw_dir;
+    }
+#ifdef __APPLE__
+    std::string caches = home.empty() ? "" : home + "/Library/Caches";
+#else
+    const char *xdgCache = getenv("XDG_CACHE_HOME");
+    std::string caches = xdgCache && *xdgCache == '/' ? xdgCache : home.empty() ? "" : home + "/.cache";
+    if(!caches.empty())
+        mkdir(caches.c_str(), 0700);
+#endif
+    return caches.empty() ? "" : caches + "/ImageGuidedFeedingSystem";
+}
+
+inline bool RectificationCache::isPrivateDirectory(const std::string &path) {
+    mkdir(path.c_str(), 0700);
+    struct stat status;
+    if(lstat(path.c_str(), &status) != 0 || !S_ISDIR(status.st_mode))
+        return false;
+    return status.st_uid == getuid() && (status.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+inline bool RectificationCache::isValidType(int32_t type) {
+    return type == CV_MAT_TYPE(type) && CV_MAT_DEPTH(type) <= CV_64F;
+}
+
+inline RectificationCache::~RectificationCache() {
+    unmap();
+}
+
+inline void RectificationCache::unmap() {
+    if(mapping)
+        munmap(mapping, mappingLength);
+    mapping = 0;
+    mappingLength = 0;
+}
+
+inline size_t RectificationCache::padded(size_t length) {
+    return (length + alignment - 1) & ~(alignment - 1);
+}
+
+inline uint64_t RectificationCache::hashBytes(uint64_t hash, const void *data, size_t length) {
+    // 64 bit FNV-1a
+    const unsigned char *bytes = (const unsigned char *)data;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline std::string RectificationCache::fileNameForKey(uint64_t key) {
+    char name[64];
+    snprintf(name, sizeof(name), "rectification-%016llx.bin", (unsigned long long)key);
+    return directory + name;
+}
+
+inline bool RectificationCache::calibrationKey(const std::string &intrinsicFileName, const std::string &extrinsicFileName, cv::Size imageSize, uint64_t &key) {
+    uint64_t hash = 14695981039346656037ULL;
+    std::string fileNames[2] = {intrinsicFileName, extrinsicFileName};
+    for(int i = 0; i < 2; i++) {
+        std::ifstream file(fileNames[i].c_str(), std::ios::in | std::ios::binary);
+        if(!file)
+            return false;
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string bytes = contents.str();
+        hash = hashBytes(hash, bytes.data(), bytes.size());
+    }
+    int32_t sizeAndVersion[3] = {imageSize.width, imageSize.height, (int32_t)formatVersion};
+    key = hashBytes(hash, sizeAndVersion, sizeof(sizeAndVersion));
+    return true;
+}
+
+inline bool RectificationCache::load(uint64_t key, std::vector<Mat> &matrices) {
+    unmap();
+    matrices.clear();
+    if(directory.empty())
+        return false;
+    std::string fileName = fileNameForKey(key);
+    int descriptor = open(fileName.c_str(), O_RDONLY | O_NOFOLLOW);
+    if(descriptor < 0)
+        return false;
+    struct stat fileStatus;
+    if(fstat(descriptor, &fileStatus) != 0 || !S_ISREG(fileStatus.st_mode) || fileStatus.st_uid != getuid() ||
+       fileStatus.st_size < (off_t)sizeof(FileHeader)) {
+        close(descriptor);
+        return false;
+    }
+    size_t length = (size_t)fileStatus.st_size;
+    // Private writable mapping so that nothing writing to a matrix by accident can change the file.
+    void *data = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if(data == MAP_FAILED)
+        return false;
+    mapping = data;
+    mappingLength = length;
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    const FileHeader *header = (const FileHeader *)bytes;
+    if(memcmp(header->magic, "IGFSRECT", 8) != 0 || header->version != formatVersion || header->key != key) {
+        unmap();
+        return false;
+    }
+    size_t offset = padded(sizeof(FileHeader));
+    for(uint32_t i = 0; i < header->matrixCount; i++) {
+        if(offset > length || length - offset < padded(sizeof(MatrixHeader)))
+            break;
+        const MatrixHeader *matrixHeader = (const MatrixHeader *)(bytes + offset);
+        offset += padded(sizeof(MatrixHeader));
+        // Checked before a Mat is made of them, since Mat throws on a bad type
+        int32_t rows = matrixHeader->rows, cols = matrixHeader->cols, type = matrixHeader->type;
+        if(rows < 0 || cols < 0 || (rows == 0) != (cols == 0) || !isValidType(type))
+            break;
+        // The elements left in the file bound rows*cols before anything is multiplied out, so nothing can overflow.
+        uint64_t elementsLeft = (length - offset)/CV_ELEM_SIZE(type);
+        if((uint64_t)rows*(uint64_t)cols > elementsLeft)
+            break;
+        size_t dataLength = (size_t)rows*(size_t)cols*CV_ELEM_SIZE(type);
+        Mat matrix;
+        if(rows > 0)
+            matrix = Mat(rows, cols, type, (void *)(bytes + offset));
+        offset += padded(dataLength);
+        matrices.push_back(matrix);
+    }
+    if(matrices.size() != header->matrixCount) {
+        matrices.clear();
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+inline bool RectificationCache::store(uint64_t key, const std::vector<Mat> &matrices) {
+    if(directory.empty())
+        return false;
+    std::string fileName = fileNameForKey(key);
+    std::vector<char> temporaryName(fileName.begin(), fileName.end());
+    const char suffix[] = ".XXXXXX";
+    temporaryName.insert(temporaryName.end(), suffix, suffix + sizeof(suffix)); // Includes the terminating zero
+    int descriptor = mkstemp(&temporaryName[0]); // Created with O_EXCL and mode 0600, never through a link
+    if(descriptor < 0)
+        return false;
+    FILE *file = fdopen(descriptor, "wb");
+    if(!file) {
+        close(descriptor);
+        unlink(&temporaryName[0]);
+        return false;
+    }
+    static const char padding[alignment] = {0};
+
+    FileHeader header;
+    memcpy(header.magic, "IGFSRECT", 8);
+    header.version = formatVersion;
+    header.matrixCount = (uint32_t)matrices.size();
+    header.key = key;
+    header.reserved = 0;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(padding, 1, padded(sizeof(header)) - sizeof(header), file);
+
+    for(size_t i = 0; i < matrices.size(); i++) {
+        Mat matrix = matrices[i].isContinuous() ? matrices[i] : matrices[i].clone();
+        MatrixHeader matrixHeader;
+        matrixHeader.rows = matrix.rows;
+        matrixHeader.cols = matrix.cols;
+        matrixHeader.type = matrix.type();
+        matrixHeader.reserved = 0;
+        fwrite(&matrixHeader, sizeof(matrixHeader), 1, file);
+        fwrite(padding, 1, padded(sizeof(matrixHeader)) - sizeof(matrixHeader), file);
+        size_t dataLength = matrix.total()*matrix.elemSize();
+        if(dataLength > 0)
+            fwrite(matrix.data, 1, dataLength, file);
+        fwrite(padding, 1, padded(dataLength) - dataLength, file);
+    }
+    bool written = !ferror(file);
+    if(fclose(file) != 0 || !written || rename(&temporaryName[0], fileName.c_str()) != 0) {
+        unlink(&temporaryName[0]);
+        return false;
+    }
+    return true;
+}
+
+#endif
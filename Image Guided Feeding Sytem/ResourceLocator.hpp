@@ -0,0 +1,121 @@
+/**
+ * @file
+ * @section Description
+ *
+ * A ResourceLocator finds the files the vision code needs (the haar cascades and the calibration files) by name and type.
+ * The app finds them in its bundle's resources; the headless tools find them in plain directories. Everything that loads a
+ * resource takes a locator so that the same code runs in both.
+ */
+#ifndef RESOURCE_LOCATOR_HPP
+#define RESOURCE_LOCATOR_HPP
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#ifdef __APPLE__
+#include "CoreFoundation/CoreFoundation.h"
+#endif
+
+class ResourceLocator
+{
+public:
+    virtual ~ResourceLocator() {}
+    /**
+     * Find a resource.
+     * @param  name The name of the resource without its extension, e.g. haarcascade_mcs_mouth
+     * @param  type The extension of the resource, e.g. xml
+     * @return      The path to the resource, or an empty string if it could not be found.
+     */
+    virtual std::string locate(const std::string &name, const std::string &type) = 0;
+};
+
+/**
+ * Looks for resources in a list of directories, and in a Cascades directory inside each of them (the layout of the source tree).
+ */
+class DirectoryResourceLocator: public ResourceLocator
+{
+    std::vector<std::string> directories;
+public:
+    /**
+     * Constructor for the DirectoryResourceLocator.
+     * @param directory The first directory to search.
+     */
+    inline DirectoryResourceLocator(const std::string &directory);
+    /**
+     * Add another directory to search, after the ones already added.
+     * @param directory The directory to search.
+     */
+    inline void addDirectory(const std::string &directory);
+    inline std::string locate(const std::string &name, const std::string &type);
+};
+
+#ifdef __APPLE__
+/**
+ * Looks for resources in the main bundle of the application.
+ */
+class BundleResourceLocator: public ResourceLocator
+{
+public:
+    inline std::string locate(const std::string &name, const std::string &type);
+};
+#endif
+
+/**
+ * The locator used when none is given: the application bundle on OS X, otherwise the directory named by the
+ * IGFS_RESOURCE_DIR environment variable, falling back to the current directory.
+ * @return a locator that lives for the life of the program.
+ */
+inline ResourceLocator *defaultResourceLocator();
+
+inline DirectoryResourceLocator::DirectoryResourceLocator(const std::string &directory) {
+    addDirectory(directory);
+}
+
+inline void DirectoryResourceLocator::addDirectory(const std::string &directory) {
+    if(directory.empty())
+        return;
+    directories.push_back(directory[directory.size() - 1] == '/' ? directory : directory + "/");
+}
+
+inline std::string DirectoryResourceLocator::locate(const std::string &name, const std::string &type) {
+    std::string fileName = name + "." + type;
+    for(size_t i = 0; i < directories.size(); i++) {
+        std::string candidates[2] = {directories[i] + fileName, directories[i] + "Cascades/" + fileName};
+        for(int j = 0; j < 2; j++) {
+            if(access(candidates[j].c_str(), R_OK) == 0)
+                return candidates[j];
+        }
+    }
+    return "";
+}
+
+#ifdef __APPLE__
+inline std::string BundleResourceLocator::locate(const std::string &name, const std::string &type) {
+    CFStringRef resourceName = CFStringCreateWithCString(NULL, name.c_str(), kCFStringEncodingUTF8);
+    CFStringRef resourceType = CFStringCreateWithCString(NULL, type.c_str(), kCFStringEncodingUTF8);
+    CFBundleRef mainBundle = CFBundleGetMainBundle();
+    CFURLRef fileURL = CFBundleCopyResourceURL( mainBundle, resourceName, resourceType, NULL );
+    CFRelease(resourceName);
+    CFRelease(resourceType);
+    char path[512];
+    bool found = fileURL && CFURLGetFileSystemRepresentation(fileURL, TRUE, (UInt8 *)path, 512);
+    if(fileURL)
+        CFRelease(fileURL);
+    return found ? std::string(path) : std::string();
+}
+#endif
+
+inline ResourceLocator *defaultResourceLocator() {
+#ifdef __APPLE__
+    if(CFBundleGetMainBundle()) {
+        static BundleResourceLocator bundleLocator;
+        return &bundleLocator;
+    }
+#endif
+    const char *directory = getenv("IGFS_RESOURCE_DIR");
+    static DirectoryResourceLocator directoryLocator(directory ? directory : ".");
+    return &directoryLocator;
+}
+
+#endif
@@ -0,0 +1,290 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The StereoFrameGrabber class describes an object that reads a pair of cameras on their own threads so that the vision code
+ * never waits on USB I/O. Each camera is grabbed and timestamped independently; the left capture thread grabs every left
+ * frame straight into a buffer from a StereoFramePool, moves the newest right frame into it when their timestamps are close
+ * enough, and publishes the buffer's handle through a lock-free TripleBuffer. The consumer can then always take the freshest
+ * stereo pair without blocking, and takes the buffer the cameras were read into rather than a copy of it.
+ *
+ * Any FrameSource works as a source (cameras, video files, image sequences, synthetic frames), so the grabber has no platform
+ * dependencies and can be run against recorded footage.
+ */
+#ifndef STEREO_FRAME_GRABBER_HPP
+#define STEREO_FRAME_GRABBER_HPP
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cmath>
+#include "TripleBuffer.hpp"
+#include "StereoFramePool.hpp"
+#include "FrameSource.hpp"
+#include "Trace.hpp"
+using namespace cv;
+
+/**
+ * Anything the tracking pipeline can take stereo pairs from: the live StereoFrameGrabber, or a recording being replayed.
+ */
+class StereoPairSource
+{
+public:
+    virtual ~StereoPairSource() {}
+    /**
+     * Tells us if the source can deliver pairs.
+     * @return true if the source is open, otherwise false.
+     */
+    virtual bool isOpened() = 0;
+    /**
+     * Start delivering pairs. Does nothing if already started.
+     */
+    virtual void start() = 0;
+    /**
+     * Stop delivering pairs.
+     */
+    virtual void stop() = 0;
+    /**
+     * Take the newest stereo pair if there is one the caller has not seen. Never blocks for long.
+     * The pair's buffer is handed over, not copied: the source never touches it again, so the caller may modify the frames
+     * until it shares the pair, and the buffer goes back to the source's pool once every handle to it is released.
+     * @param  pair reference to where the handle to the pair will be stored. Left alone if there is no new pair.
+     * @return      true if a new pair was stored, false otherwise.
+     */
+    virtual bool takeLatestPair(std::shared_ptr<StereoFramePair> &pair) = 0;
+    /**
+     * Wait until a new pair is ready to take, or the timeout passes. Sources that can't tell just sleep for the timeout.
+     * @param  timeoutSeconds The longest time to wait, in seconds.
+     * @return                true if a new pair may be ready, false if the wait timed out.
+     */
+    virtual bool waitForPair(double timeoutSeconds) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(timeoutSeconds));
+        return true;
+    }
+    /**
+     * Tells us if the source has run out of pairs.
+     * @return true if no more pairs will arrive, otherwise false.
+     */
+    virtual bool hasStreamEnded() = 0;
+};
+
+class StereoFrameGrabber: public StereoPairSource
+{
+    struct TimestampedFrame
+    {
+        Mat frame;
+        double timestamp;
+        TimestampedFrame(): timestamp(0) {}
+    };
+
+    FrameSource *leftCapture;
+    FrameSource *rightCapture;
+    StereoFramePool framePool; // Acquired from by the left capture thread only.
+    TripleBuffer<TimestampedFrame> rightFrames; // Right capture thread -> left capture thread.
+    std::mutex rightMutex; // Only guards waiting for rightPublished.
+    std::condition_variable rightPublished;
+    TripleBuffer<std::shared_ptr<StereoFramePair> > stereoPairs; // Left capture thread -> consumer.
+    std::thread leftThread;
+    std::thread rightThread;
+    std::atomic<bool> running;
+    std::atomic<bool> streamEnded;
+    std::mutex pairMutex; // Only guards waiting for pairPublished; the pairs themselves go through stereoPairs.
+    std::condition_variable pairPublished;
+    double maxTimestampSkew; // Largest allowed difference between the left and right grab times, in seconds.
+    double framePeriod; // Minimum time between grabs, in seconds. 0 grabs as fast as the source allows.
+    unsigned long pairsPublished;
+
+    inline void captureLeft();
+    inline void captureRight();
+    inline void waitForNextPeriod(double grabStarted);
+    inline bool takeRightFrame(double leftTimestamp);
+public:
+    /**
+     * Constructor for the StereoFrameGrabber. The sources are not owned by the grabber and must outlive it.
+     * @param leftSource       The source for the left camera.
+     * @param rightSource      The source for the right camera.
+     * @param maxSkew          The largest difference between left and right grab times, in seconds, that is still a pair.
+     * @param minFramePeriod   Minimum time between grabs, in seconds. Use it to play files back at camera rate; 0 for cameras.
+     * @param pairBuffers      The number of pairs in the grabber's pool: two for the grabber, and the rest for consumers to
+     *                         hold. Frames are dropped while consumers hold all of theirs.
+     */
+    inline StereoFrameGrabber(FrameSource *leftSource, FrameSource *rightSource, double maxSkew = 0.040, double minFramePeriod = 0.0,
+                              unsigned pairBuffers = 8);
+    /**
+     * Destructor for the StereoFrameGrabber. Stops the capture threads.
+     */
+    inline ~StereoFrameGrabber();
+    /**
+     * Tells us if both frame sources were opened.
+     * @return true if both sources are open, otherwise false.
+     */
+    inline bool isOpened();
+    /**
+     * Start the capture threads. Does nothing if they are already running.
+     */
+    inline void start();
+    /**
+     * Stop the capture threads and wait for them to finish.
+     */
+    inline void stop();
+    /**
+     * Take the newest stereo pair if one has been published since the last call. Never blocks. See StereoPairSource.
+     * @param  pair reference to where the handle to the pair will be stored. Left alone if there is no new pair.
+     * @return      true if a new pair was stored, false otherwise.
+     */
+    inline bool takeLatestPair(std::shared_ptr<StereoFramePair> &pair);
+    /**
+     * Wait until a pair has been published that the consumer has not taken, or the timeout passes.
+     * @param  timeoutSeconds The longest time to wait, in seconds.
+     * @return                true if a new pair is ready to take, false otherwise.
+     */
+    inline bool waitForPair(double timeoutSeconds);
+    /**
+     * Tells us if either source has run out of frames (e.g. the end of a video file or a camera was unplugged).
+     * @return true if capture has stopped because a source ended, otherwise false.
+     */
+    inline bool hasStreamEnded();
+    /**
+     * The clock used to timestamp frames.
+     * @return a monotonic time in seconds.
+     */
+    static inline double now();
+};
+
+inline StereoFrameGrabber::StereoFrameGrabber(FrameSource *leftSource, FrameSource *rightSource, double maxSkew, double minFramePeriod,
+    unsigned pairBuffers): leftCapture(leftSource), rightCapture(rightSource), framePool(pairBuffers), running(false), streamEnded(false),
+    maxTimestampSkew(maxSkew), framePeriod(minFramePeriod), pairsPublished(0) {
+}
+
+inline StereoFrameGrabber::~StereoFrameGrabber() {
+    stop();
+}
+
+inline bool StereoFrameGrabber::isOpened() {
+    return leftCapture->isOpened() && rightCapture->isOpened();
+}
+
+inline void StereoFrameGrabber::start() {
+    if(running)
+        return;
+    running = true;
+    streamEnded = false;
+    rightThread = std::thread(&StereoFrameGrabber::captureRight, this);
+    leftThread = std::thread(&StereoFrameGrabber::captureLeft, this);
+}
+
+inline void StereoFrameGrabber::stop() {
+    running = false;
+    if(leftThread.joinable())
+        leftThread.join();
+    if(rightThread.joinable())
+        rightThread.join();
+}
+
+inline bool StereoFrameGrabber::takeLatestPair(std::shared_ptr<StereoFramePair> &pair) {
+    if(!stereoPairs.update())
+        return false;
+    pair = std::move(stereoPairs.readBuffer()); // Leaves nothing behind, so the grabber doesn't hold on to the pair
+    return true;
+}
+
+inline bool StereoFrameGrabber::waitForPair(double timeoutSeconds) {
+    std::unique_lock<std::mutex> lock(pairMutex);
+    return pairPublished.wait_for(lock, std::chrono::duration<double>(timeoutSeconds), [this] { return stereoPairs.hasNewValue(); });
+}
+
+inline bool StereoFrameGrabber::hasStreamEnded() {
+    return streamEnded;
+}
+
+inline double StereoFrameGrabber::now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void StereoFrameGrabber::waitForNextPeriod(double grabStarted) {
+    if(framePeriod <= 0)
+        return;
+    double remaining = grabStarted + framePeriod - now();
+    if(remaining > 0)
+        std::this_thread::sleep_for(std::chrono::duration<double>(remaining));
+}
+
+inline void StereoFrameGrabber::captureRight() {
+    while(running) {
+        double grabStarted = now();
+        TimestampedFrame &slot = rightFrames.writeBuffer();
+        int64_t traceStart = Trace::now();
+        if(!rightCapture->grab()) {
+            streamEnded = true;
+            break;
+        }
+        slot.timestamp = now();
+        if(!rightCapture->retrieve(slot.frame) || slot.frame.empty()) {
+            streamEnded = true;
+            break;
+        }
+        Trace::record("captureRight", traceStart);
+        rightFrames.publish();
+        { std::lock_guard<std::mutex> lock(rightMutex); } // So the left thread can't miss the wake between its check and its wait.
+        rightPublished.notify_one();
+        waitForNextPeriod(grabStarted);
+    }
+}
+
+inline bool StereoFrameGrabber::takeRightFrame(double leftTimestamp) {
+    if(rightFrames.update())
+        return true;
+    // The right frame taken at the same time may be on its way; it makes a better pair than none.
+    double wait = leftTimestamp + maxTimestampSkew - now();
+    if(wait > 0) {
+        std::unique_lock<std::mutex> lock(rightMutex);
+        rightPublished.wait_for(lock, std::chrono::duration<double>(wait), [this] { return rightFrames.hasNewValue() || !running || streamEnded; });
+    }
+    return rightFrames.update();
+}
+
+inline void StereoFrameGrabber::captureLeft() {
+    while(running && !streamEnded) {
+        double grabStarted = now();
+        std::shared_ptr<StereoFramePair> &buffer = stereoPairs.writeBuffer();
+        buffer.reset(); // A pair published before the last one that the consumer never took; it goes back to the pool.
+        buffer = framePool.acquire();
+        int64_t traceStart = Trace::now();
+        if(!leftCapture->grab()) {
+            streamEnded = true;
+            break;
+        }
+        if(!buffer) { // Consumers hold every buffer, so this frame is dropped. Grabbing it keeps the camera from backing up.
+            TRACE_COUNT(framePoolExhaustions);
+            waitForNextPeriod(grabStarted);
+            continue;
+        }
+        StereoFramePair &pair = *buffer;
+        pair.leftTimestamp = now();
+        if(!leftCapture->retrieve(pair.left) || pair.left.empty()) {
+            streamEnded = true;
+            break;
+        }
+        Trace::record("captureLeft", traceStart);
+
+        // Pair with the newest right frame, if it hasn't been paired already. It is moved into the pair, and the pair's old
+        // right frame takes its place, to be filled again by the right capture thread.
+        bool haveRight = takeRightFrame(pair.leftTimestamp);
+        TimestampedFrame &right = rightFrames.readBuffer();
+        if(haveRight && !right.frame.empty() && fabs(pair.leftTimestamp - right.timestamp) <= maxTimestampSkew) {
+            std::swap(pair.right, right.frame);
+            pair.rightTimestamp = right.timestamp;
+            pair.sequenceNumber = ++pairsPublished;
+            stereoPairs.publish();
+            TRACE_COUNT(framesCaptured);
+            { std::lock_guard<std::mutex> lock(pairMutex); } // So a waiter can't miss the wake between its check and its wait.
+            pairPublished.notify_all();
+        }
+        waitForNextPeriod(grabStarted);
+    }
+}
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The StereoFramePool class holds a fixed number of stereo pair buffers that are reused for every frame. The capture thread
+ * grabs straight into a pooled buffer and hands the buffer itself on, so a pair reaches the pipeline, the display, the
+ * recorder and the arm commander without its pixels being copied, however many of them are looking at it. Once every buffer
+ * has been filled at the frame size, nothing is allocated either: the buffers and their handles are made once, up front.
+ *
+ * The producer takes a free buffer with acquire(), fills it and hands it on. Whoever holds it last before it is shared may
+ * still change it (the pipeline draws its detections on the frames); after that only read-only handles are handed out. A
+ * buffer is free again once every handle to it has been released. Handles may outlive the pool.
+ *
+ * Buffers are reused, so a consumer must keep the handle for as long as it uses the frames: a Mat copied out of a buffer
+ * shares its pixels, and those pixels are overwritten once the buffer is free and has been filled again.
+ */
+#ifndef STEREO_FRAME_POOL_HPP
+#define STEREO_FRAME_POOL_HPP
+
+#include <opencv2/opencv.hpp>
+#include <memory>
+#include <atomic>
+#include <vector>
+using namespace cv;
+
+/**
+ * A left and right frame captured at (nearly) the same time.
+ */
+struct StereoFramePair
+{
+    Mat left;
+    Mat right;
+    double leftTimestamp; // Time the left frame was grabbed, in seconds on StereoFrameGrabber::now().
+    double rightTimestamp; // Time the right frame was grabbed, in seconds on StereoFrameGrabber::now().
+    unsigned long sequenceNumber; // Counts published pairs, starting at 1.
+    StereoFramePair(): leftTimestamp(0), rightTimestamp(0), sequenceNumber(0) {}
+};
+
+/**
+ * A read-only handle to a pooled stereo pair. The pair is never changed while any handle to it is held.
+ */
+typedef std::shared_ptr<const StereoFramePair> StereoFrameHandle;
+
+class StereoFramePool
+{
+    // The pool keeps one handle to every buffer, so a buffer is free when that is the only one left. Copying a handle doesn't
+    // allocate, so neither does acquire().
+    std::vector<std::shared_ptr<StereoFramePair> > buffers;
+    size_t nextBuffer; // Where acquire() starts looking, so buffers are reused in turn.
+
+    StereoFramePool(const StereoFramePool&);
+    StereoFramePool& operator=(const StereoFramePool&);
+public:
+    /**
+     * Constructor for the StereoFramePool.
+     * @param count     The number of stereo pairs in the pool.
+     * @param frameSize The size of the frames, to allocate them up front. If empty, each buffer is allocated the first
+     *                  time it is filled and reused after that.
+     * @param type      The type of the frames, used with frameSize.
+     */
+    inline StereoFramePool(unsigned count = 8, cv::Size frameSize = cv::Size(), int type = CV_8UC3);
+    /**
+     * Take a free buffer to fill. The buffer may hold an old pair, whose storage is reused when it is overwritten.
+     * Only one thread may acquire buffers from a pool.
+     * @return a handle to the buffer, or null if every buffer is in use.
+     */
+    inline std::shared_ptr<StereoFramePair> acquire();
+    /**
+     * The number of buffers not in use. Only a hint while other threads are releasing handles.
+     */
+    inline unsigned available();
+    /**
+     * The number of buffers in the pool.
+     */
+    inline unsigned size();
+};
+
+inline StereoFramePool::StereoFramePool(unsigned count, cv::Size frameSize, int type): nextBuffer(0) {
+    for(unsigned i = 0; i < count; i++) {
+        std::shared_ptr<StereoFramePair> buffer = std::make_shared<StereoFramePair>();
+        if(frameSize.area() > 0) {
+            buffer->left.create(frameSize, type);
+            buffer->right.create(frameSize, type);
+        }
+        buffers.push_back(buffer);
+    }
+}
+
+inline std::shared_ptr<StereoFramePair> StereoFramePool::acquire() {
+    for(size_t i = 0; i < buffers.size(); i++) {
+        size_t index = (nextBuffer + i) % buffers.size();
+        // Only the acquiring thread copies the pool's handles, so once the count is down to ours nobody can raise it again.
+        if(buffers[index].use_count() == 1) {
+            std::atomic_thread_fence(std::memory_order_acquire); // See everything the last holder did before letting go.
+            nextBuffer = index + 1;
+            return buffers[index];
+        }
+    }
+    return std::shared_ptr<StereoFramePair>();
+}
+
+inline unsigned StereoFramePool::available() {
+    unsigned free = 0;
+    for(size_t i = 0; i < buffers.size(); i++)
+        if(buffers[i].use_count() == 1)
+            free++;
+    return free;
+}
+
+inline unsigned StereoFramePool::size() {
+    return (unsigned)buffers.size();
+}
+
+#endif
@@ -13,9 +13,14 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <cstdlib>
+#include <cmath>
+#include <algorithm>
 #include <vector>
 #include <string>
-#include "CoreFoundation/CoreFoundation.h"
+#include <unistd.h>
+#include "ResourceLocator.hpp"
+#include "RectificationCache.hpp"
+#include "Trace.hpp"
 using namespace cv;
 
 class FileNotOpenedException: public std::exception
@@ -26,6 +31,33 @@ class FileNotOpenedException: public std::exception
   }
 };
 
+/**
+ * A batch of matching points from the rectified left and right images, stored as one array per coordinate so that
+ * triangulateRectifiedPoints can run over them in a single tight loop.
+ */
+struct RectifiedPointBatch
+{
+    std::vector<double> leftX, leftY, rightX, rightY;
+    inline void clear() { leftX.clear(); leftY.clear(); rightX.clear(); rightY.clear(); }
+    inline size_t size() const { return leftX.size(); }
+    inline void push_back(Point2d leftPoint, Point2d rightPoint) {
+        leftX.push_back(leftPoint.x);
+        leftY.push_back(leftPoint.y);
+        rightX.push_back(rightPoint.x);
+        rightY.push_back(rightPoint.y);
+    }
+};
+
+/**
+ * A batch of 3D points, one array per coordinate.
+ */
+struct PointBatch3d
+{
+    std::vector<double> x, y, z;
+    inline size_t size() const { return x.size(); }
+    inline Point3d at(size_t i) const { return Point3d(x[i], y[i], z[i]); }
+};
+
 class StereoMatcher
 {
 	Mat M1, D1, M2, D2, R, T, R1, R2; // The calibration matrices
@@ -35,7 +67,47 @@ class StereoMatcher
 	StereoSGBM sgbm; //SGBM algorithm object.
     cv::Size imageSize; // The size of the input images.
 	int numberOfDisparities; // number of disparity levels to compute.
+	int sgbmChannels; // The number of image channels the sgbm parameters were set up for.
+	Mat leftRegion, rightRegion, regionDisparity; // Buffers for MatchRegion.
+	Mat regionPointCloud, regionDisparityMap, regionMask; // Buffers for localiseRegion.
+	std::vector<Point3f> regionSamples;
+	std::vector<float> sampleValues;
 	FileNotOpenedException fileNotOpenedException;
+	RectificationCache rectificationCache; // Holds the mapped cache file the matrices above may point into.
+
+	/**
+	 * Find a calibration file. The path is used as given if the file exists there, otherwise the file is looked up by name
+	 * and extension with the resource locator.
+	 * @param  fileName  The path to the calibration file, e.g. Resources/intrinsic.yml
+	 * @param  resources The locator to look the file up with.
+	 * @return           A path the file can be opened from. Throws FileNotOpenedException if it can't be found.
+	 */
+	inline std::string locateCalibrationFile(const std::string &fileName, ResourceLocator *resources);
+	/**
+	 * The calibration and rectification matrices in the order they are kept in the rectification cache.
+	 * @param matrices reference to a vector where pointers to the member matrices will be stored.
+	 */
+	inline void cachedMatrices(std::vector<Mat*> &matrices);
+	/**
+	 * Tells us if matrices loaded from the rectification cache are what the matcher needs: the matrices of cachedMatrices,
+	 * followed by the two regions of interest. The calibration matrices must be the ones just read from the calibration
+	 * files, the rectification transforms and projections the sizes stereoRectify makes and the maps of the image size and type.
+	 */
+	inline bool cachedMatricesAreValid(const std::vector<Mat> &cached);
+	/**
+	 * Set up the SGBM parameters for images with the given number of channels. Only needs doing when that changes.
+	 * @param channels The number of channels in the images to be matched.
+	 */
+	inline void configureSgbm(int channels);
+	/**
+	 * Work out the disparity search range that covers a band of depths around an expected depth.
+	 * @param expectedDepth  The depth to search around, in the units and sign convention of the calibration. 0 searches the full range.
+	 * @param depthTolerance The fraction of the expected depth to search either side of it.
+	 * @param minDisparity   reference to where the smallest disparity to search will be stored. Negative when the calibration
+	 *                       puts the second camera to the right of the first.
+	 * @param disparities    reference to where the number of disparities to search (a multiple of 16) will be stored.
+	 */
+	inline void disparityRangeForDepth(double expectedDepth, double depthTolerance, int &minDisparity, int &disparities);
 public:
 	/**
 	 * Constructor to initialize the StereoMatcher object with the camera parameters and the scale factor
@@ -48,8 +120,15 @@ public:
 	 * to a row in the other.
 	 *
 	 * Calibration is done with the opencv stereo calibration sample program.
+	 *
+	 * The rectification maps are cached on disk (see RectificationCache), so only the first run with a given calibration
+	 * and image size has to compute them.
+	 * @param cacheDirectory The directory to keep the rectification cache in. Empty uses the temporary directory.
+	 * @param resources      The locator used to find calibration files that are not at the given paths. If null,
+	 *                       defaultResourceLocator() is used.
 	 */
-	inline StereoMatcher(std::string intrinsicParameterFileName, std::string extrinsicParameterFileName, cv::Size imageS);
+	inline StereoMatcher(std::string intrinsicParameterFileName, std::string extrinsicParameterFileName, cv::Size imageS, std::string cacheDirectory = "",
+	                     ResourceLocator *resources = 0);
 	/**
 	 * A method to perform the match
 	 * @param left       The left camera's image
@@ -58,12 +137,67 @@ public:
 	 * @param disparityMap The output disparity map from the algorithm.
 	 */
 	inline void Match(Mat left, Mat right, Mat &pointCloud, Mat &disparityMap);
+	/**
+	 * Perform the match over a region of interest only, e.g. the face found by the MouthPointFinder plus a margin.
+	 * Only the region (and the strip to its left that the disparity search needs) is rectified and matched, and the
+	 * disparity search is limited to the depths around expectedDepth.
+	 * @param left           The left camera's raw (unrectified) image
+	 * @param right          The right camera's raw (unrectified) image
+	 * @param region         The region of interest, in rectified image coordinates.
+	 * @param expectedDepth  The depth the region is expected to be at, e.g. the last triangulated mouth depth. 0 searches the full range.
+	 * @param pointCloud     A reference to the point cloud (CV_32FC3, the size of region) in which to store the output.
+	 *                       Points are in the same coordinates as a full frame Match; unmatched pixels have a Z of 10000.
+	 * @param disparityMap   The output disparity map (CV_32F, the size of region) in pixels.
+	 * @param depthTolerance The fraction of expectedDepth to search either side of it.
+	 * @param imagesAreRectified true if left and right have already been through rectifyImages.
+	 */
+	inline void MatchRegion(const Mat &left, const Mat &right, cv::Rect region, double expectedDepth, Mat &pointCloud, Mat &disparityMap,
+	                        double depthTolerance = 0.25, bool imagesAreRectified = false);
+	/**
+	 * Find the 3D position of a region of the left image (e.g. the mouth hull) from the dense disparity around it, rather than
+	 * from a single matched point. The region plus a margin is matched with MatchRegion, the point cloud is sampled inside the
+	 * polygon and the median of the samples close to the median depth is returned.
+	 * @param  left               The left camera's image
+	 * @param  right              The right camera's image
+	 * @param  polygon            The convex polygon to sample inside, in rectified left image coordinates.
+	 * @param  expectedDepth      The depth the region is expected to be at. 0 searches the full disparity range.
+	 * @param  imagesAreRectified true if left and right have already been through rectifyImages.
+	 * @param  ThreeDPoint        The estimated position of the region.
+	 * @param  confidence         How much to trust the estimate, from 0 to 1: the fraction of the polygon with a valid disparity
+	 *                            multiplied by the fraction of those that agree with the median depth.
+	 * @return                    true if any part of the polygon had a valid disparity, false otherwise.
+	 */
+	inline bool localiseRegion(const Mat &left, const Mat &right, const std::vector<Point2f> &polygon, double expectedDepth,
+	                           bool imagesAreRectified, Point3d &ThreeDPoint, double &confidence);
 	/**
 	 * A mthod to rectify two images from the stereo Camera.
 	 * @param left  [description]
 	 * @param right [description]
 	 */
 	inline void rectifyImages(Mat &left, Mat &right);
+	/**
+	 * Rectify two images from the stereo camera into separate output images, leaving the input images untouched.
+	 * @param left           The left camera's image
+	 * @param right          The right camera's image
+	 * @param leftRectified  The Mat in which to store the rectified left image.
+	 * @param rightRectified The Mat in which to store the rectified right image.
+	 */
+	inline void rectifyImages(const Mat &left, const Mat &right, Mat &leftRectified, Mat &rightRectified);
+	/**
+	 * Undistort and rectify a single point from each raw (unrectified) image, so that it can be triangulated without remapping
+	 * the whole frames. The output points are in the same coordinates as points found in images passed through rectifyImages.
+	 * @param leftImagePoint  The point from the raw left image.
+	 * @param rightImagePoint The point from the raw right image.
+	 * @param leftRectified   The point in the rectified left image.
+	 * @param rightRectified  The point in the rectified right image.
+	 */
+	inline void rectifyPoints(Point2d leftImagePoint, Point2d rightImagePoint, Point2d &leftRectified, Point2d &rightRectified);
+	/**
+	 * Undistort and rectify points from the raw left image.
+	 * @param leftImagePoints The points from the raw left image.
+	 * @param leftRectified   The points in the rectified left image.
+	 */
+	inline void rectifyLeftPoints(const std::vector<Point2f> &leftImagePoints, std::vector<Point2f> &leftRectified);
 	/**
 	 * Take a point from each image (the same feature) and use traingulation to find a point in 3d space.
 	 * @param leftImagePoint  The point from the left image
@@ -71,20 +205,29 @@ public:
 	 * @param ThreeDPoint     The point reprojected in 3 dimensions.
 	 */
 	inline void triangulateSinglePoint(Point2d leftImagePoint, Point2d rightImagePoint, Point3d &ThreeDPoint);
+	/**
+	 * Triangulate a batch of matching points from the rectified images in one call, e.g. several mouth landmarks or a window of
+	 * frames. Because the images are rectified, each point is just its disparity pushed through Q, so no linear system is
+	 * solved and nothing is allocated once the output has grown to the batch size.
+	 * Points with no disparity come out at infinity.
+	 * @param points      The matching points, in rectified image coordinates. The y of a pair is taken as the mean of the two.
+	 * @param ThreeDPoints The points reprojected in 3 dimensions, in the same coordinates as triangulateSinglePoint.
+	 */
+	inline void triangulateRectifiedPoints(const RectifiedPointBatch &points, PointBatch3d &ThreeDPoints);
 	~StereoMatcher();
 };
 
-inline StereoMatcher::StereoMatcher(std::string intrinsicParameterFileName, std::string extrinsicParameterFileName, cv::Size imageS) {
+inline StereoMatcher::StereoMatcher(std::string intrinsicParameterFileName, std::string extrinsicParameterFileName, cv::Size imageS, std::string cacheDirectory,
+                                    ResourceLocator *resources): rectificationCache(cacheDirectory) {
 	imageSize = imageS;
+    numberOfDisparities = 256;
+    sgbmChannels = 0;
     
-    // Look for a resource in the main bundle by name and type.
+    if(!resources)
+        resources = defaultResourceLocator();
+    std::string path1 = locateCalibrationFile(intrinsicParameterFileName, resources);
+    std::string path2 = locateCalibrationFile(extrinsicParameterFileName, resources);
     
-	CFBundleRef mainBundle = CFBundleGetMainBundle();
-    CFURLRef fileURL1 = CFBundleCopyResourceURL( mainBundle, CFSTR("intrinsic"), CFSTR("yml"), NULL );
-    char path1[512];
-    if (!CFURLGetFileSystemRepresentation(fileURL1, TRUE, (UInt8 *)path1, 512))
-        throw fileNotOpenedException;
-
     FileStorage fs(path1, CV_STORAGE_READ);
     
 	if(!fs.isOpened())
@@ -94,55 +237,320 @@ inline StereoMatcher::StereoMatcher(std::string intrinsicParameterFileName, std:
     fs["M2"] >> this->M2;
     fs["D2"] >> this->D2;
 
-    CFURLRef fileURL2 = CFBundleCopyResourceURL( mainBundle, CFSTR("extrinsic"), CFSTR("yml"), NULL );
-    char path2[512];
-    if (!CFURLGetFileSystemRepresentation(fileURL2, TRUE, (UInt8 *)path2, 512))
-        throw fileNotOpenedException;
-    
     fs.open(path2, CV_STORAGE_READ);
     if(!fs.isOpened())
     	throw fileNotOpenedException;
     fs["R"] >> this->R;
     fs["T"] >> this->T;
 
+    // Use the cached maps if this calibration and image size have been seen before.
+    uint64_t cacheKey = 0;
+    bool haveCacheKey = RectificationCache::calibrationKey(path1, path2, imageSize, cacheKey);
+    std::vector<Mat*> matrices;
+    cachedMatrices(matrices);
+    std::vector<Mat> cached;
+    if(haveCacheKey && rectificationCache.load(cacheKey, cached) && cachedMatricesAreValid(cached)) {
+        for(size_t i = 0; i < matrices.size(); i++)
+            *matrices[i] = cached[i];
+        const Mat &rois = cached[matrices.size()];
+        roi1 = cv::Rect(rois.at<int>(0), rois.at<int>(1), rois.at<int>(2), rois.at<int>(3));
+        roi2 = cv::Rect(rois.at<int>(4), rois.at<int>(5), rois.at<int>(6), rois.at<int>(7));
+        return;
+    }
+
     stereoRectify( M1, D1, M2, D2, imageSize, R, T, R1, R2, P1, P2, Q, CALIB_ZERO_DISPARITY, -1, imageSize, &roi1, &roi2 );
     initUndistortRectifyMap(M1, D1, R1, P1, imageSize, CV_16SC2, map11, map12);
     initUndistortRectifyMap(M2, D2, R2, P2, imageSize, CV_16SC2, map21, map22);
-    numberOfDisparities = 256;
 
+    if(haveCacheKey) {
+        cached.clear();
+        for(size_t i = 0; i < matrices.size(); i++)
+            cached.push_back(*matrices[i]);
+        Mat rois(1, 8, CV_32S);
+        int roiValues[8] = {roi1.x, roi1.y, roi1.width, roi1.height, roi2.x, roi2.y, roi2.width, roi2.height};
+        for(int i = 0; i < 8; i++)
+            rois.at<int>(i) = roiValues[i];
+        cached.push_back(rois);
+        rectificationCache.store(cacheKey, cached);
+    }
+}
+
+inline std::string StereoMatcher::locateCalibrationFile(const std::string &fileName, ResourceLocator *resources) {
+    if(access(fileName.c_str(), R_OK) == 0)
+        return fileName;
+    size_t nameStart = fileName.find_last_of('/') == std::string::npos ? 0 : fileName.find_last_of('/') + 1;
+    size_t extensionStart = fileName.find_last_of('.');
+    if(extensionStart == std::string::npos || extensionStart < nameStart)
+        throw fileNotOpenedException;
+    std::string path = resources->locate(fileName.substr(nameStart, extensionStart - nameStart), fileName.substr(extensionStart + 1));
+    if(path.empty())
+        throw fileNotOpenedException;
+    return path;
+}
+
+inline void StereoMatcher::cachedMatrices(std::vector<Mat*> &matrices) {
+    Mat *members[] = {&M1, &D1, &M2, &D2, &R, &T, &R1, &R2, &P1, &P2, &Q, &map11, &map12, &map21, &map22};
+    matrices.assign(members, members + sizeof(members)/sizeof(members[0]));
+}
+
+inline bool StereoMatcher::cachedMatricesAreValid(const std::vector<Mat> &cached) {
+    const size_t mapCount = 4, calibrationCount = 11; // The maps come last in cachedMatrices
+    if(cached.size() != calibrationCount + mapCount + 1)
+        return false;
+    // M1, D1, M2, D2, R and T come straight from the calibration files, which have just been read.
+    const Mat *calibration[] = {&M1, &D1, &M2, &D2, &R, &T};
+    for(size_t i = 0; i < sizeof(calibration)/sizeof(calibration[0]); i++) {
+        const Mat &read = *calibration[i];
+        if(cached[i].size() != read.size() || cached[i].type() != read.type() || read.empty() || norm(cached[i], read, NORM_INF) != 0)
+            return false;
+    }
+    // R1, R2, P1, P2 and Q, as stereoRectify makes them
+    cv::Size derivedSizes[] = {cv::Size(3, 3), cv::Size(3, 3), cv::Size(4, 3), cv::Size(4, 3), cv::Size(4, 4)};
+    for(size_t i = 0; i < 5; i++) {
+        const Mat &derived = cached[6 + i];
+        if(derived.size() != derivedSizes[i] || derived.type() != CV_64FC1)
+            return false;
+    }
+    int mapTypes[mapCount] = {CV_16SC2, CV_16UC1, CV_16SC2, CV_16UC1};
+    for(size_t i = 0; i < mapCount; i++) {
+        const Mat &map = cached[calibrationCount + i];
+        if(map.rows != imageSize.height || map.cols != imageSize.width || map.type() != mapTypes[i])
+            return false;
+    }
+    const Mat &rois = cached[calibrationCount + mapCount];
+    return rois.total() == 8 && rois.type() == CV_32SC1;
 }
 
 inline void StereoMatcher::Match(Mat left, Mat right, Mat &pointCloud, Mat &disparityMap) {
+    TRACE_SCOPE("Match");
 	Mat leftRectified, rightRectified;
 	remap(left, leftRectified, map11, map12, INTER_LINEAR);
     remap(right, rightRectified, map21, map22, INTER_LINEAR);
     if(numberOfDisparities == 0)
     	numberOfDisparities = ((leftRectified.size().width/8) + 15) & -16;
-    int cn = leftRectified.channels();
+    if(leftRectified.channels() != sgbmChannels)
+        configureSgbm(leftRectified.channels());
+    int minDisparity, disparities;
+    disparityRangeForDepth(0, 0, minDisparity, disparities);
+    sgbm.minDisparity = minDisparity;
+    sgbm.numberOfDisparities = numberOfDisparities;
+    Mat disp;
+    sgbm(leftRectified, rightRectified, disp);
+    disp.convertTo(disparityMap, CV_8U, 255/(numberOfDisparities*16.));
+    disparityMap = disp;
+    reprojectImageTo3D(disparityMap, pointCloud, Q, false);
+}
+
+inline void StereoMatcher::MatchRegion(const Mat &left, const Mat &right, cv::Rect region, double expectedDepth, Mat &pointCloud, Mat &disparityMap,
+                                       double depthTolerance, bool imagesAreRectified) {
+    TRACE_SCOPE("MatchRegion");
+    int minDisparity, disparities;
+    disparityRangeForDepth(expectedDepth, depthTolerance, minDisparity, disparities);
+    region &= cv::Rect(0, 0, imageSize.width, imageSize.height);
+    if(region.width <= 0 || region.height <= 0) {
+        pointCloud.release();
+        disparityMap.release();
+        return;
+    }
+    
+    // SGBM can't find disparities for the first minDisparity + disparities columns, or (when minDisparity is negative) for the
+    // last -minDisparity, so match strips that wide either side of the region as well. Both views are cropped the same way
+    // so the disparities are unchanged.
+    int searchStart = std::max(0, region.x - std::max(0, minDisparity + disparities));
+    int searchEnd = std::min(imageSize.width, region.x + region.width + std::max(0, -minDisparity));
+    cv::Rect searchRegion(searchStart, region.y, searchEnd - searchStart, region.height);
+    if(imagesAreRectified) {
+        leftRegion = left(searchRegion);
+        rightRegion = right(searchRegion);
+    } else {
+        remap(left, leftRegion, map11(searchRegion), map12(searchRegion), INTER_LINEAR);
+        remap(right, rightRegion, map21(searchRegion), map22(searchRegion), INTER_LINEAR);
+    }
+    
+    if(leftRegion.channels() != sgbmChannels)
+        configureSgbm(leftRegion.channels());
+    sgbm.minDisparity = minDisparity;
+    sgbm.numberOfDisparities = disparities;
+    sgbm(leftRegion, rightRegion, regionDisparity);
+    regionDisparity(cv::Rect(region.x - searchStart, 0, region.width, region.height)).convertTo(disparityMap, CV_32F, 1/16.);
+    
+    // Shift Q so that pixel (0, 0) of the region reprojects as pixel (region.x, region.y) of the full image.
+    Mat regionQ = Q.clone();
+    for(int row = 0; row < 4; row++)
+        regionQ.at<double>(row, 3) += region.x*Q.at<double>(row, 0) + region.y*Q.at<double>(row, 1);
+    reprojectImageTo3D(disparityMap, pointCloud, regionQ, true);
+}
+
+inline bool StereoMatcher::localiseRegion(const Mat &left, const Mat &right, const std::vector<Point2f> &polygon, double expectedDepth,
+                                          bool imagesAreRectified, Point3d &ThreeDPoint, double &confidence) {
+    TRACE_SCOPE("localiseRegion");
+    confidence = 0;
+    if(polygon.size() < 3)
+        return false;
+    std::vector<cv::Point> vertices;
+    for(size_t i = 0; i < polygon.size(); i++)
+        vertices.push_back(cv::Point(cvRound(polygon[i].x), cvRound(polygon[i].y)));
+    
+    // Match the polygon's bounding box plus half its size on each side, so SGBM has some texture around the mouth to work with.
+    cv::Rect bounds = boundingRect(vertices);
+    cv::Rect region(bounds.x - bounds.width/2, bounds.y - bounds.height/2, bounds.width*2, bounds.height*2);
+    region &= cv::Rect(0, 0, imageSize.width, imageSize.height);
+    MatchRegion(left, right, region, expectedDepth, regionPointCloud, regionDisparityMap, 0.25, imagesAreRectified);
+    if(regionPointCloud.empty())
+        return false;
+    
+    regionMask.create(region.height, region.width, CV_8U);
+    regionMask.setTo(Scalar(0));
+    for(size_t i = 0; i < vertices.size(); i++)
+        vertices[i] -= region.tl();
+    fillConvexPoly(regionMask, vertices, Scalar(255));
+    
+    // Collect the points inside the polygon that have a valid disparity.
+    regionSamples.clear();
+    int polygonArea = 0;
+    for(int row = 0; row < region.height; row++) {
+        const uchar *mask = regionMask.ptr<uchar>(row);
+        const Vec3f *points = regionPointCloud.ptr<Vec3f>(row);
+        for(int col = 0; col < region.width; col++) {
+            if(!mask[col])
+                continue;
+            polygonArea++;
+            const Vec3f &point = points[col];
+            if(point[2] < 10000 && point[2] == point[2]) // reprojectImageTo3D sets Z to 10000 where there is no disparity
+                regionSamples.push_back(Point3f(point[0], point[1], point[2]));
+        }
+    }
+    if(regionSamples.empty())
+        return false;
+    
+    // Keep the samples within 5% of the median depth and report the median of each coordinate of those.
+    sampleValues.resize(regionSamples.size());
+    for(size_t i = 0; i < regionSamples.size(); i++)
+        sampleValues[i] = regionSamples[i].z;
+    std::nth_element(sampleValues.begin(), sampleValues.begin() + sampleValues.size()/2, sampleValues.end());
+    float medianDepth = sampleValues[sampleValues.size()/2];
+    float tolerance = fabs(medianDepth)*0.05f;
+    size_t inliers = 0;
+    for(size_t i = 0; i < regionSamples.size(); i++) {
+        if(fabs(regionSamples[i].z - medianDepth) <= tolerance)
+            regionSamples[inliers++] = regionSamples[i];
+    }
+    regionSamples.resize(inliers);
+    double medians[3];
+    for(int axis = 0; axis < 3; axis++) {
+        for(size_t i = 0; i < inliers; i++)
+            sampleValues[i] = axis == 0 ? regionSamples[i].x : axis == 1 ? regionSamples[i].y : regionSamples[i].z;
+        std::nth_element(sampleValues.begin(), sampleValues.begin() + inliers/2, sampleValues.begin() + inliers);
+        medians[axis] = sampleValues[inliers/2];
+    }
+    ThreeDPoint = Point3d(medians[0], medians[1], medians[2]);
+    // (valid / polygonArea) * (inliers / valid)
+    confidence = (double)inliers/polygonArea;
+    return true;
+}
+
+inline void StereoMatcher::configureSgbm(int channels) {
+    int cn = channels;
     sgbm.preFilterCap = 0;
     sgbm.SADWindowSize = 3;
     sgbm.P1 = 8*cn*sgbm.SADWindowSize*sgbm.SADWindowSize;
     sgbm.P2 = 32*cn*sgbm.SADWindowSize*sgbm.SADWindowSize;
-    sgbm.minDisparity = 0;
-    sgbm.numberOfDisparities = numberOfDisparities;
     sgbm.uniquenessRatio = 5;
     sgbm.speckleWindowSize = 0;
     sgbm.speckleRange = 1;
     sgbm.disp12MaxDiff = 600;
     sgbm.fullDP = false;
-    Mat disp;
-    sgbm(leftRectified, rightRectified, disp);
-    disp.convertTo(disparityMap, CV_8U, 255/(numberOfDisparities*16.));
-    disparityMap = disp;
-    reprojectImageTo3D(disparityMap, pointCloud, Q, false);
+    sgbmChannels = channels;
+}
+
+inline void StereoMatcher::disparityRangeForDepth(double expectedDepth, double depthTolerance, int &minDisparity, int &disparities) {
+    disparities = numberOfDisparities > 0 ? numberOfDisparities : 256;
+    // Q maps (x, y, d, 1) to (X, Y, Z, W) with W = d*Q(3,2) + Q(3,3) and Z/W = Q(2,3), so d = (Q(2,3)/depth - Q(3,3))/Q(3,2).
+    double focalLength = Q.at<double>(2, 3);
+    double inverseBaseline = Q.at<double>(3, 2);
+    double principalOffset = Q.at<double>(3, 3);
+    // When the second camera is to the right of the first, points in front of the cameras have negative disparities.
+    bool disparitiesAreNegative = inverseBaseline != 0 && focalLength/inverseBaseline < 0;
+    minDisparity = disparitiesAreNegative ? -disparities : 0;
+    if(expectedDepth == 0 || inverseBaseline == 0)
+        return;
+    double nearDisparity = (focalLength/(expectedDepth*(1 - depthTolerance)) - principalOffset)/inverseBaseline;
+    double farDisparity = (focalLength/(expectedDepth*(1 + depthTolerance)) - principalOffset)/inverseBaseline;
+    double lowest = std::min(nearDisparity, farDisparity);
+    double highest = std::max(nearDisparity, farDisparity);
+    if(disparitiesAreNegative ? lowest >= 0 : highest <= 0)
+        return;
+    if(disparitiesAreNegative)
+        highest = std::min(highest, 0.0);
+    else
+        lowest = std::max(lowest, 0.0);
+    minDisparity = (int)floor(lowest);
+    disparities = (((int)ceil(highest) - minDisparity + 1) + 15) & -16;
 }
 
 inline void StereoMatcher::rectifyImages(Mat &left, Mat &right) {
+    TRACE_SCOPE("rectifyImages");
 	remap(left, left, map11, map12, INTER_LINEAR);
     remap(right, right, map21, map22, INTER_LINEAR);
 }
 
+inline void StereoMatcher::rectifyImages(const Mat &left, const Mat &right, Mat &leftRectified, Mat &rightRectified) {
+    TRACE_SCOPE("rectifyImages");
+	remap(left, leftRectified, map11, map12, INTER_LINEAR);
+    remap(right, rightRectified, map21, map22, INTER_LINEAR);
+}
+
+inline void StereoMatcher::rectifyPoints(Point2d leftImagePoint, Point2d rightImagePoint, Point2d &leftRectified, Point2d &rightRectified) {
+    TRACE_SCOPE("rectifyPoints");
+    std::vector<Point2d> leftPoints(1, leftImagePoint), rightPoints(1, rightImagePoint);
+    undistortPoints(leftPoints, leftPoints, M1, D1, R1, P1);
+    undistortPoints(rightPoints, rightPoints, M2, D2, R2, P2);
+    leftRectified = leftPoints[0];
+    rightRectified = rightPoints[0];
+}
+
+inline void StereoMatcher::rectifyLeftPoints(const std::vector<Point2f> &leftImagePoints, std::vector<Point2f> &leftRectified) {
+    if(leftImagePoints.empty()) {
+        leftRectified.clear();
+        return;
+    }
+    undistortPoints(leftImagePoints, leftRectified, M1, D1, R1, P1);
+}
+
+inline void StereoMatcher::triangulateRectifiedPoints(const RectifiedPointBatch &points, PointBatch3d &ThreeDPoints) {
+    TRACE_SCOPE("triangulateRectifiedPoints");
+    size_t count = points.size();
+    ThreeDPoints.x.resize(count);
+    ThreeDPoints.y.resize(count);
+    ThreeDPoints.z.resize(count);
+    if(count == 0)
+        return;
+    
+    // [X Y Z W] = Q [x y d 1], with d = leftX - rightX
+    double q[4][4];
+    for(int row = 0; row < 4; row++)
+        for(int col = 0; col < 4; col++)
+            q[row][col] = Q.at<double>(row, col);
+    const double *leftX = &points.leftX[0];
+    const double *leftY = &points.leftY[0];
+    const double *rightX = &points.rightX[0];
+    const double *rightY = &points.rightY[0];
+    double *outX = &ThreeDPoints.x[0];
+    double *outY = &ThreeDPoints.y[0];
+    double *outZ = &ThreeDPoints.z[0];
+    for(size_t i = 0; i < count; i++) {
+        double x = leftX[i];
+        double y = 0.5*(leftY[i] + rightY[i]);
+        double d = leftX[i] - rightX[i];
+        double inverseW = 1.0/(q[3][0]*x + q[3][1]*y + q[3][2]*d + q[3][3]);
+        outX[i] = (q[0][0]*x + q[0][1]*y + q[0][2]*d + q[0][3])*inverseW;
+        outY[i] = (q[1][0]*x + q[1][1]*y + q[1][2]*d + q[1][3])*inverseW;
+        outZ[i] = (q[2][0]*x + q[2][1]*y + q[2][2]*d + q[2][3])*inverseW;
+    }
+}
+
 inline void StereoMatcher::triangulateSinglePoint(Point2d leftImagePoint, Point2d rightImagePoint, Point3d &ThreeDPoint) {
+    TRACE_SCOPE("triangulateSinglePoint");
 
 	Mat outputArray(1,1,CV_64FC4);
 	std::vector<Point2d> leftPoints;
@@ -0,0 +1,178 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The StereoMouthDetector class describes an object that finds the mouth centre in both views of a stereo pair.
+ * Each view has its own MouthPointFinder (and so its own cascade classifiers, which are not safe to share between threads).
+ * In parallel mode the right view is handed to a persistent worker thread while the left view is processed on the
+ * caller's thread, so the two Haar cascade passes overlap instead of running back to back.
+ */
+#ifndef STEREO_MOUTH_DETECTOR_HPP
+#define STEREO_MOUTH_DETECTOR_HPP
+
+#include <opencv2/opencv.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "MouthPointFinder.hpp"
+using namespace cv;
+
+class StereoMouthDetector
+{
+    MouthPointFinder *leftFinder;
+    MouthPointFinder *rightFinder;
+    bool runInParallel;
+
+    // Right view worker. A job is posted by setting rightJobFrame and jobPending under jobMutex.
+    std::thread rightWorker;
+    std::mutex jobMutex;
+    std::condition_variable jobPosted;
+    std::condition_variable jobFinished;
+    bool jobPending;
+    bool workerShouldQuit;
+    Mat *rightJobFrame;
+    Point2d rightJobCentre;
+    bool rightJobIsOpen;
+    bool rightJobFound;
+
+    inline void runRightWorker();
+public:
+    /**
+     * Constructor for the StereoMouthDetector.
+     * @param parallel  true to detect in both views at the same time, false to detect one after the other.
+     * @param resources The locator used to find the cascade files. If null, defaultResourceLocator() is used.
+     */
+    inline StereoMouthDetector(bool parallel = true, ResourceLocator *resources = 0);
+    /**
+     * Destructor for the StereoMouthDetector. Stops the worker thread.
+     */
+    inline ~StereoMouthDetector();
+    /**
+     * Find the mouth centre in both frames. See MouthPointFinder::detectMouthCentre.
+     * In sequential mode the right frame is skipped if no mouth is found in the left frame.
+     * @param  leftFrame        reference to the left frame of interest
+     * @param  rightFrame       reference to the right frame of interest
+     * @param  leftMouthCentre  reference to a point where the left mouth centre will be stored
+     * @param  rightMouthCentre reference to a point where the right mouth centre will be stored
+     * @param  leftIsOpen       reference to a boolean that will be true if the mouth is open in the left frame
+     * @param  rightIsOpen      reference to a boolean that will be true if the mouth is open in the right frame
+     * @return                  true if a mouth was found in both frames, false otherwise
+     */
+    inline bool detectMouthCentres(Mat &leftFrame, Mat &rightFrame, Point2d &leftMouthCentre, Point2d &rightMouthCentre,
+                                   bool &leftIsOpen, bool &rightIsOpen);
+    /**
+     * Switch between parallel and sequential detection.
+     * @param parallel true to detect in both views at the same time.
+     */
+    inline void setParallel(bool parallel);
+    /**
+     * Turn face tracking on or off in both views. See MouthPointFinder::setTracking.
+     * @param enabled          true to search around the predicted face instead of the whole frame.
+     * @param fullSearchFrames Number of frames between full frame searches.
+     */
+    inline void setTracking(bool enabled, int fullSearchFrames = 15);
+    /**
+     * Set the resolution faces are searched for at in both views. See MouthPointFinder::setFaceDetectionScale.
+     * @param scale Fraction of the full resolution to detect faces at, in (0, 1].
+     */
+    inline void setFaceDetectionScale(double scale);
+    /**
+     * Get the mouth hull found in the left view by the last call to detectMouthCentres. See MouthPointFinder::getMouthHull.
+     * @param  hull reference to a vector where the hull points will be stored, in left frame coordinates.
+     * @return      true if a mouth was found in the left view, false otherwise.
+     */
+    inline bool getLeftMouthHull(std::vector<cv::Point> &hull);
+    /**
+     * Get the stage timings of the last call to detectMouthCentres in each view. See MouthPointFinder::getLastTimings.
+     * A view that was skipped (the right view in sequential mode when the left view failed) keeps its earlier timings.
+     * @param leftTimings  reference to where the left view timings will be stored.
+     * @param rightTimings reference to where the right view timings will be stored.
+     */
+    inline void getLastTimings(MouthDetectionTimings &leftTimings, MouthDetectionTimings &rightTimings);
+};
+
+inline StereoMouthDetector::StereoMouthDetector(bool parallel, ResourceLocator *resources): runInParallel(parallel), jobPending(false), workerShouldQuit(false),
+    rightJobFrame(0), rightJobIsOpen(false), rightJobFound(false) {
+    leftFinder = new MouthPointFinder(resources);
+    rightFinder = new MouthPointFinder(resources);
+    rightWorker = std::thread(&StereoMouthDetector::runRightWorker, this);
+}
+
+inline StereoMouthDetector::~StereoMouthDetector() {
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        workerShouldQuit = true;
+    }
+    jobPosted.notify_one();
+    rightWorker.join();
+    delete leftFinder;
+    delete rightFinder;
+}
+
+inline void StereoMouthDetector::setParallel(bool parallel) {
+    runInParallel = parallel;
+}
+
+inline void StereoMouthDetector::setTracking(bool enabled, int fullSearchFrames) {
+    leftFinder->setTracking(enabled, fullSearchFrames);
+    rightFinder->setTracking(enabled, fullSearchFrames);
+}
+
+inline void StereoMouthDetector::setFaceDetectionScale(double scale) {
+    leftFinder->setFaceDetectionScale(scale);
+    rightFinder->setFaceDetectionScale(scale);
+}
+
+inline bool StereoMouthDetector::getLeftMouthHull(std::vector<cv::Point> &hull) {
+    return leftFinder->getMouthHull(hull);
+}
+
+inline void StereoMouthDetector::getLastTimings(MouthDetectionTimings &leftTimings, MouthDetectionTimings &rightTimings) {
+    leftTimings = leftFinder->getLastTimings();
+    rightTimings = rightFinder->getLastTimings();
+}
+
+inline void StereoMouthDetector::runRightWorker() {
+    std::unique_lock<std::mutex> lock(jobMutex);
+    while(true) {
+        jobPosted.wait(lock, [this]{ return jobPending || workerShouldQuit; });
+        if(workerShouldQuit)
+            return;
+        Mat *frame = rightJobFrame;
+        lock.unlock();
+        Point2d centre;
+        bool isOpen = false;
+        bool found = rightFinder->detectMouthCentre(*frame, centre, isOpen);
+        lock.lock();
+        rightJobCentre = centre;
+        rightJobIsOpen = isOpen;
+        rightJobFound = found;
+        jobPending = false;
+        jobFinished.notify_one();
+    }
+}
+
+inline bool StereoMouthDetector::detectMouthCentres(Mat &leftFrame, Mat &rightFrame, Point2d &leftMouthCentre, Point2d &rightMouthCentre,
+                                                    bool &leftIsOpen, bool &rightIsOpen) {
+    if(!runInParallel) {
+        return leftFinder->detectMouthCentre(leftFrame, leftMouthCentre, leftIsOpen) &&
+               rightFinder->detectMouthCentre(rightFrame, rightMouthCentre, rightIsOpen);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        rightJobFrame = &rightFrame;
+        jobPending = true;
+    }
+    jobPosted.notify_one();
+
+    bool leftFound = leftFinder->detectMouthCentre(leftFrame, leftMouthCentre, leftIsOpen);
+
+    std::unique_lock<std::mutex> lock(jobMutex);
+    jobFinished.wait(lock, [this]{ return !jobPending; });
+    rightMouthCentre = rightJobCentre;
+    rightIsOpen = rightJobIsOpen;
+    return leftFound && rightJobFound;
+}
+
+#endif
@@ -0,0 +1,611 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Recording and replay of stereo sessions. A StereoRecorder writes timestamped frame pairs and the mouth positions found in
+ * them to a recording file; a StereoReplaySource feeds a recording back through the tracking pipeline in place of the cameras.
+ * Replaying the same recording always gives the pipeline the same input, which makes it the reference input for regression
+ * tests and benchmarks.
+ *
+ * A recording is a short file header ("IGFSSREC", format version) followed by chunks. Each chunk is a type and a payload
+ * length followed by the payload, so a reader can skip chunk types it does not know. Chunks are only ever appended, so
+ * recording into an existing file adds to it, and a recording cut short by a crash can still be read up to its last whole chunk.
+ *
+ * Frames chunk:    sequence (uint64), left timestamp, right timestamp (double), then the left and right images.
+ *                  Each image is rows, cols, type, encoding (int32) and a byte count (uint32) followed by the bytes.
+ * Detection chunk: sequence (uint64), found, open (int32), x, y, z, confidence (double), for the pair with that sequence.
+ *
+ * Numbers are stored in the byte order of the machine that wrote them (little endian on everything we run on).
+ */
+#ifndef STEREO_RECORDING_HPP
+#define STEREO_RECORDING_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <cstring>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "StereoFrameGrabber.hpp"
+#include "Trace.hpp"
+using namespace cv;
+
+/**
+ * How frames are stored in a recording.
+ */
+enum FrameEncoding {
+    RawFrames = 0, // Uncompressed pixels. Lossless and cheapest to write, but large.
+    PngFrames = 1, // PNG. Lossless, around half the size of raw frames.
+    JpegFrames = 2 // JPEG. Lossy and much smaller; detection on the replay will not exactly match the live session.
+};
+
+/**
+ * The mouth position found in a recorded pair.
+ */
+struct RecordedDetection
+{
+    unsigned long sequenceNumber;
+    bool found;
+    bool mouthIsOpen;
+    Point3d position;
+    double confidence;
+    RecordedDetection(): sequenceNumber(0), found(false), mouthIsOpen(false), position(0, 0, 0), confidence(0) {}
+};
+
+namespace StereoRecordingFormat
+{
+    static const char magic[8] = {'I', 'G', 'F', 'S', 'S', 'R', 'E', 'C'};
+    static const uint32_t version = 1;
+    enum ChunkType {
+        FramesChunk = 1,
+        DetectionChunk = 2
+    };
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+    };
+    struct ChunkHeader
+    {
+        uint32_t type;
+        uint32_t length; // Length of the payload that follows, in bytes.
+    };
+    struct FramesHeader
+    {
+        uint64_t sequenceNumber;
+        double leftTimestamp;
+        double rightTimestamp;
+    };
+    struct ImageHeader
+    {
+        int32_t rows;
+        int32_t cols;
+        int32_t type;
+        int32_t encoding;
+        uint32_t length;
+    };
+    struct DetectionRecord
+    {
+        uint64_t sequenceNumber;
+        int32_t found;
+        int32_t mouthIsOpen;
+        double x, y, z;
+        double confidence;
+    };
+}
+
+/**
+ * Writes a recording. Pairs are copied on the caller's thread and encoded and written on the recorder's own thread, so
+ * recording never holds up tracking. If the writer falls behind by more than a few pairs, new pairs are dropped (and
+ * counted) rather than letting the queue grow.
+ */
+class StereoRecorder
+{
+    struct QueuedChunk
+    {
+        StereoRecordingFormat::ChunkType type;
+        StereoFramePair pair;
+        RecordedDetection detection;
+    };
+
+    std::ofstream file;
+    FrameEncoding encoding;
+    int jpegQuality;
+    size_t maxQueuedPairs;
+    std::deque<QueuedChunk> queue;
+    size_t queuedPairs;
+    unsigned long pairsDropped;
+    bool writeFailed;
+    bool writerShouldQuit;
+    std::mutex queueMutex;
+    std::condition_variable chunkQueued;
+    std::thread writer;
+    std::vector<uchar> encodedImage, payload;
+
+    inline void runWriter();
+    inline void writeChunk(const QueuedChunk &chunk);
+    inline void appendImage(const Mat &image);
+    template<typename T> inline void append(const T &value);
+public:
+    /**
+     * Constructor for the StereoRecorder. Opens the file for appending and starts the writer thread.
+     * @param fileName       The recording to write. If it already exists, new chunks are added to its end.
+     * @param frameEncoding  How the frames are stored.
+     * @param maxQueued      The most pairs waiting to be written before new pairs are dropped.
+     * @param quality        JPEG quality from 0 to 100, for JpegFrames.
+     */
+    inline StereoRecorder(const std::string &fileName, FrameEncoding frameEncoding = PngFrames, size_t maxQueued = 8, int quality = 90);
+    /**
+     * Destructor for the StereoRecorder. Writes everything still queued and closes the file.
+     */
+    inline ~StereoRecorder();
+    /**
+     * Tells us if the file was opened and every write so far has succeeded.
+     * @return true if recording is working, otherwise false.
+     */
+    inline bool isOpen();
+    /**
+     * Queue a pair to be recorded. The frames are copied, so the caller may draw on them straight away.
+     * @param  pair The pair to record.
+     * @return      true if the pair was queued, false if it was dropped because the writer is behind.
+     */
+    inline bool recordPair(const StereoFramePair &pair);
+    /**
+     * Queue the result of looking for the mouth in a pair. Results are never dropped.
+     * @param detection The result, with the sequence number of its pair.
+     */
+    inline void recordDetection(const RecordedDetection &detection);
+    /**
+     * The number of pairs dropped because the writer was behind.
+     * @return the number of dropped pairs.
+     */
+    inline unsigned long droppedPairs();
+};
+
+/**
+ * Reads a recording one pair at a time, along with the recorded detection for each pair.
+ */
+class StereoRecordingReader
+{
+    static const uint32_t maxChunkLength = 256*1024*1024; // Anything longer is taken to be a corrupt chunk header.
+    std::ifstream file;
+    std::vector<uchar> payload;
+    bool haveLookahead; // True if the frames chunk after the current pair has already been read into lookahead.
+    StereoFramePair lookahead;
+
+    inline bool readChunk(StereoRecordingFormat::ChunkHeader &header);
+    inline bool decodeFrames(StereoFramePair &pair);
+    inline bool decodeImage(size_t &offset, Mat &image);
+public:
+    inline StereoRecordingReader();
+    /**
+     * Open a recording.
+     * @param  fileName The recording to read.
+     * @return          true if the file was opened and is a recording, false otherwise.
+     */
+    inline bool open(const std::string &fileName);
+    /**
+     * Go back to the first pair.
+     */
+    inline void rewind();
+    /**
+     * Read the next pair.
+     * @param  pair      reference to the pair in which to store the frames. Its buffers are reused where possible.
+     * @param  detection If not null, where the detection recorded for the pair is stored. detection->found is false and
+     *                   detection->sequenceNumber is 0 if none was recorded.
+     * @return           true if a pair was read, false at the end of the recording.
+     */
+    inline bool readNextPair(StereoFramePair &pair, RecordedDetection *detection = 0);
+};
+
+/**
+ * Feeds a recording to the tracking pipeline in place of the cameras. In the default mode every recorded pair is handed out
+ * exactly once, as fast as the pipeline takes them, so a replay is deterministic. In real time mode pairs are released at the
+ * rate they were recorded and the ones the pipeline is too slow for are skipped, as they would be with cameras; their
+ * timestamps are moved onto StereoFrameGrabber::now() so latencies can be measured against the replay.
+ */
+class StereoReplaySource: public StereoPairSource
+{
+    StereoRecordingReader reader;
+    bool opened;
+    bool realTime;
+    bool started;
+    double replayStart; // When start() was called, on StereoFrameGrabber::now().
+    double recordingStart; // Left timestamp of the first pair.
+    StereoFramePool framePool;
+    StereoFramePair pending; // Next pair to hand out. Its frames are moved into a pooled buffer when it is taken.
+    StereoFramePair due; // The pair about to be handed out in real time mode, kept so its storage is reused.
+    RecordedDetection pendingDetection;
+    bool havePending;
+    RecordedDetection lastDetection;
+
+    inline bool readPending();
+    inline bool handOut(StereoFramePair &pair, double offset, std::shared_ptr<StereoFramePair> &handle);
+public:
+    /**
+     * Constructor for the StereoReplaySource.
+     * @param fileName     The recording to replay.
+     * @param realTimeMode true to release pairs at the recorded rate, false to hand out every pair as fast as they are taken.
+     */
+    inline StereoReplaySource(const std::string &fileName, bool realTimeMode = false);
+    inline bool isOpened();
+    inline void start();
+    inline void stop();
+    inline bool takeLatestPair(std::shared_ptr<StereoFramePair> &pair);
+    inline bool hasStreamEnded();
+    /**
+     * The detection recorded with the last pair handed out by takeLatestPair, to compare against the replay.
+     * @param  detection reference to where the detection will be stored.
+     * @return           true if one was recorded for that pair, false otherwise.
+     */
+    inline bool getRecordedDetection(RecordedDetection &detection);
+};
+
+inline StereoRecorder::StereoRecorder(const std::string &fileName, FrameEncoding frameEncoding, size_t maxQueued, int quality):
+    encoding(frameEncoding), jpegQuality(quality), maxQueuedPairs(maxQueued), queuedPairs(0), pairsDropped(0), writeFailed(false),
+    writerShouldQuit(false) {
+    // Only a new or empty file gets a header; anything else must already be a recording, which we append to.
+    std::ifstream existing(fileName.c_str(), std::ios::in | std::ios::binary);
+    StereoRecordingFormat::FileHeader header;
+    bool isEmpty = !existing || existing.peek() == std::ifstream::traits_type::eof();
+    bool isRecording = !isEmpty && existing.read((char *)&header, sizeof(header)) &&
+                       memcmp(header.magic, StereoRecordingFormat::magic, 8) == 0 && header.version == StereoRecordingFormat::version;
+    existing.close();
+    if(!isEmpty && !isRecording) {
+        writeFailed = true;
+        return;
+    }
+    file.open(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+    if(!file) {
+        writeFailed = true;
+        return;
+    }
+    if(isEmpty) {
+        memcpy(header.magic, StereoRecordingFormat::magic, 8);
+        header.version = StereoRecordingFormat::version;
+        header.reserved = 0;
+        file.write((const char *)&header, sizeof(header));
+        file.flush();
+    }
+    writer = std::thread(&StereoRecorder::runWriter, this);
+}
+
+inline StereoRecorder::~StereoRecorder() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        writerShouldQuit = true;
+    }
+    chunkQueued.notify_one();
+    if(writer.joinable())
+        writer.join();
+}
+
+inline bool StereoRecorder::isOpen() {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return !writeFailed;
+}
+
+inline unsigned long StereoRecorder::droppedPairs() {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return pairsDropped;
+}
+
+inline bool StereoRecorder::recordPair(const StereoFramePair &pair) {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    if(writeFailed || queuedPairs >= maxQueuedPairs) {
+        pairsDropped++;
+        return false;
+    }
+    lock.unlock();
+    QueuedChunk chunk; // Copy outside the lock so the writer is not held up.
+    chunk.type = StereoRecordingFormat::FramesChunk;
+    pair.left.copyTo(chunk.pair.left);
+    pair.right.copyTo(chunk.pair.right);
+    chunk.pair.leftTimestamp = pair.leftTimestamp;
+    chunk.pair.rightTimestamp = pair.rightTimestamp;
+    chunk.pair.sequenceNumber = pair.sequenceNumber;
+    lock.lock();
+    queue.push_back(chunk);
+    queuedPairs++;
+    lock.unlock();
+    chunkQueued.notify_one();
+    return true;
+}
+
+inline void StereoRecorder::recordDetection(const RecordedDetection &detection) {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if(writeFailed)
+            return;
+        QueuedChunk chunk;
+        chunk.type = StereoRecordingFormat::DetectionChunk;
+        chunk.detection = detection;
+        queue.push_back(chunk);
+    }
+    chunkQueued.notify_one();
+}
+
+inline void StereoRecorder::runWriter() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while(true) {
+        chunkQueued.wait(lock, [this]{ return !queue.empty() || writerShouldQuit; });
+        if(queue.empty()) // Only quit once everything queued has been written.
+            return;
+        QueuedChunk chunk;
+        std::swap(chunk, queue.front());
+        queue.pop_front();
+        lock.unlock();
+        writeChunk(chunk);
+        bool failed = !file;
+        lock.lock();
+        if(chunk.type == StereoRecordingFormat::FramesChunk)
+            queuedPairs--;
+        if(failed) {
+            writeFailed = true;
+            queue.clear();
+            queuedPairs = 0;
+            return;
+        }
+    }
+}
+
+template<typename T> inline void StereoRecorder::append(const T &value) {
+    const uchar *bytes = (const uchar *)&value;
+    payload.insert(payload.end(), bytes, bytes + sizeof(T));
+}
+
+inline void StereoRecorder::appendImage(const Mat &image) {
+    StereoRecordingFormat::ImageHeader header;
+    header.rows = image.rows;
+    header.cols = image.cols;
+    header.type = image.type();
+    header.encoding = encoding;
+    if(encoding == RawFrames || image.empty()) {
+        header.encoding = RawFrames;
+        Mat continuous = image.isContinuous() ? image : image.clone();
+        header.length = (uint32_t)(continuous.total()*continuous.elemSize());
+        append(header);
+        payload.insert(payload.end(), continuous.data, continuous.data + header.length);
+        return;
+    }
+    std::vector<int> parameters;
+    if(encoding == JpegFrames) {
+        parameters.push_back(CV_IMWRITE_JPEG_QUALITY);
+        parameters.push_back(jpegQuality);
+    } else {
+        parameters.push_back(CV_IMWRITE_PNG_COMPRESSION);
+        parameters.push_back(1); // Fast; higher levels take several times as long for a few percent.
+    }
+    imencode(encoding == JpegFrames ? ".jpg" : ".png", image, encodedImage, parameters);
+    header.length = (uint32_t)encodedImage.size();
+    append(header);
+    payload.insert(payload.end(), encodedImage.begin(), encodedImage.end());
+}
+
+inline void StereoRecorder::writeChunk(const QueuedChunk &chunk) {
+    payload.clear();
+    if(chunk.type == StereoRecordingFormat::FramesChunk) {
+        StereoRecordingFormat::FramesHeader frames;
+        frames.sequenceNumber = chunk.pair.sequenceNumber;
+        frames.leftTimestamp = chunk.pair.leftTimestamp;
+        frames.rightTimestamp = chunk.pair.rightTimestamp;
+        append(frames);
+        appendImage(chunk.pair.left);
+        appendImage(chunk.pair.right);
+    } else {
+        StereoRecordingFormat::DetectionRecord record;
+        record.sequenceNumber = chunk.detection.sequenceNumber;
+        record.found = chunk.detection.found;
+        record.mouthIsOpen = chunk.detection.mouthIsOpen;
+        record.x = chunk.detection.position.x;
+        record.y = chunk.detection.position.y;
+        record.z = chunk.detection.position.z;
+        record.confidence = chunk.detection.confidence;
+        append(record);
+    }
+    StereoRecordingFormat::ChunkHeader header;
+    header.type = chunk.type;
+    header.length = (uint32_t)payload.size();
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)&payload[0], payload.size());
+    file.flush(); // Keep whole chunks on disk so a crash loses at most the chunk being written.
+}
+
+inline StereoRecordingReader::StereoRecordingReader(): haveLookahead(false) {
+}
+
+inline bool StereoRecordingReader::open(const std::string &fileName) {
+    file.close();
+    file.clear();
+    haveLookahead = false;
+    file.open(fileName.c_str(), std::ios::in | std::ios::binary);
+    StereoRecordingFormat::FileHeader header;
+    if(!file || !file.read((char *)&header, sizeof(header)))
+        return false;
+    return memcmp(header.magic, StereoRecordingFormat::magic, 8) == 0 && header.version == StereoRecordingFormat::version;
+}
+
+inline void StereoRecordingReader::rewind() {
+    file.clear();
+    file.seekg(sizeof(StereoRecordingFormat::FileHeader));
+    haveLookahead = false;
+}
+
+inline bool StereoRecordingReader::readChunk(StereoRecordingFormat::ChunkHeader &header) {
+    if(!file.read((char *)&header, sizeof(header)) || header.length > maxChunkLength)
+        return false;
+    payload.resize(header.length);
+    if(header.length > 0 && !file.read((char *)&payload[0], header.length))
+        return false; // A chunk cut short by the end of the file is the end of the recording.
+    return true;
+}
+
+inline bool StereoRecordingReader::decodeImage(size_t &offset, Mat &image) {
+    StereoRecordingFormat::ImageHeader header;
+    if(offset + sizeof(header) > payload.size())
+        return false;
+    memcpy(&header, &payload[offset], sizeof(header));
+    offset += sizeof(header);
+    if(header.length > payload.size() - offset)
+        return false;
+    // Cameras give gray or BGR frames. Anything else, or a size that doesn't fit the payload, is a damaged recording, and is
+    // turned away before any memory is allocated for it.
+    if((header.type != CV_8UC1 && header.type != CV_8UC3) || header.rows < 0 || header.cols < 0)
+        return false;
+    if(header.encoding == RawFrames) {
+        if((uint64_t)header.rows*(uint64_t)header.cols*CV_ELEM_SIZE(header.type) != header.length)
+            return false;
+        image.create(header.rows, header.cols, header.type);
+        if(header.length > 0)
+            memcpy(image.data, &payload[offset], header.length);
+    } else {
+        image = imdecode(Mat(1, (int)header.length, CV_8U, &payload[offset]), CV_LOAD_IMAGE_UNCHANGED);
+        if(image.rows != header.rows || image.cols != header.cols || image.type() != header.type)
+            return false;
+    }
+    offset += header.length;
+    return true;
+}
+
+inline bool StereoRecordingReader::decodeFrames(StereoFramePair &pair) {
+    StereoRecordingFormat::FramesHeader frames;
+    if(payload.size() < sizeof(frames))
+        return false;
+    memcpy(&frames, &payload[0], sizeof(frames));
+    pair.sequenceNumber = (unsigned long)frames.sequenceNumber;
+    pair.leftTimestamp = frames.leftTimestamp;
+    pair.rightTimestamp = frames.rightTimestamp;
+    size_t offset = sizeof(frames);
+    return decodeImage(offset, pair.left) && decodeImage(offset, pair.right);
+}
+
+inline bool StereoRecordingReader::readNextPair(StereoFramePair &pair, RecordedDetection *detection) {
+    StereoRecordingFormat::ChunkHeader header;
+    if(haveLookahead) {
+        lookahead.left.copyTo(pair.left);
+        lookahead.right.copyTo(pair.right);
+        pair.leftTimestamp = lookahead.leftTimestamp;
+        pair.rightTimestamp = lookahead.rightTimestamp;
+        pair.sequenceNumber = lookahead.sequenceNumber;
+        haveLookahead = false;
+    } else {
+        bool foundFrames = false;
+        while(!foundFrames && readChunk(header)) {
+            if(header.type == StereoRecordingFormat::FramesChunk) {
+                if(!decodeFrames(pair))
+                    return false;
+                foundFrames = true;
+            }
+        }
+        if(!foundFrames)
+            return false;
+    }
+    if(detection)
+        *detection = RecordedDetection();
+
+    // The detection for a pair is written after it, so read on to the next pair's frames, keeping them for the next call.
+    while(readChunk(header)) {
+        if(header.type == StereoRecordingFormat::FramesChunk) {
+            haveLookahead = decodeFrames(lookahead);
+            break;
+        }
+        if(header.type == StereoRecordingFormat::DetectionChunk && payload.size() >= sizeof(StereoRecordingFormat::DetectionRecord)) {
+            StereoRecordingFormat::DetectionRecord record;
+            memcpy(&record, &payload[0], sizeof(record));
+            if(detection && record.sequenceNumber == pair.sequenceNumber) {
+                detection->sequenceNumber = (unsigned long)record.sequenceNumber;
+                detection->found = record.found != 0;
+                detection->mouthIsOpen = record.mouthIsOpen != 0;
+                detection->position = Point3d(record.x, record.y, record.z);
+                detection->confidence = record.confidence;
+            }
+        }
+    }
+    return true;
+}
+
+inline StereoReplaySource::StereoReplaySource(const std::string &fileName, bool realTimeMode): realTime(realTimeMode), started(false),
+    replayStart(0), recordingStart(0), havePending(false) {
+    opened = reader.open(fileName);
+}
+
+inline bool StereoReplaySource::isOpened() {
+    return opened;
+}
+
+inline void StereoReplaySource::start() {
+    if(started || !opened)
+        return;
+    started = true;
+    reader.rewind();
+    havePending = readPending();
+    recordingStart = pending.leftTimestamp;
+    replayStart = StereoFrameGrabber::now();
+}
+
+inline void StereoReplaySource::stop() {
+    started = false;
+}
+
+inline bool StereoReplaySource::readPending() {
+    return reader.readNextPair(pending, &pendingDetection);
+}
+
+inline bool StereoReplaySource::handOut(StereoFramePair &pair, double offset, std::shared_ptr<StereoFramePair> &handle) {
+    std::shared_ptr<StereoFramePair> buffer = framePool.acquire();
+    if(!buffer) { // Consumers hold every buffer; the pair waits here until one comes back.
+        TRACE_COUNT(framePoolExhaustions);
+        return false;
+    }
+    // The frames are moved, and the buffer's old frames are read into next.
+    std::swap(buffer->left, pair.left);
+    std::swap(buffer->right, pair.right);
+    buffer->leftTimestamp = pair.leftTimestamp + offset;
+    buffer->rightTimestamp = pair.rightTimestamp + offset;
+    buffer->sequenceNumber = pair.sequenceNumber;
+    handle = buffer;
+    TRACE_COUNT(framesCaptured);
+    return true;
+}
+
+inline bool StereoReplaySource::takeLatestPair(std::shared_ptr<StereoFramePair> &pair) {
+    if(!started || !havePending)
+        return false;
+    if(realTime) {
+        double elapsed = StereoFrameGrabber::now() - replayStart;
+        if(pending.leftTimestamp - recordingStart > elapsed)
+            return false; // Not due yet
+        // Skip to the newest pair that is due, like a consumer that fell behind the cameras.
+        RecordedDetection dueDetection;
+        do {
+            std::swap(due, pending);
+            dueDetection = pendingDetection;
+            havePending = readPending();
+        } while(havePending && pending.leftTimestamp - recordingStart <= elapsed);
+        if(!handOut(due, replayStart - recordingStart, pair))
+            return false; // Dropped, as it would be by the cameras
+        lastDetection = dueDetection;
+        return true;
+    }
+    if(!handOut(pending, 0, pair))
+        return false;
+    lastDetection = pendingDetection;
+    havePending = readPending();
+    return true;
+}
+
+inline bool StereoReplaySource::hasStreamEnded() {
+    return started && !havePending;
+}
+
+inline bool StereoReplaySource::getRecordedDetection(RecordedDetection &detection) {
+    detection = lastDetection;
+    return lastDetection.sequenceNumber != 0;
+}
+
+#endif
@@ -7,99 +7,374 @@
 #include <exception>
 #include <iostream>
 #include <cmath>
-#include "stereoMatcher.hpp"
-#include "MouthPointFinder.hpp"
+#include "StereoMatcher.hpp"
+#include "StereoMouthDetector.hpp"
+#include "StereoFrameGrabber.hpp"
+#include "StereoFramePool.hpp"
+#include "FrameSource.hpp"
+#include "StereoRecording.hpp"
+#include "ResourceLocator.hpp"
+#include "Trace.hpp"
 using namespace cv;
 class ThreeDMouthLocationFinder
 {
+public:
+    /**
+     * How the 3D mouth position is found from a stereo pair.
+     */
+    enum LocalisationMode {
+        TriangulateMouthCentres, // Triangulate the mouth centre found in each view. Needs the mouth in both views.
+        DenseDepth // Sample the dense disparity inside the mouth hull from the left view. Needs the mouth in the left view only.
+    };
+private:
     StereoMatcher *stereoMatcher;
-    MouthPointFinder *mouthPointFinder;
-    Mat leftFrame, rightFrame;
+    StereoMouthDetector *mouthDetector;
+    Mat leftFrame, rightFrame; // The frames of currentFrames, which detection draws on.
     Point3d triangulatedMouthPoint;
     bool mouthIsOpen;
     bool newDataIsAvailable;
-    VideoCapture *leftFrameCapture;
-    VideoCapture *rightFrameCapture;
-    
+    bool sparseRectification; // Rectify only the detected points instead of both frames.
+    bool framesAreRectified; // True if leftFrame and rightFrame have been rectified.
+    FrameSource *leftFrameCapture;
+    FrameSource *rightFrameCapture;
+    ResourceLocator *resources; // Finds the cascade and calibration files. Not owned.
+    StereoPairSource *frameGrabber;
+    StereoRecorder *recorder; // Records every pair and the position found in it while not null.
+    std::shared_ptr<StereoFramePair> currentFrames; // The last pair processed. Not changed again once GrabMouthPosition returns.
+    LocalisationMode localisationMode;
+    double fixConfidence; // Confidence of the last mouth position, from 0 to 1.
+    double minimumDepthConfidence; // Dense depth estimates less confident than this are thrown away.
+    bool haveMouthFix; // True once a mouth position has been found.
+    double lastFixTime; // When the pair the last position was found in was captured.
+    bool lastDenseLocalisationFailed; // True if the mouth couldn't be placed by dense depth in the last pair.
+    double maximumBandAge; // In DenseDepth mode, the oldest position, in seconds, the disparity search is narrowed around.
+    bool reportedSourceClosed; // True once GrabMouthPosition has said the cameras didn't open.
+    Mat unannotatedLeft, unannotatedRight; // Copies of the frames from before detection drew on them, for dense matching.
+    std::vector<cv::Point> mouthHull;
+    std::vector<Point2f> mouthHullPoints, rectifiedMouthHull;
     
+    inline void startCapture();
+    /**
+     * Find the mouth position from the dense disparity inside the mouth hull found in the left view.
+     * @return true if a confident enough position was found, false otherwise.
+     */
+    inline bool localiseFromDenseDepth();
     
 public:
 	/**
 	 *    Constructor for the ThreeDMouthLocationfinder.
 	 */
     inline ThreeDMouthLocationFinder();
+    /**
+     *    Constructor for the ThreeDMouthLocationfinder that reads from the given sources instead of the cameras,
+     *    e.g. recorded video files or synthetic frames. Takes ownership of the sources.
+     * @param leftSource  The source to use for the left view.
+     * @param rightSource The source to use for the right view.
+     * @param framePeriod Minimum time between frames in seconds, so files can be played back at camera rate.
+     * @param locator     The locator used to find the cascade and calibration files. If null, defaultResourceLocator() is used.
+     */
+    inline ThreeDMouthLocationFinder(FrameSource *leftSource, FrameSource *rightSource, double framePeriod = 0.0, ResourceLocator *locator = 0);
+    /**
+     *    Constructor for the ThreeDMouthLocationfinder that takes whole stereo pairs from a source, e.g. a StereoReplaySource
+     *    playing back a recording. Takes ownership of the source.
+     * @param pairSource The source of stereo pairs.
+     * @param locator    The locator used to find the cascade and calibration files. If null, defaultResourceLocator() is used.
+     */
+    inline ThreeDMouthLocationFinder(StereoPairSource *pairSource, ResourceLocator *locator = 0);
 	/**
 	 *     Destructor for the ThreeDMouthLocationFinder.
 	 */
     inline ~ThreeDMouthLocationFinder();
 	/**
 	 * Continously compute the mouth position in 3 cordinates;
+	 * Works on the newest stereo pair from the capture threads and returns straight away if no new pair has arrived.
 	 */
     inline void GrabMouthPosition();
     /**
      * Get the data from the grabber.
-     * @param leftImage  The openCV mat object in which to place the left image. Passed by reference
-     * @param rightImage The openCV mat object in which to place the right image. Passed by reference
+     * @param frames     A handle, passed by reference, to the last pair processed with the detections drawn on it. Null if no pair has been processed.
+     * @param rectified  A boolean passed by reference that will be false if the frames still need rectifyForDisplay.
      * @param open       A boolean passed by reference that will be true if the system thinks the mouth is open or false otherwise.
      * @param position   An openCV Point3f, passed by reference, that will store the postion of the mouth centre.
      */
-    inline void getData(Mat& leftImage, Mat& rightImage, bool& open, Point3f& position);
+    inline void getData(StereoFrameHandle &frames, bool &rectified, bool& open, Point3f& position);
     /**
      * Tells us if there is new data available;
      * @return true if there is new data otherwise false;
      */
     inline bool isNewDataAvailable();
+    /**
+     * Get the newest mouth position without the frames, for callers that don't display them.
+     * Unlike getData it does not process a new frame pair; call GrabMouthPosition first.
+     * @param  position reference to a point where the position of the mouth centre will be stored.
+     * @param  open     reference to a boolean that will be true if the system thinks the mouth is open.
+     * @return          true if the position is new since the last call to getData or takeMouthPosition, false otherwise.
+     */
+    inline bool takeMouthPosition(Point3d &position, bool &open);
+    /**
+     * Wait until the frame source has a pair GrabMouthPosition hasn't processed, or the timeout passes.
+     * @param  timeoutSeconds The longest time to wait, in seconds.
+     * @return                true if a new pair may be ready, false if the wait timed out.
+     */
+    inline bool waitForNewPair(double timeoutSeconds);
+    /**
+     * The sequence number of the last frame pair processed by GrabMouthPosition. See StereoFramePair.
+     * @return the sequence number, or 0 if no pair has been processed yet.
+     */
+    inline unsigned long getFrameSequenceNumber();
+    /**
+     * When the left frame of the last pair processed by GrabMouthPosition was grabbed.
+     * @return the time in seconds on StereoFrameGrabber::now().
+     */
+    inline double getCaptureTimestamp();
+    /**
+     * Get the frames of the last pair processed by GrabMouthPosition, with the detections drawn on them. No pixels are copied;
+     * the pair stays out of the frame pool for as long as the handle is held, and may be handed to other threads.
+     * @param frames    reference to where the handle will be stored. Null if no pair has been processed.
+     * @param rectified reference to a boolean that will be false if the frames still need rectifyForDisplay.
+     */
+    inline void getAnnotatedFrames(StereoFrameHandle &frames, bool &rectified);
+    /**
+     * Rectify frames from getAnnotatedFrames for display. Only reads the rectification maps, so it may be called from
+     * another thread while the pipeline runs, once a pair has been processed.
+     * @param left           The left frame.
+     * @param right          The right frame.
+     * @param rectified      true if the frames are already rectified, in which case they are just copied.
+     * @param leftImage      reference to where the rectified left frame will be stored.
+     * @param rightImage     reference to where the rectified right frame will be stored.
+     */
+    inline void rectifyForDisplay(const Mat &left, const Mat &right, bool rectified, Mat &leftImage, Mat &rightImage);
+    /**
+     * Tells us if the cameras (or other frame source) opened. If they didn't, GrabMouthPosition does nothing.
+     * @return true if pairs can arrive, otherwise false.
+     */
+    inline bool isSourceOpen();
+    /**
+     * Tells us if a frame source has run out of frames, e.g. at the end of a recording.
+     * @return true if no more frames will arrive, otherwise false.
+     */
+    inline bool hasStreamEnded();
+    /**
+     * Start recording every stereo pair and the mouth position found in it. See StereoRecorder.
+     * @param  fileName The recording to write. If it already exists, the new pairs are added to its end.
+     * @param  encoding How the frames are stored.
+     * @return          true if the recording was opened, false otherwise.
+     */
+    inline bool startRecording(const std::string &fileName, FrameEncoding encoding = PngFrames);
+    /**
+     * Stop recording. Waits for the pairs still queued to be written.
+     */
+    inline void stopRecording();
+    /**
+     * Choose whether the mouth is searched for in both views at the same time or one after the other.
+     * @param parallel true to run the left and right detection concurrently (the default).
+     */
+    inline void setParallelDetection(bool parallel);
+    /**
+     * Choose whether the face is tracked between frames so that only the area around it has to be searched.
+     * @param enabled true to track the face (the default), false to search every whole frame.
+     */
+    inline void setFaceTracking(bool enabled);
+    /**
+     * Set the resolution faces are searched for at. The mouth is still located at full resolution.
+     * @param scale Fraction of the full resolution to detect faces at, in (0, 1]. Defaults to 0.5.
+     */
+    inline void setFaceDetectionScale(double scale);
+    /**
+     * Choose how the stereo pair is rectified. In sparse mode the mouth is found in the raw frames and only the two mouth points
+     * are undistorted and rectified before triangulation, so tracking never remaps whole frames. The frames handed out by
+     * getData are still rectified, but only when they are asked for.
+     * @param sparse true to rectify only the detected points (the default), false to rectify both frames before detection.
+     */
+    inline void setSparseRectification(bool sparse);
+    /**
+     * Choose how the 3D mouth position is found. See LocalisationMode. In DenseDepth mode the disparity search covers a band
+     * around the last depth found while that depth was found in the previous pair and less than 0.2 s ago, and the full range
+     * otherwise. A band search that misses, or is much less confident than the last position, is repeated over the full range.
+     * @param mode TriangulateMouthCentres (the default) or DenseDepth.
+     * @param minimumConfidence In DenseDepth mode, estimates with a lower confidence than this are thrown away.
+     */
+    inline void setLocalisationMode(LocalisationMode mode, double minimumConfidence = 0.3);
+    /**
+     * The confidence of the last mouth position. Positions triangulated from both views always have a confidence of 1.
+     * @return a value from 0 to 1.
+     */
+    inline double getFixConfidence();
     
 	/* data */
 };
-inline ThreeDMouthLocationFinder::ThreeDMouthLocationFinder(): triangulatedMouthPoint(0,0,0), mouthIsOpen(false), newDataIsAvailable(false) {
+inline ThreeDMouthLocationFinder::ThreeDMouthLocationFinder(): triangulatedMouthPoint(0,0,0), mouthIsOpen(false), newDataIsAvailable(false),
+    sparseRectification(true), framesAreRectified(true), localisationMode(TriangulateMouthCentres), fixConfidence(0),
+    minimumDepthConfidence(0.3), haveMouthFix(false), lastFixTime(0), lastDenseLocalisationFailed(false), maximumBandAge(0.2),
+    reportedSourceClosed(false) {
+    stereoMatcher = 0;
+    resources = defaultResourceLocator();
+    mouthDetector = new StereoMouthDetector(true, resources);
+    leftFrameCapture = new VideoCaptureFrameSource(0); // open Camera attached to usb port 2;
+    rightFrameCapture = new VideoCaptureFrameSource(1); // open Camera attached to usb port 1;
+    frameGrabber = new StereoFrameGrabber(leftFrameCapture, rightFrameCapture);
+    recorder = 0;
+    startCapture();
+}
+
+inline ThreeDMouthLocationFinder::ThreeDMouthLocationFinder(FrameSource *leftSource, FrameSource *rightSource, double framePeriod, ResourceLocator *locator):
+    triangulatedMouthPoint(0,0,0), mouthIsOpen(false), newDataIsAvailable(false),
+    sparseRectification(true), framesAreRectified(true), localisationMode(TriangulateMouthCentres), fixConfidence(0),
+    minimumDepthConfidence(0.3), haveMouthFix(false), lastFixTime(0), lastDenseLocalisationFailed(false), maximumBandAge(0.2),
+    reportedSourceClosed(false) {
+    stereoMatcher = 0;
+    resources = locator ? locator : defaultResourceLocator();
+    mouthDetector = new StereoMouthDetector(true, resources);
+    leftFrameCapture = leftSource;
+    rightFrameCapture = rightSource;
+    frameGrabber = new StereoFrameGrabber(leftFrameCapture, rightFrameCapture, 0.040, framePeriod);
+    recorder = 0;
+    startCapture();
+}
+
+inline ThreeDMouthLocationFinder::ThreeDMouthLocationFinder(StereoPairSource *pairSource, ResourceLocator *locator):
+    triangulatedMouthPoint(0,0,0), mouthIsOpen(false), newDataIsAvailable(false),
+    sparseRectification(true), framesAreRectified(true), localisationMode(TriangulateMouthCentres), fixConfidence(0),
+    minimumDepthConfidence(0.3), haveMouthFix(false), lastFixTime(0), lastDenseLocalisationFailed(false), maximumBandAge(0.2),
+    reportedSourceClosed(false) {
     stereoMatcher = 0;
-    mouthPointFinder = new MouthPointFinder();
-    leftFrameCapture = new VideoCapture(0); // open Camera attached to usb port 2;
-    rightFrameCapture = new VideoCapture(1); // open Camera attached to usb port 1;
+    resources = locator ? locator : defaultResourceLocator();
+    mouthDetector = new StereoMouthDetector(true, resources);
+    leftFrameCapture = 0;
+    rightFrameCapture = 0;
+    frameGrabber = pairSource;
+    recorder = 0;
+    startCapture();
+}
+
+inline void ThreeDMouthLocationFinder::startCapture() {
+    if(frameGrabber->isOpened())
+        frameGrabber->start();
 }
 
 inline ThreeDMouthLocationFinder::~ThreeDMouthLocationFinder() {
+    delete frameGrabber; // Stops the capture threads before the captures go away.
+    delete recorder;
     if(stereoMatcher)
         delete stereoMatcher;
-    delete mouthPointFinder;
+    delete mouthDetector;
     delete leftFrameCapture;
     delete rightFrameCapture;
 }
 
 inline void ThreeDMouthLocationFinder::GrabMouthPosition() {
     
-    if(!(leftFrameCapture->isOpened() && rightFrameCapture->isOpened())) {  // check if we succeeded
-        std::cout << "Failed to open cameras" << std::endl;
+    if(!frameGrabber->isOpened()) {  // check if we succeeded
+        if(!reportedSourceClosed) // Callers see it through isSourceOpen; saying so on every call would flood the log
+            std::cout << "Failed to open cameras" << std::endl;
+        reportedSourceClosed = true;
         return;
     }
-    *leftFrameCapture >> leftFrame; // get a new frame from camera 1
-    *rightFrameCapture >> rightFrame; // geta new frame from camera 2
+    // The previous pair goes back to the pool once its other consumers are done with it.
+    if(!frameGrabber->takeLatestPair(currentFrames)) // nothing new from the cameras yet
+        return;
+    TRACE_SCOPE("GrabMouthPosition");
+    TRACE_COUNT(framesProcessed);
+    if(recorder)
+        recorder->recordPair(*currentFrames); // Before detection draws on the frames
+    leftFrame = currentFrames->left;
+    rightFrame = currentFrames->right;
     if(!stereoMatcher)
-        stereoMatcher = new StereoMatcher("Resources/intrinsic.yml", "Resources/extrinsic.yml", leftFrame.size());
+        stereoMatcher = new StereoMatcher("Resources/intrinsic.yml", "Resources/extrinsic.yml", leftFrame.size(), "", resources);
     
-    stereoMatcher->rectifyImages(leftFrame, rightFrame);
+    if(!sparseRectification)
+        stereoMatcher->rectifyImages(leftFrame, rightFrame);
+    framesAreRectified = !sparseRectification;
+    if(localisationMode == DenseDepth) { // Detection draws on the frames, so keep clean copies to match.
+        leftFrame.copyTo(unannotatedLeft);
+        rightFrame.copyTo(unannotatedRight);
+    }
     
     Point2d leftMouthPoint, rightMouthPoint;
     
     bool isOpenLeft = false;
     bool isOpenRight = false;
-    if(mouthPointFinder->detectMouthCentre(leftFrame, leftMouthPoint, isOpenLeft) &&
-       mouthPointFinder->detectMouthCentre(rightFrame, rightMouthPoint, isOpenRight)) {
+    int64_t detectionStart = Trace::now();
+    bool foundInBothViews = mouthDetector->detectMouthCentres(leftFrame, rightFrame, leftMouthPoint, rightMouthPoint, isOpenLeft, isOpenRight);
+    Trace::record("detectMouthCentres", detectionStart);
+    bool foundMouth = false;
+    if(localisationMode == DenseDepth) {
+        lastDenseLocalisationFailed = !localiseFromDenseDepth();
+        if(!lastDenseLocalisationFailed) {
+            mouthIsOpen = foundInBothViews ? isOpenLeft && isOpenRight : isOpenLeft;
+            foundMouth = true;
+        }
+    } else if(foundInBothViews) {
+        if(sparseRectification)
+            stereoMatcher->rectifyPoints(leftMouthPoint, rightMouthPoint, leftMouthPoint, rightMouthPoint);
         if (fabs(leftMouthPoint.y - rightMouthPoint.y) < 30) {
             stereoMatcher->triangulateSinglePoint(leftMouthPoint, rightMouthPoint, triangulatedMouthPoint);
             mouthIsOpen = isOpenLeft && isOpenRight;
-            newDataIsAvailable = true;
+            fixConfidence = 1;
+            foundMouth = true;
+        } else {
+            TRACE_COUNT(epipolarRejections);
+        }
+    }
+    if(foundMouth) {
+        haveMouthFix = true;
+        lastFixTime = currentFrames->leftTimestamp;
+        newDataIsAvailable = true;
+        TRACE_COUNT(framesDetected);
+    }
+    if(recorder) {
+        RecordedDetection detection;
+        detection.sequenceNumber = currentFrames->sequenceNumber;
+        detection.found = foundMouth;
+        detection.mouthIsOpen = foundMouth && mouthIsOpen;
+        if(foundMouth) {
+            detection.position = triangulatedMouthPoint;
+            detection.confidence = fixConfidence;
         }
+        recorder->recordDetection(detection);
     }
     
 }
 
-inline void ThreeDMouthLocationFinder::getData(Mat& leftImage, Mat& rightImage, bool& open, Point3f& position) {
+inline bool ThreeDMouthLocationFinder::localiseFromDenseDepth() {
+    if(!mouthDetector->getLeftMouthHull(mouthHull))
+        return false;
+    mouthHullPoints.clear();
+    for(int i = 0; i < mouthHull.size(); i++)
+        mouthHullPoints.push_back(Point2f(mouthHull[i].x, mouthHull[i].y));
+    if(framesAreRectified)
+        rectifiedMouthHull = mouthHullPoints;
+    else
+        stereoMatcher->rectifyLeftPoints(mouthHullPoints, rectifiedMouthHull);
+    
+    Point3d mouthPoint;
+    double confidence = 0;
+    // Only a recent position that dense depth confirmed narrows the search. After a gap or a miss the mouth may have moved
+    // out of the band around it, and would never be found again if the search stayed there.
+    bool depthIsCurrent = haveMouthFix && !lastDenseLocalisationFailed && currentFrames->leftTimestamp - lastFixTime <= maximumBandAge;
+    double expectedDepth = depthIsCurrent ? triangulatedMouthPoint.z : 0;
+    bool found = stereoMatcher->localiseRegion(unannotatedLeft, unannotatedRight, rectifiedMouthHull, expectedDepth, framesAreRectified,
+                                               mouthPoint, confidence);
+    // A mouth that jumped out of the band can still match something inside it, just less well, and the band would then
+    // follow the wrong depth. So a miss or a clear drop in confidence in the band is searched again over the full range.
+    if(expectedDepth != 0 && (!found || confidence < std::max(minimumDepthConfidence, 0.8*fixConfidence)))
+        found = stereoMatcher->localiseRegion(unannotatedLeft, unannotatedRight, rectifiedMouthHull, 0, framesAreRectified,
+                                              mouthPoint, confidence);
+    if(!found)
+        return false;
+    if(confidence < minimumDepthConfidence) {
+        TRACE_COUNT(confidenceRejections);
+        return false;
+    }
+    triangulatedMouthPoint = mouthPoint;
+    fixConfidence = confidence;
+    return true;
+}
+
+inline void ThreeDMouthLocationFinder::getData(StereoFrameHandle &frames, bool &rectified, bool& open, Point3f& position) {
     this->GrabMouthPosition();
     newDataIsAvailable = false;
-    leftImage = leftFrame.clone();
-    rightImage = rightFrame.clone();
+    getAnnotatedFrames(frames, rectified);
     open = mouthIsOpen;
     position = triangulatedMouthPoint;
 }
@@ -109,4 +384,84 @@ inline bool ThreeDMouthLocationFinder::isNewDataAvailable() {
     return retFlg;
 }
 
+inline bool ThreeDMouthLocationFinder::takeMouthPosition(Point3d &position, bool &open) {
+    bool isNew = newDataIsAvailable;
+    newDataIsAvailable = false;
+    position = triangulatedMouthPoint;
+    open = mouthIsOpen;
+    return isNew;
+}
+
+inline bool ThreeDMouthLocationFinder::waitForNewPair(double timeoutSeconds) {
+    return frameGrabber->waitForPair(timeoutSeconds);
+}
+
+inline unsigned long ThreeDMouthLocationFinder::getFrameSequenceNumber() {
+    return currentFrames ? currentFrames->sequenceNumber : 0;
+}
+
+inline double ThreeDMouthLocationFinder::getCaptureTimestamp() {
+    return currentFrames ? currentFrames->leftTimestamp : 0;
+}
+
+inline void ThreeDMouthLocationFinder::getAnnotatedFrames(StereoFrameHandle &frames, bool &rectified) {
+    frames = currentFrames;
+    rectified = framesAreRectified;
+}
+
+inline void ThreeDMouthLocationFinder::rectifyForDisplay(const Mat &left, const Mat &right, bool rectified, Mat &leftImage, Mat &rightImage) {
+    if(rectified || !stereoMatcher) {
+        left.copyTo(leftImage);
+        right.copyTo(rightImage);
+    } else {
+        stereoMatcher->rectifyImages(left, right, leftImage, rightImage);
+    }
+}
+
+inline bool ThreeDMouthLocationFinder::isSourceOpen() {
+    return frameGrabber->isOpened();
+}
+
+inline bool ThreeDMouthLocationFinder::hasStreamEnded() {
+    return frameGrabber->hasStreamEnded();
+}
+
+inline bool ThreeDMouthLocationFinder::startRecording(const std::string &fileName, FrameEncoding encoding) {
+    stopRecording();
+    recorder = new StereoRecorder(fileName, encoding);
+    if(!recorder->isOpen())
+        stopRecording();
+    return recorder != 0;
+}
+
+inline void ThreeDMouthLocationFinder::stopRecording() {
+    delete recorder;
+    recorder = 0;
+}
+
+inline void ThreeDMouthLocationFinder::setParallelDetection(bool parallel) {
+    mouthDetector->setParallel(parallel);
+}
+
+inline void ThreeDMouthLocationFinder::setFaceTracking(bool enabled) {
+    mouthDetector->setTracking(enabled);
+}
+
+inline void ThreeDMouthLocationFinder::setFaceDetectionScale(double scale) {
+    mouthDetector->setFaceDetectionScale(scale);
+}
+
+inline void ThreeDMouthLocationFinder::setSparseRectification(bool sparse) {
+    sparseRectification = sparse;
+}
+
+inline void ThreeDMouthLocationFinder::setLocalisationMode(LocalisationMode mode, double minimumConfidence) {
+    localisationMode = mode;
+    minimumDepthConfidence = minimumConfidence;
+}
+
+inline double ThreeDMouthLocationFinder::getFixConfidence() {
+    return fixConfidence;
+}
+
 #endif
\ No newline at end of file
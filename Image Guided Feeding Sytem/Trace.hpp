@@ -0,0 +1,337 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Always-on tracing of the tracking pipeline. Code marks a stage with TRACE_SCOPE("name") (or Trace::record for a stage that
+ * is not a whole scope), which costs two clock reads and a few stores into a ring buffer owned by the calling thread. Nothing
+ * is locked and nothing is allocated after a thread's first event, so tracing does not change the timing it is measuring.
+ *
+ * Each thread keeps its most recent events in its own ring, overwriting the oldest, until it ends. The rings can be written
+ * out at any time as a Chrome trace (open it at chrome://tracing or ui.perfetto.dev), or summarised into live per stage
+ * latencies.
+ * The pipeline also keeps a few counters (frames captured, detected, rejected) that are cheap enough to update on every frame.
+ *
+ * Event names must be string literals (or otherwise live forever), since only the pointer is stored.
+ * Define IGFS_DISABLE_TRACING to compile the trace points out.
+ */
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace Trace
+{
+    /**
+     * Counters updated by the pipeline as it runs. Read them at any time from any thread.
+     */
+    struct PipelineCounters
+    {
+        std::atomic<unsigned long> framesCaptured; // Stereo pairs published by the frame grabber.
+        std::atomic<unsigned long> framesProcessed; // Stereo pairs taken by GrabMouthPosition.
+        std::atomic<unsigned long> framesDetected; // Pairs that gave a mouth position.
+        std::atomic<unsigned long> epipolarRejections; // Pairs with a mouth in both views thrown away by the 30 pixel row gate.
+        std::atomic<unsigned long> confidenceRejections; // Dense depth positions thrown away for low confidence.
+        std::atomic<unsigned long> framePoolExhaustions; // Times a pair had to wait because consumers held every pooled buffer.
+        PipelineCounters(): framesCaptured(0), framesProcessed(0), framesDetected(0), epipolarRejections(0), confidenceRejections(0),
+            framePoolExhaustions(0) {}
+    };
+
+    /**
+     * The latency of one stage over the events still in the rings.
+     */
+    struct StageSummary
+    {
+        std::string name;
+        unsigned long count;
+        double meanSeconds;
+        double maxSeconds;
+        double lastSeconds; // The most recent event
+        StageSummary(): count(0), meanSeconds(0), maxSeconds(0), lastSeconds(0) {}
+    };
+
+    /**
+     * One completed stage.
+     */
+    struct Event
+    {
+        const char *name;
+        int64_t start; // Nanoseconds on Trace::now()
+        int64_t end;
+    };
+
+    /**
+     * The events of one thread. Written only by its thread; read by anyone, using a sequence number per slot to spot a slot
+     * that was overwritten while it was being read.
+     */
+    class ThreadRing
+    {
+    public:
+        static const unsigned capacity = 4096; // Must be a power of two
+    private:
+        struct Slot
+        {
+            std::atomic<uint64_t> sequence; // Number of the event in the slot plus one; 0 while it is being written.
+            std::atomic<const char *> name;
+            std::atomic<int64_t> start;
+            std::atomic<int64_t> end;
+            Slot(): sequence(0), name(0), start(0), end(0) {}
+        };
+        Slot slots[capacity];
+        std::atomic<uint64_t> written;
+        unsigned threadNumber;
+    public:
+        inline ThreadRing(unsigned number): written(0), threadNumber(number) {}
+        inline unsigned getThreadNumber() { return threadNumber; }
+        /**
+         * Add an event. Only called by the thread that owns the ring.
+         */
+        inline void push(const char *name, int64_t start, int64_t end);
+        /**
+         * Copy out the events still in the ring, oldest first.
+         * @param events reference to a vector the events will be added to.
+         */
+        inline void snapshot(std::vector<Event> &events);
+    };
+
+    /**
+     * Every thread's ring. Rings are created the first time a thread records an event and freed when the thread ends, after
+     * their events are moved to a history shared by every ended thread, so the events can still be exported. The history
+     * keeps the newest ThreadRing::capacity events, so threads started and stopped over and over don't add up.
+     */
+    class Registry
+    {
+        std::mutex ringsMutex; // Guards everything below
+        std::vector<ThreadRing *> rings;
+        std::vector<Event> endedEvents; // Events of ended threads, oldest first.
+        std::vector<unsigned> endedThreadOfEvent;
+        unsigned nextThreadNumber;
+        pthread_key_t threadRingKey;
+        Registry(): nextThreadNumber(1), threadRingKey() { pthread_key_create(&threadRingKey, &Registry::threadEnded); }
+        static inline void threadEnded(void *ring);
+        inline void retire(ThreadRing *ring);
+    public:
+        static inline Registry &instance();
+        /**
+         * The calling thread's ring, created on first use.
+         */
+        inline ThreadRing *threadRing();
+        /**
+         * Copy the rings of every running thread and the events kept from ended ones.
+         * @param events       reference to a vector where the events will be stored.
+         * @param threadOfEvent reference to a vector where the thread number of each event will be stored.
+         */
+        inline void snapshot(std::vector<Event> &events, std::vector<unsigned> &threadOfEvent);
+    };
+
+    /**
+     * The clock events are timed with.
+     * @return a monotonic time in nanoseconds.
+     */
+    inline int64_t now();
+    /**
+     * Record a stage that started at start and ends now.
+     * @param  name  The name of the stage. Must be a string literal.
+     * @param  start When the stage started, from Trace::now().
+     * @return       How long the stage took, in seconds.
+     */
+    inline double record(const char *name, int64_t start);
+    /**
+     * The pipeline counters.
+     */
+    inline PipelineCounters &counters();
+    /**
+     * Summarise the latency of each stage over the events that ended in the last windowSeconds.
+     * @param windowSeconds How far back to look.
+     * @param summaries     reference to a vector where one summary per stage will be stored.
+     */
+    inline void summarise(double windowSeconds, std::vector<StageSummary> &summaries);
+    /**
+     * Write every event still in the rings, and the counters, as a Chrome trace JSON file.
+     * @param  fileName The file to write.
+     * @return          true if the file was written, false otherwise.
+     */
+    inline bool writeChromeTrace(const std::string &fileName);
+
+    /**
+     * Records the time from its construction to its destruction as an event. Use through TRACE_SCOPE.
+     */
+    class Scope
+    {
+        const char *name;
+        int64_t start;
+    public:
+        inline Scope(const char *stageName): name(stageName), start(now()) {}
+        inline ~Scope() { record(name, start); }
+    };
+}
+
+#ifdef IGFS_DISABLE_TRACING
+#define TRACE_SCOPE(name)
+#define TRACE_COUNT(counter)
+#else
+#define TRACE_CONCATENATE_(a, b) a##b
+#define TRACE_CONCATENATE(a, b) TRACE_CONCATENATE_(a, b)
+/** Time the rest of the enclosing scope as the stage name. */
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCATENATE(traceScope, __LINE__)(name)
+/** Add one to a member of Trace::PipelineCounters. */
+#define TRACE_COUNT(counter) (Trace::counters().counter.fetch_add(1, std::memory_order_relaxed))
+#endif
+
+inline void Trace::ThreadRing::push(const char *name, int64_t start, int64_t end) {
+    uint64_t number = written.load(std::memory_order_relaxed);
+    Slot &slot = slots[number & (capacity - 1)];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.start.store(start, std::memory_order_relaxed);
+    slot.end.store(end, std::memory_order_relaxed);
+    slot.sequence.store(number + 1, std::memory_order_release);
+    written.store(number + 1, std::memory_order_release);
+}
+
+inline void Trace::ThreadRing::snapshot(std::vector<Event> &events) {
+    uint64_t newest = written.load(std::memory_order_acquire);
+    uint64_t oldest = newest > capacity ? newest - capacity : 0;
+    for(uint64_t number = oldest; number < newest; number++) {
+        Slot &slot = slots[number & (capacity - 1)];
+        uint64_t before = slot.sequence.load(std::memory_order_acquire);
+        Event event;
+        event.name = slot.name.load(std::memory_order_relaxed);
+        event.start = slot.start.load(std::memory_order_relaxed);
+        event.end = slot.end.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(before == number + 1 && slot.sequence.load(std::memory_order_relaxed) == before)
+            events.push_back(event); // Otherwise the writer has lapped us and the slot holds a newer event.
+    }
+}
+
+inline Trace::Registry &Trace::Registry::instance() {
+    static Registry registry;
+    return registry;
+}
+
+inline Trace::ThreadRing *Trace::Registry::threadRing() {
+    ThreadRing *ring = (ThreadRing *)pthread_getspecific(threadRingKey);
+    if(ring)
+        return ring;
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    ring = new ThreadRing(nextThreadNumber++);
+    rings.push_back(ring);
+    pthread_setspecific(threadRingKey, ring);
+    return ring;
+}
+
+inline void Trace::Registry::threadEnded(void *ring) {
+    instance().retire((ThreadRing *)ring);
+}
+
+inline void Trace::Registry::retire(ThreadRing *ring) {
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    rings.erase(std::remove(rings.begin(), rings.end(), ring), rings.end());
+    ring->snapshot(endedEvents);
+    endedThreadOfEvent.resize(endedEvents.size(), ring->getThreadNumber());
+    if(endedEvents.size() > ThreadRing::capacity) {
+        size_t excess = endedEvents.size() - ThreadRing::capacity;
+        endedEvents.erase(endedEvents.begin(), endedEvents.begin() + excess);
+        endedThreadOfEvent.erase(endedThreadOfEvent.begin(), endedThreadOfEvent.begin() + excess);
+    }
+    delete ring;
+}
+
+inline void Trace::Registry::snapshot(std::vector<Event> &events, std::vector<unsigned> &threadOfEvent) {
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    events = endedEvents;
+    threadOfEvent = endedThreadOfEvent;
+    for(size_t i = 0; i < rings.size(); i++) {
+        rings[i]->snapshot(events);
+        threadOfEvent.resize(events.size(), rings[i]->getThreadNumber());
+    }
+}
+
+inline int64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline double Trace::record(const char *name, int64_t start) {
+    int64_t end = now();
+#ifndef IGFS_DISABLE_TRACING
+    Registry::instance().threadRing()->push(name, start, end);
+#endif
+    return (end - start)*1e-9;
+}
+
+inline Trace::PipelineCounters &Trace::counters() {
+    static PipelineCounters pipelineCounters;
+    return pipelineCounters;
+}
+
+inline void Trace::summarise(double windowSeconds, std::vector<StageSummary> &summaries) {
+    std::vector<Event> events;
+    std::vector<unsigned> threads;
+    Registry::instance().snapshot(events, threads);
+    int64_t windowStart = now() - (int64_t)(windowSeconds*1e9);
+    std::vector<int64_t> lastEnd;
+    summaries.clear();
+    for(size_t i = 0; i < events.size(); i++) {
+        if(events[i].end < windowStart)
+            continue;
+        size_t stage = 0;
+        while(stage < summaries.size() && strcmp(summaries[stage].name.c_str(), events[i].name) != 0)
+            stage++;
+        if(stage == summaries.size()) {
+            summaries.push_back(StageSummary());
+            summaries.back().name = events[i].name;
+            lastEnd.push_back(0);
+        }
+        StageSummary &summary = summaries[stage];
+        double seconds = (events[i].end - events[i].start)*1e-9;
+        summary.meanSeconds += seconds; // Divided by the count below
+        summary.count++;
+        if(seconds > summary.maxSeconds)
+            summary.maxSeconds = seconds;
+        if(events[i].end >= lastEnd[stage]) {
+            lastEnd[stage] = events[i].end;
+            summary.lastSeconds = seconds;
+        }
+    }
+    for(size_t i = 0; i < summaries.size(); i++)
+        summaries[i].meanSeconds /= summaries[i].count;
+}
+
+inline bool Trace::writeChromeTrace(const std::string &fileName) {
+    std::vector<Event> events;
+    std::vector<unsigned> threads;
+    Registry::instance().snapshot(events, threads);
+    FILE *file = fopen(fileName.c_str(), "w");
+    if(!file)
+        return false;
+    int64_t origin = now();
+    for(size_t i = 0; i < events.size(); i++) {
+        if(events[i].start < origin)
+            origin = events[i].start;
+    }
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for(size_t i = 0; i < events.size(); i++) {
+        fprintf(file, "{\"name\": \"%s\", \"cat\": \"pipeline\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f},\n",
+                events[i].name, threads[i], (events[i].start - origin)*1e-3, (events[i].end - events[i].start)*1e-3);
+    }
+    PipelineCounters &pipelineCounters = counters();
+    fprintf(file, "{\"name\": \"pipeline\", \"ph\": \"C\", \"pid\": 1, \"tid\": 0, \"ts\": %.3f, \"args\": {\"framesCaptured\": %lu, "
+            "\"framesProcessed\": %lu, \"framesDetected\": %lu, \"epipolarRejections\": %lu, \"confidenceRejections\": %lu, "
+            "\"framePoolExhaustions\": %lu}}\n]}\n",
+            (now() - origin)*1e-3, pipelineCounters.framesCaptured.load(), pipelineCounters.framesProcessed.load(),
+            pipelineCounters.framesDetected.load(), pipelineCounters.epipolarRejections.load(), pipelineCounters.confidenceRejections.load(),
+            pipelineCounters.framePoolExhaustions.load());
+    return fclose(file) == 0;
+}
+
+#endif
@@ -0,0 +1,281 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The TrackingLoop class runs the tracking pipeline (ThreeDMouthLocationFinder::GrabMouthPosition) on its own thread, at the
+ * rate stereo pairs arrive, and publishes the result of every pair as an immutable TrackingResult. Consumers such as the
+ * display and the arm commander take the latest result whenever they need one and at their own rate, so a slow display never
+ * delays tracking and a slow frame never freezes the display.
+ *
+ * Results are shared, not copied: latestResult() hands out a pointer to a result that is never changed after it is published,
+ * so any number of threads can hold and read results while the loop moves on.
+ *
+ * A consumer can take the newest result without blocking (tryGetResult), wait for one newer than it has (waitForResult), or
+ * be called with every result as it is published (subscribe). Every result carries the sequence number and capture time of
+ * its pair, so a consumer can tell how old it is and how many pairs it missed.
+ *
+ * If the cameras didn't open, the loop stops straight away rather than spinning, and hasFailed tells consumers why no
+ * results come.
+ *
+ * Every position found is also fed to a MouthMotionModel, whose smoothed position and velocity go out with each result so
+ * consumers can predict where the mouth will be.
+ */
+#ifndef TRACKING_LOOP_HPP
+#define TRACKING_LOOP_HPP
+
+#include <opencv2/opencv.hpp>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "ThreeDMouthLocationFinder.hpp"
+#include "MouthMotionModel.hpp"
+using namespace cv;
+
+/**
+ * What the tracking pipeline made of one stereo pair.
+ */
+struct TrackingResult
+{
+    unsigned long sequenceNumber; // Sequence number of the pair. See StereoFramePair.
+    unsigned long pairsSkipped; // Pairs captured since the previous result that the pipeline was too slow to process.
+    double captureTimestamp; // When the left frame was grabbed, on StereoFrameGrabber::now().
+    double publishTimestamp; // When the result was published, on StereoFrameGrabber::now().
+    bool positionIsNew; // True if the mouth was found in this pair. Otherwise position is the last one found.
+    bool hasPosition; // True if the mouth has been found in this pair or an earlier one.
+    Point3d position; // The mouth centre, in the units of the calibration.
+    bool mouthIsOpen;
+    double confidence; // See ThreeDMouthLocationFinder::getFixConfidence.
+    MouthMotionEstimate motion; // The motion model after this pair. Use motion.predict to aim at where the mouth will be.
+    StereoFrameHandle frames; // The pair with the detections drawn on it, shared with the frame pool. Null unless frames are published.
+    bool framesAreRectified; // False if the frames still have to be rectified for display. See ThreeDMouthLocationFinder::rectifyForDisplay.
+    TrackingResult(): sequenceNumber(0), pairsSkipped(0), captureTimestamp(0), publishTimestamp(0), positionIsNew(false),
+        hasPosition(false), position(0, 0, 0), mouthIsOpen(false), confidence(0), framesAreRectified(false) {}
+};
+
+class TrackingLoop
+{
+public:
+    /**
+     * Called on the tracking thread with every result as it is published.
+     */
+    typedef std::function<void(const std::shared_ptr<const TrackingResult> &)> ResultCallback;
+private:
+    struct Subscription
+    {
+        unsigned long id;
+        ResultCallback callback;
+    };
+
+    ThreeDMouthLocationFinder *finder;
+    bool publishFrames;
+    double idleWait; // Longest wait for a new pair before looking again, in seconds.
+    MouthMotionModel motionModel; // Only used by the tracking thread.
+    std::thread loopThread;
+    std::atomic<bool> running;
+    std::atomic<bool> failed; // Set when the loop stopped because the frame source wasn't open.
+    std::mutex resultMutex;
+    std::condition_variable resultPublished;
+    std::shared_ptr<const TrackingResult> latest;
+    std::mutex subscriptionMutex; // Held while callbacks run, so unsubscribe waits for a running callback to finish.
+    std::vector<Subscription> subscriptions;
+    unsigned long lastSubscriptionId;
+
+    inline void run();
+    inline void publish(const std::shared_ptr<const TrackingResult> &result);
+    inline void finish();
+public:
+    /**
+     * Constructor for the TrackingLoop. The finder must outlive the loop and must not be used by anything else while the loop runs.
+     * @param mouthFinder   The pipeline to run.
+     * @param withFrames    true to publish the annotated frames with every result (for display), false for positions only.
+     * @param pollInterval  Longest time to wait for a new pair before looking again, in seconds. Pairs from the cameras wake
+     *                      the loop as soon as they arrive.
+     */
+    inline TrackingLoop(ThreeDMouthLocationFinder *mouthFinder, bool withFrames = true, double pollInterval = 0.002);
+    /**
+     * Destructor for the TrackingLoop. Stops the loop.
+     */
+    inline ~TrackingLoop();
+    /**
+     * Start the tracking thread. Does nothing if it is already running.
+     */
+    inline void start();
+    /**
+     * Stop the tracking thread and wait for it to finish. Threads in waitForResult return straight away.
+     */
+    inline void stop();
+    /**
+     * Tells us if the loop stopped on its own because the cameras (or other frame source) weren't open. No results will come
+     * until the loop is started again with an open source.
+     * @return true if the loop has failed, otherwise false.
+     */
+    inline bool hasFailed();
+    /**
+     * Get the latest result. Never blocks for longer than it takes to copy a pointer.
+     * @return the latest result, or null if no pair has been processed yet.
+     */
+    inline std::shared_ptr<const TrackingResult> latestResult();
+    /**
+     * Take the latest result if it is newer than the one the caller already has. Never blocks for longer than it takes to copy a pointer.
+     * @param  afterSequence The sequence number of the newest result the caller has, or 0 for any result.
+     * @param  result        reference to where the result will be stored. Left alone if there is nothing newer.
+     * @return               true if a newer result was stored, false otherwise.
+     */
+    inline bool tryGetResult(unsigned long afterSequence, std::shared_ptr<const TrackingResult> &result);
+    /**
+     * Wait for a result newer than the one the caller already has.
+     * @param  afterSequence  The sequence number of the newest result the caller has, or 0 for any result.
+     * @param  timeoutSeconds The longest time to wait, in seconds.
+     * @param  result         reference to where the result will be stored. Left alone if there is nothing newer.
+     * @return                true if a newer result was stored, false if the wait timed out or the loop is not running.
+     */
+    inline bool waitForResult(unsigned long afterSequence, double timeoutSeconds, std::shared_ptr<const TrackingResult> &result);
+    /**
+     * Have a function called with every result from now on. It runs on the tracking thread, so it must be quick and must not
+     * call subscribe or unsubscribe.
+     * @param  callback The function to call.
+     * @return          An id to pass to unsubscribe.
+     */
+    inline unsigned long subscribe(const ResultCallback &callback);
+    /**
+     * Stop calling a function subscribed with subscribe. Once this returns the function is not running and won't be called again.
+     * @param subscription The id returned by subscribe.
+     */
+    inline void unsubscribe(unsigned long subscription);
+};
+
+inline TrackingLoop::TrackingLoop(ThreeDMouthLocationFinder *mouthFinder, bool withFrames, double pollInterval): finder(mouthFinder),
+    publishFrames(withFrames), idleWait(pollInterval), running(false), failed(false), lastSubscriptionId(0) {
+}
+
+inline TrackingLoop::~TrackingLoop() {
+    stop();
+}
+
+inline void TrackingLoop::start() {
+    if(running)
+        return;
+    if(loopThread.joinable()) // The loop stopped on its own
+        loopThread.join();
+    failed = false;
+    running = true;
+    loopThread = std::thread(&TrackingLoop::run, this);
+}
+
+inline void TrackingLoop::stop() {
+    {
+        std::lock_guard<std::mutex> lock(resultMutex);
+        running = false;
+    }
+    resultPublished.notify_all();
+    if(loopThread.joinable())
+        loopThread.join();
+}
+
+inline bool TrackingLoop::hasFailed() {
+    return failed;
+}
+
+inline void TrackingLoop::finish() {
+    {
+        std::lock_guard<std::mutex> lock(resultMutex);
+        running = false;
+    }
+    resultPublished.notify_all(); // Nothing more is coming, so waitForResult returns now
+}
+
+inline std::shared_ptr<const TrackingResult> TrackingLoop::latestResult() {
+    std::lock_guard<std::mutex> lock(resultMutex);
+    return latest;
+}
+
+inline bool TrackingLoop::tryGetResult(unsigned long afterSequence, std::shared_ptr<const TrackingResult> &result) {
+    std::lock_guard<std::mutex> lock(resultMutex);
+    if(!latest || latest->sequenceNumber <= afterSequence)
+        return false;
+    result = latest;
+    return true;
+}
+
+inline bool TrackingLoop::waitForResult(unsigned long afterSequence, double timeoutSeconds, std::shared_ptr<const TrackingResult> &result) {
+    std::unique_lock<std::mutex> lock(resultMutex);
+    resultPublished.wait_for(lock, std::chrono::duration<double>(timeoutSeconds), [this, afterSequence] {
+        return !running || (latest && latest->sequenceNumber > afterSequence);
+    });
+    if(!latest || latest->sequenceNumber <= afterSequence)
+        return false;
+    result = latest;
+    return true;
+}
+
+inline unsigned long TrackingLoop::subscribe(const ResultCallback &callback) {
+    std::lock_guard<std::mutex> lock(subscriptionMutex);
+    Subscription subscription;
+    subscription.id = ++lastSubscriptionId;
+    subscription.callback = callback;
+    subscriptions.push_back(subscription);
+    return subscription.id;
+}
+
+inline void TrackingLoop::unsubscribe(unsigned long subscription) {
+    std::lock_guard<std::mutex> lock(subscriptionMutex);
+    for(size_t i = 0; i < subscriptions.size(); i++) {
+        if(subscriptions[i].id == subscription) {
+            subscriptions.erase(subscriptions.begin() + i);
+            return;
+        }
+    }
+}
+
+inline void TrackingLoop::publish(const std::shared_ptr<const TrackingResult> &result) {
+    {
+        std::lock_guard<std::mutex> lock(resultMutex);
+        latest = result;
+    }
+    resultPublished.notify_all();
+    std::lock_guard<std::mutex> lock(subscriptionMutex);
+    for(size_t i = 0; i < subscriptions.size(); i++)
+        subscriptions[i].callback(result);
+}
+
+inline void TrackingLoop::run() {
+    unsigned long lastSequence = 0;
+    bool hasPosition = false;
+    while(running) {
+        finder->GrabMouthPosition(); // Says once if the cameras didn't open
+        if(!finder->isSourceOpen()) { // waitForNewPair would return straight away, forever
+            failed = true;
+            finish();
+            return;
+        }
+        unsigned long sequence = finder->getFrameSequenceNumber();
+        if(sequence == lastSequence) {
+            finder->waitForNewPair(idleWait);
+            continue;
+        }
+
+        std::shared_ptr<TrackingResult> result = std::make_shared<TrackingResult>();
+        result->sequenceNumber = sequence;
+        result->pairsSkipped = lastSequence != 0 && sequence > lastSequence ? sequence - lastSequence - 1 : 0;
+        lastSequence = sequence;
+        result->captureTimestamp = finder->getCaptureTimestamp();
+        result->positionIsNew = finder->takeMouthPosition(result->position, result->mouthIsOpen);
+        hasPosition = hasPosition || result->positionIsNew;
+        result->hasPosition = hasPosition;
+        result->confidence = finder->getFixConfidence();
+        if(result->positionIsNew)
+            motionModel.update(result->position, result->captureTimestamp, result->confidence);
+        result->motion = motionModel.getEstimate(result->captureTimestamp);
+        if(publishFrames)
+            finder->getAnnotatedFrames(result->frames, result->framesAreRectified);
+        result->publishTimestamp = StereoFrameGrabber::now();
+        publish(result);
+    }
+}
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The TripleBuffer class is a lock-free single-producer/single-consumer slot that always hands the consumer the newest value.
+ * The producer fills a back buffer and publishes it by swapping it with the middle buffer; the consumer takes the middle buffer
+ * by swapping it with its front buffer. Neither side ever waits for the other and the producer never touches the buffer the
+ * consumer is reading, so old values are simply overwritten when the consumer falls behind.
+ */
+#ifndef TRIPLE_BUFFER_HPP
+#define TRIPLE_BUFFER_HPP
+
+#include <atomic>
+
+template <typename T>
+class TripleBuffer
+{
+    static const int indexMask = 0x3; // Low bits of middle hold the index of the middle buffer.
+    static const int freshFlag = 0x4; // Set when the middle buffer holds a value the consumer has not seen.
+    T buffers[3];
+    std::atomic<int> middle;
+    int back; // Only touched by the producer.
+    int front; // Only touched by the consumer.
+
+    TripleBuffer(const TripleBuffer&);
+    TripleBuffer& operator=(const TripleBuffer&);
+public:
+    inline TripleBuffer();
+    /**
+     * The buffer the producer should fill next. Only call from the producer thread.
+     * @return reference to the back buffer.
+     */
+    inline T& writeBuffer();
+    /**
+     * Publish the back buffer to the consumer. After this call writeBuffer() returns a different buffer,
+     * which may still contain an older value that the producer can reuse the storage of.
+     */
+    inline void publish();
+    /**
+     * Take the newest published value if there is one the consumer has not seen yet. Only call from the consumer thread.
+     * @return true if readBuffer() now holds a new value, false if nothing was published since the last call.
+     */
+    inline bool update();
+    /**
+     * Tells us if a value has been published that the consumer has not taken yet, without taking it.
+     * @return true if update() would return true, otherwise false.
+     */
+    inline bool hasNewValue();
+    /**
+     * The buffer the consumer currently owns. It stays valid and untouched by the producer until the next call to update().
+     * @return reference to the front buffer.
+     */
+    inline T& readBuffer();
+};
+
+template <typename T>
+inline TripleBuffer<T>::TripleBuffer(): middle(1), back(0), front(2) {
+}
+
+template <typename T>
+inline T& TripleBuffer<T>::writeBuffer() {
+    return buffers[back];
+}
+
+template <typename T>
+inline void TripleBuffer<T>::publish() {
+    back = middle.exchange(back | freshFlag, std::memory_order_acq_rel) & indexMask;
+}
+
+template <typename T>
+inline bool TripleBuffer<T>::update() {
+    if(!(middle.load(std::memory_order_relaxed) & freshFlag))
+        return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+    return true;
+}
+
+template <typename T>
+inline bool TripleBuffer<T>::hasNewValue() {
+    return (middle.load(std::memory_order_acquire) & freshFlag) != 0;
+}
+
+template <typename T>
+inline T& TripleBuffer<T>::readBuffer() {
+    return buffers[front];
+}
+
+#endif
@@ -0,0 +1,255 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks the binary arm protocol: the CRC against the standard check value, FrameDecoder finding frames among garbage, split
+ * reads and corrupt CRCs, and encodeArguments refusing values that don't fit. Then what ArmLink puts on the wire when acks go
+ * missing: what it sends again, and what it must not send again after an abort or a newer target. Last, a move round trip
+ * through a SimulatedArm on a pseudo-terminal, over the same raw serial device the headless tools use.
+ */
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "ArmProtocol.hpp"
+#include "SimulatedArmEndpoint.hpp"
+#include "StereoFrameGrabber.hpp"
+#include "TestSupport.hpp"
+
+/**
+ * An ArmLink whose writer keeps every frame it is given, for an arm that never answers unless told to.
+ */
+struct RecordingLink
+{
+    std::vector<ArmProtocol::Frame> sent;
+    ArmProtocol::FrameDecoder decoder;
+    ArmLink link;
+
+    RecordingLink(): link([this] (const uint8_t *bytes, size_t length) {
+        decoder.push(bytes, length);
+        ArmProtocol::Frame frame;
+        while(decoder.next(frame))
+            sent.push_back(frame);
+    }) {}
+
+    void ack(uint8_t sequence, double now) {
+        std::vector<uint8_t> frame;
+        ArmProtocol::encodeFrame(ArmProtocol::AckMessage, sequence, 0, 0, frame);
+        link.receive(&frame[0], frame.size(), now);
+    }
+
+    size_t timesSent(uint8_t sequence) {
+        size_t count = 0;
+        for(size_t i = 0; i < sent.size(); i++)
+            if(sent[i].sequence == sequence)
+                count++;
+        return count;
+    }
+};
+
+static const double target[ArmProtocol::commandArguments] = {10, -20, 5.5, 0, 1};
+static const double otherTarget[ArmProtocol::commandArguments] = {12, -18, 6, 0, 1};
+
+static std::vector<uint8_t> moveFrame(uint8_t sequence, const double *arguments) {
+    std::vector<uint8_t> payload, frame;
+    ArmProtocol::encodeArguments(arguments, payload);
+    ArmProtocol::encodeFrame(ArmProtocol::MoveMessage, sequence, &payload[0], payload.size(), frame);
+    return frame;
+}
+
+static bool isMove(const ArmProtocol::Frame &frame, uint8_t sequence, const double *arguments) {
+    double decoded[ArmProtocol::commandArguments];
+    if(frame.type != ArmProtocol::MoveMessage || frame.sequence != sequence || !ArmProtocol::decodeArguments(frame.payload, decoded))
+        return false;
+    for(size_t i = 0; i < ArmProtocol::commandArguments; i++)
+        if(std::fabs(decoded[i] - arguments[i]) > 0.005)
+            return false;
+    return true;
+}
+
+static void crcMatchesTheCheckValue() {
+    const char *check = "123456789";
+    CHECK(ArmProtocol::crc16((const uint8_t *)check, strlen(check)) == 0x29B1);
+}
+
+static void decoderResynchronisesAfterGarbage() {
+    ArmProtocol::FrameDecoder decoder;
+    // Noise, including a sync byte whose length is too long and one whose CRC can't match, then a real frame.
+    const uint8_t garbage[] = {0x00, 0x13, ArmProtocol::syncByte, 'M', 7, 200, ArmProtocol::syncByte, 'K', 1, 0, 0x12, 0x34, 0xFF};
+    std::vector<uint8_t> frame = moveFrame(9, target);
+    decoder.push(garbage, sizeof(garbage));
+    decoder.push(&frame[0], frame.size());
+    ArmProtocol::Frame decoded;
+    CHECK(decoder.next(decoded));
+    CHECK(isMove(decoded, 9, target));
+    CHECK(decoder.getBadFrames() == 2);
+    CHECK(!decoder.next(decoded));
+}
+
+static void decoderTakesFramesSplitAcrossReads() {
+    ArmProtocol::FrameDecoder decoder;
+    std::vector<uint8_t> stream = moveFrame(1, target), second = moveFrame(2, otherTarget);
+    stream.insert(stream.end(), second.begin(), second.end());
+    std::vector<ArmProtocol::Frame> frames;
+    for(size_t i = 0; i < stream.size(); i++) { // A byte at a time, as a slow serial port might deliver them
+        decoder.push(&stream[i], 1);
+        ArmProtocol::Frame frame;
+        while(decoder.next(frame))
+            frames.push_back(frame);
+        CHECK(frames.size() == (i + 1 >= stream.size() ? 2u : i + 1 >= stream.size() - second.size() ? 1u : 0u));
+    }
+    CHECK(frames.size() == 2 && isMove(frames[0], 1, target) && isMove(frames[1], 2, otherTarget));
+    CHECK(decoder.getBadFrames() == 0);
+}
+
+static void decoderDropsFramesWithABadCrc() {
+    ArmProtocol::FrameDecoder decoder;
+    std::vector<uint8_t> corrupt = moveFrame(1, target), good = moveFrame(2, otherTarget);
+    corrupt[ArmProtocol::headerLength] ^= 0x01; // One bit of the payload flipped on the wire
+    decoder.push(&corrupt[0], corrupt.size());
+    decoder.push(&good[0], good.size());
+    ArmProtocol::Frame decoded;
+    CHECK(decoder.next(decoded));
+    CHECK(isMove(decoded, 2, otherTarget));
+    CHECK(decoder.getBadFrames() == 1);
+    CHECK(!decoder.next(decoded));
+}
+
+static void argumentsOutOfRangeAreRefused() {
+    std::vector<uint8_t> out(1, 0x55);
+    const double limits[ArmProtocol::commandArguments] = {327.67, -327.68, 0, 0, 1};
+    CHECK(ArmProtocol::encodeArguments(limits, out));
+    CHECK(out.size() == 1 + 2*ArmProtocol::commandArguments);
+
+    const double tooBig[ArmProtocol::commandArguments] = {10, 400, 5, 0, 1};
+    const double tooSmall[ArmProtocol::commandArguments] = {10, -20, -327.69, 0, 1};
+    const double notANumber[ArmProtocol::commandArguments] = {10, -20, 5, std::numeric_limits<double>::quiet_NaN(), 1};
+    std::vector<uint8_t> unchanged = out;
+    CHECK(!ArmProtocol::encodeArguments(tooBig, out));
+    CHECK(!ArmProtocol::encodeArguments(tooSmall, out));
+    CHECK(!ArmProtocol::encodeArguments(notANumber, out));
+    CHECK(out == unchanged); // Nothing appended
+
+    // ArmLink won't send what it can't encode.
+    RecordingLink arm;
+    CHECK(!arm.link.sendMove(tooBig, 0));
+    CHECK(!arm.link.sendMove(notANumber, 0));
+    CHECK(arm.sent.empty() && arm.link.isIdle());
+}
+
+static void unacknowledgedMoveIsSentAgain() {
+    RecordingLink arm;
+    uint8_t move;
+    CHECK(arm.link.sendMove(target, 0, &move));
+    arm.link.poll(0.05);
+    CHECK(arm.timesSent(move) == 1);
+    arm.link.poll(0.2);
+    CHECK(arm.timesSent(move) == 2);
+    CHECK(arm.link.getStatistics().retransmissions == 1);
+}
+
+static void abortDropsUnacknowledgedMove() {
+    RecordingLink arm;
+    uint8_t move, abort;
+    CHECK(arm.link.sendMove(target, 0, &move)); // Its ack is lost
+    arm.link.sendAbort(0.01, &abort);
+    arm.link.poll(0.2);
+    arm.link.poll(0.4);
+    CHECK(arm.timesSent(move) == 1);
+    CHECK(arm.timesSent(abort) == 3);
+    arm.ack(abort, 0.41);
+    CHECK(arm.link.isIdle());
+}
+
+static void abortDropsQueuedCommands() {
+    RecordingLink arm;
+    uint8_t sequence[6];
+    for(int i = 0; i < 6; i++) // A window of four, so two wait
+        CHECK(arm.link.sendMove(target, 0, &sequence[i]));
+    arm.link.sendAbort(0.01);
+    arm.link.poll(0.2);
+    CHECK(arm.timesSent(sequence[4]) == 0);
+    CHECK(arm.timesSent(sequence[5]) == 0);
+}
+
+static void supersededMoveIsNotSentAgain() {
+    RecordingLink arm;
+    uint8_t older, newer;
+    CHECK(arm.link.sendMove(target, 0, &older, true)); // Its ack is lost
+    CHECK(arm.link.sendMove(otherTarget, 0.01, &newer, true));
+    arm.link.poll(0.2);
+    CHECK(arm.timesSent(older) == 1);
+    CHECK(arm.timesSent(newer) == 2);
+    CHECK(arm.link.getStatistics().supersededMoves == 1);
+    arm.ack(newer, 0.21);
+    CHECK(arm.link.isIdle());
+}
+
+static void servoTargetDoesNotReplaceQueuedRetrieve() {
+    RecordingLink arm;
+    for(int i = 0; i < 4; i++) // Fill the window, so later commands queue
+        CHECK(arm.link.sendMove(target, 0));
+    uint8_t retrieve, first, second;
+    CHECK(arm.link.sendMove(target, 0, &retrieve));
+    CHECK(arm.link.sendMove(target, 0, &first, true));
+    CHECK(arm.link.sendMove(otherTarget, 0, &second, true));
+    CHECK(first != retrieve);
+    CHECK(second == first); // One servo target replaces another
+    CHECK(arm.link.getStatistics().replacedMoves == 1);
+}
+
+static void moveRoundTripsThroughASimulatedArm() {
+    SimulatedArmEndpoint arm;
+    int device = arm.open() ? openSerialDevice(arm.getPath()) : -1;
+    CHECK(device >= 0);
+    if(device < 0)
+        return;
+    arm.start();
+    ArmLink link([device] (const uint8_t *data, size_t length) {
+        ssize_t written = write(device, data, length); // A short write is a lost frame, which the link sends again
+        (void)written;
+    });
+    uint8_t move = 0;
+    int arrivals = 0;
+    bool arrivedAtMove = false;
+    link.onArrived = [&] (uint8_t sequence) {
+        arrivals++;
+        arrivedAtMove = sequence == move;
+    };
+    CHECK(link.sendMove(target, StereoFrameGrabber::now(), &move));
+
+    double end = StereoFrameGrabber::now() + 2;
+    while((!link.isIdle() || arrivals == 0) && StereoFrameGrabber::now() < end) {
+        struct pollfd readable = {device, POLLIN, 0};
+        poll(&readable, 1, 10);
+        uint8_t buffer[256];
+        ssize_t length;
+        while((length = read(device, buffer, sizeof(buffer))) > 0)
+            link.receive(buffer, length, StereoFrameGrabber::now());
+        link.poll(StereoFrameGrabber::now());
+    }
+    arm.stop();
+    close(device);
+
+    CHECK(link.isIdle());
+    CHECK(arrivals == 1 && arrivedAtMove);
+    ArmLink::Statistics statistics = link.getStatistics();
+    CHECK(statistics.acks == 1 && statistics.failures == 0);
+    CHECK(link.getBadFrames() == 0);
+    CHECK(arm.getStatistics().commands == 1);
+}
+
+int main() {
+    RUN_TEST(crcMatchesTheCheckValue);
+    RUN_TEST(decoderResynchronisesAfterGarbage);
+    RUN_TEST(decoderTakesFramesSplitAcrossReads);
+    RUN_TEST(decoderDropsFramesWithABadCrc);
+    RUN_TEST(argumentsOutOfRangeAreRefused);
+    RUN_TEST(unacknowledgedMoveIsSentAgain);
+    RUN_TEST(abortDropsUnacknowledgedMove);
+    RUN_TEST(abortDropsQueuedCommands);
+    RUN_TEST(supersededMoveIsNotSentAgain);
+    RUN_TEST(servoTargetDoesNotReplaceQueuedRetrieve);
+    RUN_TEST(moveRoundTripsThroughASimulatedArm);
+    return testResult();
+}
@@ -0,0 +1,98 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks that ThreeDMouthLocationFinder in DenseDepth mode finds the mouth again when its depth jumps outside the band the
+ * disparity search was narrowed to. A photograph of a face is drawn by FaceScene at one depth and then at another, well
+ * outside the band around the first. A search in the band still matches something at the wrong depth, so this also checks
+ * that the drop in confidence sends the search back to the full range.
+ *
+ * Needs a frontal photograph of a face the mouth detector can find the mouth in (DenseDepthTests FACE_IMAGE; ctest passes
+ * Tests/Fixtures/face.jpg). Leaving it out is a failure rather than a skip.
+ */
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include "ThreeDMouthLocationFinder.hpp"
+#include "ResourceLocator.hpp"
+#include "FaceScene.hpp"
+#include "TestSupport.hpp"
+using namespace cv;
+
+#ifndef IGFS_RESOURCE_DIR
+#define IGFS_RESOURCE_DIR "."
+#endif
+
+/**
+ * Hands out a new pair of the current scene every time one is asked for, 30 frames a second apart on its own clock.
+ */
+class SceneSource: public StereoPairSource
+{
+    StereoFramePool framePool;
+    unsigned long sequenceNumber;
+public:
+    const FaceScene *scene;
+
+    SceneSource(cv::Size size, const FaceScene *initialScene): framePool(8, size), sequenceNumber(0), scene(initialScene) {}
+    bool isOpened() { return true; }
+    void start() {}
+    void stop() {}
+    bool takeLatestPair(std::shared_ptr<StereoFramePair> &pair) {
+        std::shared_ptr<StereoFramePair> buffer = framePool.acquire();
+        if(!buffer)
+            return false;
+        scene->draw(0, buffer->left);
+        scene->draw(1, buffer->right);
+        buffer->sequenceNumber = ++sequenceNumber;
+        buffer->leftTimestamp = buffer->rightTimestamp = sequenceNumber/30.0;
+        pair = buffer;
+        return true;
+    }
+    bool waitForPair(double) { return true; }
+    bool hasStreamEnded() { return false; }
+};
+
+static bool isNear(double depth, double expected) {
+    return fabs(fabs(depth) - expected) < expected*0.1;
+}
+
+static void findsMouthAfterDepthJump(const std::string &fileName) {
+    DirectoryResourceLocator resources(IGFS_RESOURCE_DIR);
+    Mat face = imread(fileName, CV_LOAD_IMAGE_COLOR);
+    Point2d mouthInFace;
+    CHECK(!face.empty() && findMouthInFace(face, &resources, mouthInFace));
+    if(face.empty())
+        return;
+    cv::Size frameSize(1600, 1200); // The size the bundled calibration was made at
+    const double faceWidth = 56; // Big enough in the view at both depths for the face detector to find
+    const double nearDepth = 60, farDepth = 100; // The band around 60 reaches 75
+    FaceScene nearScene(face, mouthInFace, faceWidth, resources, frameSize, nearDepth, 0, 1);
+    FaceScene farScene(face, mouthInFace, faceWidth, resources, frameSize, farDepth, 0, 1);
+    SceneSource *source = new SceneSource(frameSize, &nearScene);
+    ThreeDMouthLocationFinder finder(source, &resources);
+    finder.setLocalisationMode(ThreeDMouthLocationFinder::DenseDepth);
+    Point3d position;
+    bool open;
+    bool foundNear = false;
+    for(int i = 0; i < 10; i++) {
+        finder.GrabMouthPosition();
+        if(finder.takeMouthPosition(position, open))
+            foundNear = isNear(position.z, nearDepth);
+    }
+    CHECK(foundNear);
+    source->scene = &farScene;
+    bool foundFar = false;
+    for(int i = 0; i < 3 && !foundFar; i++) { // The detector may take a frame to find the smaller face
+        finder.GrabMouthPosition();
+        if(finder.takeMouthPosition(position, open))
+            foundFar = isNear(position.z, farDepth);
+    }
+    CHECK(foundFar);
+}
+
+int main(int argc, char **argv) {
+    std::cerr << "findsMouthAfterDepthJump" << std::endl;
+    CHECK(argc > 1); // The photograph of a face
+    if(argc > 1)
+        findsMouthAfterDepthJump(argv[1]);
+    return testResult();
+}
@@ -0,0 +1,160 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks FeedingSequence step by step on a clock of its own: arrivals move a feed from the scoop through the insert and the
+ * retrieve to rest; a feed won't start without a tracked mouth and is abandoned if the mouth is lost or stays closed past the
+ * grace period; insert targets only follow moves bigger than the dead band; each phase ends on its timeout when the arm never
+ * reports; and abort() stops a feed.
+ */
+#include <opencv2/opencv.hpp>
+#include <string>
+#include "FeedingSequence.hpp"
+#include "TestSupport.hpp"
+using namespace cv;
+
+static const Point3d mouthPosition(5, 20, 25);
+
+static FeedingSequence::MouthObservation observe(const Point3d &position = mouthPosition, bool isOpen = true, bool tracked = true) {
+    FeedingSequence::MouthObservation mouth;
+    mouth.tracked = tracked;
+    mouth.position = position;
+    mouth.isOpen = isOpen;
+    return mouth;
+}
+
+static bool isAt(const Point3d &a, const Point3d &b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+/**
+ * Start a feed at time 0 and have the arm finish the scoop, so the sequence is inserting from time 1.
+ */
+static void startInserting(FeedingSequence &sequence) {
+    sequence.start(observe(), 0);
+    sequence.armArrived();
+    sequence.update(observe(), 1);
+}
+
+static void arrivalsAdvanceThePhases() {
+    FeedingSequence sequence;
+    FeedingSequence::ArmCommand command = sequence.start(observe(), 0);
+    CHECK(command.type == FeedingSequence::ScoopCommand && isAt(command.mouth, mouthPosition));
+    CHECK(sequence.getPhase() == FeedingSequence::Scooping);
+    CHECK(sequence.update(observe(), 1).type == FeedingSequence::NoCommand); // Still scooping
+    CHECK(sequence.start(observe(), 1).type == FeedingSequence::NoCommand); // Already running
+
+    sequence.armArrived();
+    command = sequence.update(observe(), 2);
+    CHECK(command.type == FeedingSequence::InsertCommand && isAt(command.mouth, mouthPosition));
+    CHECK(sequence.getPhase() == FeedingSequence::Inserting);
+    CHECK(sequence.update(observe(), 3).type == FeedingSequence::NoCommand);
+
+    sequence.armArrived();
+    command = sequence.update(observe(), 4);
+    CHECK(command.type == FeedingSequence::RetrieveCommand && isAt(command.mouth, mouthPosition));
+    CHECK(sequence.getPhase() == FeedingSequence::Retrieving);
+    CHECK(sequence.update(observe(), 5).type == FeedingSequence::NoCommand);
+
+    sequence.armArrived();
+    CHECK(sequence.update(observe(), 6).type == FeedingSequence::RestCommand);
+    CHECK(sequence.getPhase() == FeedingSequence::Idle);
+    CHECK(sequence.getStopReason().empty());
+    CHECK(sequence.update(observe(), 7).type == FeedingSequence::NoCommand);
+}
+
+static void doesNotStartWithoutATrack() {
+    FeedingSequence sequence;
+    CHECK(sequence.start(observe(mouthPosition, true, false), 0).type == FeedingSequence::RestCommand);
+    CHECK(sequence.getPhase() == FeedingSequence::Idle);
+    CHECK(!sequence.getStopReason().empty());
+    // A later start with the mouth in view goes ahead, and clears the reason.
+    CHECK(sequence.start(observe(), 1).type == FeedingSequence::ScoopCommand);
+    CHECK(sequence.getStopReason().empty());
+}
+
+static void abortsWhenTheMouthIsLost() {
+    FeedingSequence before;
+    before.start(observe(), 0);
+    before.armArrived();
+    CHECK(before.update(observe(mouthPosition, true, false), 1).type == FeedingSequence::RestCommand);
+    CHECK(before.getPhase() == FeedingSequence::Idle && !before.getStopReason().empty());
+
+    FeedingSequence during;
+    startInserting(during);
+    CHECK(during.update(observe(mouthPosition, true, false), 1.1).type == FeedingSequence::RestCommand);
+    CHECK(during.getPhase() == FeedingSequence::Idle && !during.getStopReason().empty());
+}
+
+static void abortsWhenTheMouthStaysClosed() {
+    FeedingSequence::Timing timing;
+    timing.closedGrace = 0.2;
+    FeedingSequence sequence(timing);
+    startInserting(sequence);
+    // A flicker shorter than the grace period is ridden out, and opening again starts the grace period over.
+    CHECK(sequence.update(observe(mouthPosition, false), 1.0).type == FeedingSequence::NoCommand);
+    CHECK(sequence.update(observe(mouthPosition, false), 1.15).type == FeedingSequence::NoCommand);
+    CHECK(sequence.update(observe(mouthPosition, true), 1.2).type == FeedingSequence::NoCommand);
+    CHECK(sequence.update(observe(mouthPosition, false), 1.3).type == FeedingSequence::NoCommand);
+    CHECK(sequence.update(observe(mouthPosition, false), 1.45).type == FeedingSequence::NoCommand);
+    CHECK(sequence.getPhase() == FeedingSequence::Inserting);
+    CHECK(sequence.update(observe(mouthPosition, false), 1.55).type == FeedingSequence::RestCommand);
+    CHECK(sequence.getPhase() == FeedingSequence::Idle && !sequence.getStopReason().empty());
+}
+
+static void targetFollowsMovesPastTheDeadBand() {
+    FeedingSequence sequence(FeedingSequence::Timing(), 0.5);
+    startInserting(sequence);
+    CHECK(sequence.update(observe(mouthPosition + Point3d(0.3, 0, 0)), 1.1).type == FeedingSequence::NoCommand);
+    Point3d moved = mouthPosition + Point3d(0, 0.6, 0);
+    FeedingSequence::ArmCommand command = sequence.update(observe(moved), 1.2);
+    CHECK(command.type == FeedingSequence::InsertCommand && isAt(command.mouth, moved));
+    // Arriving at an old target while the mouth has moved on sends the new one rather than retrieving.
+    sequence.armArrived();
+    Point3d movedAgain = moved + Point3d(0, 0, -0.8);
+    command = sequence.update(observe(movedAgain), 1.3);
+    CHECK(command.type == FeedingSequence::InsertCommand && isAt(command.mouth, movedAgain));
+    CHECK(sequence.getPhase() == FeedingSequence::Inserting);
+}
+
+static void phasesEndOnTheirTimeouts() {
+    FeedingSequence::Timing timing;
+    timing.scoopTimeout = 15;
+    timing.insertTimeout = 5;
+    timing.retrieveTimeout = 4;
+    FeedingSequence sequence(timing);
+    sequence.start(observe(), 0);
+    CHECK(sequence.update(observe(), 14.9).type == FeedingSequence::NoCommand);
+    CHECK(sequence.update(observe(), 15).type == FeedingSequence::InsertCommand);
+    CHECK(sequence.update(observe(), 19.9).type == FeedingSequence::NoCommand);
+    FeedingSequence::ArmCommand command = sequence.update(observe(mouthPosition + Point3d(0.1, 0, 0)), 20);
+    CHECK(command.type == FeedingSequence::RetrieveCommand && isAt(command.mouth, mouthPosition)); // Back out from where it went in
+    CHECK(sequence.update(observe(), 23.9).type == FeedingSequence::NoCommand);
+    CHECK(sequence.update(observe(), 24).type == FeedingSequence::RestCommand);
+    CHECK(sequence.getPhase() == FeedingSequence::Idle && sequence.getStopReason().empty());
+}
+
+static void abortStopsTheFeed() {
+    FeedingSequence sequence;
+    startInserting(sequence);
+    FeedingSequence::ArmCommand command = sequence.abort("Aborted by the user");
+    CHECK(command.type == FeedingSequence::RestCommand);
+    CHECK(sequence.getPhase() == FeedingSequence::Idle);
+    CHECK(sequence.getStopReason() == "Aborted by the user");
+    CHECK(sequence.update(observe(), 2).type == FeedingSequence::NoCommand);
+
+    // With no feed running there is nothing to have stopped.
+    CHECK(sequence.abort("Aborted by the user").type == FeedingSequence::RestCommand);
+    CHECK(sequence.getStopReason().empty());
+}
+
+int main() {
+    RUN_TEST(arrivalsAdvanceThePhases);
+    RUN_TEST(doesNotStartWithoutATrack);
+    RUN_TEST(abortsWhenTheMouthIsLost);
+    RUN_TEST(abortsWhenTheMouthStaysClosed);
+    RUN_TEST(targetFollowsMovesPastTheDeadBand);
+    RUN_TEST(phasesEndOnTheirTimeouts);
+    RUN_TEST(abortStopsTheFeed);
+    return testResult();
+}
@@ -0,0 +1,105 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks MouthMotionModel: it locks on to a mouth moving at constant velocity and predicts ahead along it, caps how far ahead
+ * it predicts, starts a new track after a gap or when time goes backwards, and lets low confidence positions move it less.
+ * Positions come 30 times a second, like the cameras'.
+ */
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include "MouthMotionModel.hpp"
+#include "TestSupport.hpp"
+using namespace cv;
+
+static const double framePeriod = 1/30.0;
+static const double startTime = 100;
+
+static bool isNear(const Point3d &a, const Point3d &b, double tolerance) {
+    return norm(a - b) <= tolerance;
+}
+
+/**
+ * Feed the model two seconds of a mouth moving at constant velocity.
+ * @return The time of the last position.
+ */
+static double feedConstantVelocity(MouthMotionModel &model, Point3d start, Point3d velocity) {
+    double elapsed = 0;
+    for(int i = 0; i <= 60; i++) {
+        elapsed = i*framePeriod;
+        model.update(start + velocity*elapsed, startTime + elapsed);
+    }
+    return startTime + elapsed;
+}
+
+static void convergesOnConstantVelocity() {
+    MouthMotionModel model;
+    Point3d start(1, -2, 60), velocity(3, -1.5, 6);
+    double last = feedConstantVelocity(model, start, velocity);
+    MouthMotionEstimate estimate = model.getEstimate(last);
+    CHECK(estimate.valid);
+    CHECK(estimate.timestamp == last);
+    CHECK(isNear(estimate.position, start + velocity*(last - startTime), 1e-3));
+    CHECK(isNear(estimate.velocity, velocity, 1e-3));
+    // Where the mouth will be when an arm command sent now arrives.
+    CHECK(isNear(estimate.predict(last + 0.2), start + velocity*(last + 0.2 - startTime), 1e-3));
+}
+
+static void leadIsCapped() {
+    MouthMotionModel model;
+    Point3d start(1, -2, 60), velocity(3, -1.5, 6);
+    double last = feedConstantVelocity(model, start, velocity);
+    MouthMotionEstimate estimate = model.getEstimate(last);
+    CHECK(isNear(estimate.predict(last + 2), estimate.position + estimate.velocity*0.5, 1e-9));
+    CHECK(isNear(estimate.predict(last + 2, 0.1), estimate.position + estimate.velocity*0.1, 1e-9));
+    CHECK(isNear(estimate.predict(last - 1), estimate.position, 1e-9)); // Never back in time
+}
+
+static void restartsAfterAGap() {
+    MouthMotionModel model;
+    double last = feedConstantVelocity(model, Point3d(1, -2, 60), Point3d(3, -1.5, 6));
+    CHECK(model.getEstimate(last + 0.9).valid);
+    CHECK(!model.getEstimate(last + 1.1).valid); // Lost once there has been nothing for over a second
+
+    Point3d elsewhere(-5, 4, 80);
+    model.update(elsewhere, last + 1.5);
+    MouthMotionEstimate estimate = model.getEstimate(last + 1.5);
+    CHECK(estimate.valid);
+    CHECK(isNear(estimate.position, elsewhere, 0));
+    CHECK(isNear(estimate.velocity, Point3d(0, 0, 0), 0));
+    CHECK(estimate.timestamp == last + 1.5);
+}
+
+static void restartsWhenTimeGoesBackwards() {
+    MouthMotionModel model;
+    double last = feedConstantVelocity(model, Point3d(1, -2, 60), Point3d(3, -1.5, 6));
+    Point3d earlier(2, 2, 70);
+    model.update(earlier, last - 0.5);
+    MouthMotionEstimate estimate = model.getEstimate(last - 0.5);
+    CHECK(isNear(estimate.position, earlier, 0));
+    CHECK(isNear(estimate.velocity, Point3d(0, 0, 0), 0));
+    CHECK(estimate.timestamp == last - 0.5);
+}
+
+static void lowConfidenceMovesTheEstimateLess() {
+    // The mouth sits still for two seconds, then one position 10 units to the side arrives.
+    double jump[2];
+    double confidences[2] = {1.0, 0.1};
+    for(int i = 0; i < 2; i++) {
+        MouthMotionModel model;
+        double last = feedConstantVelocity(model, Point3d(0, 0, 60), Point3d(0, 0, 0));
+        model.update(Point3d(10, 0, 60), last + framePeriod, confidences[i]);
+        jump[i] = model.getEstimate(last + framePeriod).position.x;
+    }
+    CHECK(jump[0] > 1);
+    CHECK(jump[1] > 0 && jump[1] < jump[0]/10);
+}
+
+int main() {
+    RUN_TEST(convergesOnConstantVelocity);
+    RUN_TEST(leadIsCapped);
+    RUN_TEST(restartsAfterAGap);
+    RUN_TEST(restartsWhenTimeGoesBackwards);
+    RUN_TEST(lowConfidenceMovesTheEstimateLess);
+    return testResult();
+}
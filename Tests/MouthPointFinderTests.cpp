@@ -0,0 +1,88 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks that MouthPointFinder keeps its pixel buffers from frame to frame: once the first frame of a size has been through
+ * detectMouthCentre, later frames of that size must not reallocate any of them.
+ *
+ * Frames with no face in them cover the grayscale frame and the face search image. Frames with the photograph of a face given
+ * on the command line (MouthPointFinderTests FACE_IMAGE; ctest passes Tests/Fixtures/face.jpg) also cover the mouth patch and
+ * edges. Leaving the photograph out is a failure rather than a skip, so the mouth buffers are never silently left unchecked.
+ */
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include "MouthPointFinder.hpp"
+#include "ResourceLocator.hpp"
+#include "TestSupport.hpp"
+using namespace cv;
+
+#ifndef IGFS_RESOURCE_DIR
+#define IGFS_RESOURCE_DIR "."
+#endif
+
+static DirectoryResourceLocator resources(IGFS_RESOURCE_DIR);
+
+/**
+ * A dark frame with a bright bar at a position that depends on index, so every frame has different pixels.
+ */
+static void drawBar(int index, Mat &frame) {
+    frame.setTo(Scalar(40, 40, 40));
+    int x = index*37 % (frame.cols - 32);
+    rectangle(frame, cv::Point(x, 0), cv::Point(x + 32, frame.rows - 1), Scalar(220, 220, 220), CV_FILLED);
+}
+
+static void buffersAreReusedWithoutAFace() {
+    MouthPointFinder finder(&resources);
+    Mat frame(480, 640, CV_8UC3);
+    Point2d centre;
+    bool isOpen;
+    drawBar(0, frame);
+    finder.detectMouthCentre(frame, centre, isOpen);
+    std::vector<const uchar*> first, later;
+    finder.getWorkspaceBuffers(first);
+    CHECK(first[0] != 0); // The grayscale frame
+    CHECK(first[1] != 0); // The face search image
+    for(int i = 1; i < 20; i++) {
+        drawBar(i, frame);
+        finder.detectMouthCentre(frame, centre, isOpen);
+        finder.getWorkspaceBuffers(later);
+        CHECK(later == first);
+    }
+}
+
+static void buffersAreReusedWithAFace(const std::string &fileName) {
+    Mat face = imread(fileName, CV_LOAD_IMAGE_COLOR);
+    CHECK(!face.empty());
+    if(face.empty())
+        return;
+    Mat frame(face.rows*2, face.cols*2, CV_8UC3, Scalar(90, 90, 90));
+    face.copyTo(frame(cv::Rect(face.cols/2, face.rows/2, face.cols, face.rows)));
+    MouthPointFinder finder(&resources);
+    finder.setTracking(true, 1000); // No periodic full searches, so every frame after the first searches the same region
+    Point2d centre;
+    bool isOpen = false;
+    Mat annotated;
+    for(int i = 0; i < 3; i++) { // The first full search, then the track settles
+        frame.copyTo(annotated);
+        CHECK(finder.detectMouthCentre(annotated, centre, isOpen));
+    }
+    std::vector<const uchar*> first, later;
+    finder.getWorkspaceBuffers(first);
+    for(size_t i = 0; i < first.size(); i++)
+        CHECK(first[i] != 0);
+    for(int i = 0; i < 20; i++) {
+        frame.copyTo(annotated);
+        finder.detectMouthCentre(annotated, centre, isOpen);
+        finder.getWorkspaceBuffers(later);
+        CHECK(later == first);
+    }
+}
+
+int main(int argc, char **argv) {
+    RUN_TEST(buffersAreReusedWithoutAFace);
+    std::cerr << "buffersAreReusedWithAFace" << std::endl;
+    CHECK(argc > 1); // The photograph of a face
+    if(argc > 1)
+        buffersAreReusedWithAFace(argv[1]);
+    return testResult();
+}
@@ -0,0 +1,136 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks the pooled capture path: StereoFramePool hands a buffer out again only once every handle to it has been released,
+ * and keeps its pixels when it does; StereoFrameGrabber drops frames, rather than reusing a buffer, while consumers hold
+ * every one; and under skew the grabber only pairs frames grabbed close enough together and pairs each right frame at most
+ * once. The grabber runs on SyntheticFrameSources that write each frame's index into its first pixels.
+ */
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include "StereoFramePool.hpp"
+#include "StereoFrameGrabber.hpp"
+#include "FrameSource.hpp"
+#include "Trace.hpp"
+#include "TestSupport.hpp"
+using namespace cv;
+
+static const cv::Size testFrameSize(64, 48);
+
+static void writeIndex(unsigned long frameIndex, Mat &frame) {
+    memset(frame.data, 0, frame.total()*frame.elemSize());
+    memcpy(frame.data, &frameIndex, sizeof(frameIndex));
+}
+
+static unsigned long readIndex(const Mat &frame) {
+    unsigned long frameIndex;
+    memcpy(&frameIndex, frame.data, sizeof(frameIndex));
+    return frameIndex;
+}
+
+/**
+ * A SyntheticFrameSource that takes a while to grab each frame, like a camera running at a lower rate.
+ */
+class SlowFrameSource: public SyntheticFrameSource
+{
+    double grabSeconds;
+public:
+    SlowFrameSource(double seconds): SyntheticFrameSource(testFrameSize, writeIndex), grabSeconds(seconds) {}
+    bool grab() {
+        std::this_thread::sleep_for(std::chrono::duration<double>(grabSeconds));
+        return SyntheticFrameSource::grab();
+    }
+};
+
+static void buffersAreReusedOnlyWhenReleased() {
+    StereoFramePool pool(2, testFrameSize);
+    std::shared_ptr<StereoFramePair> first = pool.acquire(), second = pool.acquire();
+    CHECK(first && second && first != second);
+    CHECK(!pool.acquire());
+    CHECK(pool.available() == 0);
+    const uchar *pixels = first->left.data;
+
+    // A read-only handle keeps the buffer in use after the writer lets go of it.
+    StereoFrameHandle shared = first;
+    StereoFramePair *buffer = first.get();
+    first.reset();
+    CHECK(!pool.acquire());
+    shared.reset();
+    CHECK(pool.available() == 1);
+
+    std::shared_ptr<StereoFramePair> again = pool.acquire();
+    CHECK(again.get() == buffer);
+    CHECK(again && again->left.data == pixels); // Reused, not reallocated
+    CHECK(again && again.use_count() == 2); // The pool's handle and ours
+}
+
+static void framesAreDroppedWhileConsumersHoldEveryBuffer() {
+    SyntheticFrameSource left(testFrameSize, writeIndex), right(testFrameSize, writeIndex);
+    const unsigned pairBuffers = 4;
+    StereoFrameGrabber grabber(&left, &right, 0.040, 0.002, pairBuffers);
+#ifndef IGFS_DISABLE_TRACING
+    unsigned long exhaustionsBefore = Trace::counters().framePoolExhaustions;
+#endif
+    grabber.start();
+    std::vector<std::shared_ptr<StereoFramePair> > held;
+    double end = StereoFrameGrabber::now() + 0.5;
+    while(StereoFrameGrabber::now() < end) {
+        std::shared_ptr<StereoFramePair> pair;
+        if(grabber.waitForPair(0.01) && grabber.takeLatestPair(pair))
+            held.push_back(pair);
+    }
+    // Every buffer the grabber gave out is held, so no buffer can have been filled twice.
+    CHECK(held.size() <= pairBuffers);
+    for(size_t i = 0; i < held.size(); i++)
+        for(size_t j = i + 1; j < held.size(); j++)
+            CHECK(held[i] != held[j] && held[i]->sequenceNumber < held[j]->sequenceNumber);
+#ifndef IGFS_DISABLE_TRACING
+    CHECK(Trace::counters().framePoolExhaustions > exhaustionsBefore);
+#endif
+
+    // Letting go of them lets frames through again.
+    held.clear();
+    std::shared_ptr<StereoFramePair> pair;
+    bool resumed = false;
+    end = StereoFrameGrabber::now() + 0.5;
+    while(!resumed && StereoFrameGrabber::now() < end)
+        resumed = grabber.waitForPair(0.01) && grabber.takeLatestPair(pair);
+    CHECK(resumed);
+    grabber.stop();
+}
+
+static void rightFramesArePairedOnceWithinTheSkew() {
+    // The right camera runs at a third of the left one's rate, so most left frames have no right frame of their own.
+    SlowFrameSource left(0.010), right(0.030);
+    const double maxSkew = 0.015;
+    StereoFrameGrabber grabber(&left, &right, maxSkew);
+    grabber.start();
+    unsigned long pairs = 0, lastRightIndex = 0;
+    bool first = true;
+    double end = StereoFrameGrabber::now() + 1;
+    while(StereoFrameGrabber::now() < end) {
+        std::shared_ptr<StereoFramePair> pair;
+        if(!grabber.waitForPair(0.05) || !grabber.takeLatestPair(pair))
+            continue;
+        pairs++;
+        CHECK(fabs(pair->leftTimestamp - pair->rightTimestamp) <= maxSkew);
+        unsigned long rightIndex = readIndex(pair->right);
+        CHECK(first || rightIndex > lastRightIndex); // A right frame is never paired with a second left frame
+        lastRightIndex = rightIndex;
+        first = false;
+    }
+    grabber.stop();
+    CHECK(pairs > 5);
+    CHECK(pairs <= lastRightIndex + 1); // No more pairs than right frames
+}
+
+int main() {
+    RUN_TEST(buffersAreReusedOnlyWhenReleased);
+    RUN_TEST(framesAreDroppedWhileConsumersHoldEveryBuffer);
+    RUN_TEST(rightFramesArePairedOnceWithinTheSkew);
+    return testResult();
+}
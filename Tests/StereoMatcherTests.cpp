@@ -0,0 +1,63 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks that StereoMatcher::triangulateRectifiedPoints, which pushes each disparity through Q, puts matching rectified points
+ * where triangulateSinglePoint's linear triangulation does, with the bundled calibration at the size it was made at. The
+ * correspondences are on the same rectified row with disparities across the depths the feeding system works at, plus a
+ * sub-pixel one.
+ */
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include "StereoMatcher.hpp"
+#include "ResourceLocator.hpp"
+#include "TestSupport.hpp"
+using namespace cv;
+
+#ifndef IGFS_RESOURCE_DIR
+#define IGFS_RESOURCE_DIR "."
+#endif
+
+static DirectoryResourceLocator resources(IGFS_RESOURCE_DIR);
+
+static bool isClose(const Point3d &a, const Point3d &b) {
+    return norm(a - b) <= 1e-6*std::max(1.0, norm(b));
+}
+
+static void batchMatchesSinglePoints() {
+    StereoMatcher matcher("Resources/intrinsic.yml", "Resources/extrinsic.yml", cv::Size(1600, 1200), "", &resources);
+    // Left x, y and the disparity to the right view. The bundled calibration has the second camera to the right of the
+    // first, so disparities in front of the cameras are negative.
+    const double correspondences[][3] = {{800, 600, -124}, {300, 200, -60}, {1400, 1000, -200}, {812.5, 611.25, -87.75}};
+    const size_t count = sizeof(correspondences)/sizeof(correspondences[0]);
+    RectifiedPointBatch batch;
+    for(size_t i = 0; i < count; i++) {
+        Point2d left(correspondences[i][0], correspondences[i][1]);
+        batch.push_back(left, left - Point2d(correspondences[i][2], 0));
+    }
+    PointBatch3d batchPoints;
+    matcher.triangulateRectifiedPoints(batch, batchPoints);
+    CHECK(batchPoints.size() == count);
+    for(size_t i = 0; i < count && i < batchPoints.size(); i++) {
+        Point3d single;
+        matcher.triangulateSinglePoint(Point2d(batch.leftX[i], batch.leftY[i]), Point2d(batch.rightX[i], batch.rightY[i]), single);
+        CHECK(single.z > 0);
+        CHECK(isClose(batchPoints.at(i), single));
+    }
+
+    // A second batch of the same size goes into the same storage.
+    const double *storage = &batchPoints.z[0];
+    matcher.triangulateRectifiedPoints(batch, batchPoints);
+    CHECK(&batchPoints.z[0] == storage);
+
+    // A pair with no disparity is at infinity.
+    batch.clear();
+    batch.push_back(Point2d(800, 600), Point2d(800, 600));
+    matcher.triangulateRectifiedPoints(batch, batchPoints);
+    CHECK(batchPoints.size() == 1 && std::isinf(batchPoints.z[0]));
+}
+
+int main() {
+    RUN_TEST(batchMatchesSinglePoints);
+    return testResult();
+}
@@ -0,0 +1,35 @@
+/**
+ * @file
+ * @section Description
+ *
+ * The little the tests need: CHECK records a failed condition with where it was and carries on, so one run reports every
+ * failure, and RUN_TEST runs a test function and names it. A test's main returns testResult(), which is non-zero if any
+ * check failed, so ctest sees the failure.
+ */
+#ifndef TEST_SUPPORT_HPP
+#define TEST_SUPPORT_HPP
+
+#include <iostream>
+
+inline int &testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+inline void checkCondition(bool passed, const char *condition, const char *file, int line) {
+    if(passed)
+        return;
+    std::cerr << file << ":" << line << ": check failed: " << condition << std::endl;
+    testFailures()++;
+}
+
+inline int testResult() {
+    if(testFailures() > 0)
+        std::cerr << testFailures() << " check(s) failed" << std::endl;
+    return testFailures() > 0 ? 1 : 0;
+}
+
+#define CHECK(condition) checkCondition((condition), #condition, __FILE__, __LINE__)
+#define RUN_TEST(test) do { std::cerr << #test << std::endl; test(); } while(0)
+
+#endif
@@ -0,0 +1,39 @@
+/**
+ * @file
+ * @section Description
+ *
+ * Checks that Trace keeps the events of threads that have ended, and only as many of them as one ring holds, however many
+ * threads come and go.
+ */
+#include <thread>
+#include <vector>
+#include "Trace.hpp"
+#include "TestSupport.hpp"
+
+static void endedThreadsKeepTheirNewestEvents() {
+    for(int thread = 0; thread < 200; thread++) {
+        std::thread([] {
+            for(int i = 0; i < 100; i++) {
+                TRACE_SCOPE("work");
+            }
+        }).join();
+    }
+    {
+        TRACE_SCOPE("main");
+    }
+    std::vector<Trace::Event> events;
+    std::vector<unsigned> threads;
+    Trace::Registry::instance().snapshot(events, threads);
+    CHECK(events.size() == Trace::ThreadRing::capacity + 1);
+    CHECK(threads.size() == events.size());
+    if(events.size() < 2)
+        return;
+    CHECK(threads[events.size() - 2] == 200); // The last thread to end
+    CHECK(threads.back() == 201); // The main thread, still running
+    CHECK(events.front().end <= events[events.size() - 2].end); // Oldest first
+}
+
+int main() {
+    RUN_TEST(endedThreadsKeepTheirNewestEvents);
+    return testResult();
+}